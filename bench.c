@@ -0,0 +1,197 @@
+/**
+ * Throughput and latency regression gate for LOG()
+ *
+ * Runs a fixed workload (LOGI calls spread across threads) against each
+ * target, reports calls/s and p99 per-call latency, and compares them with
+ * a stored baseline: the run fails when throughput drops or p99 latency
+ * rises by more than the tolerance. Each workload is repeated and the best
+ * run kept, so a noisy neighbour does not fail the gate.
+ *
+ * Usage: bench [-n calls] [-j threads] [-r runs] [-t tolerance%] [-b baseline] [-w]
+ *   -w rewrites the baseline file with this run's results
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#define  LOGTEE_UNIQUE_STATE
+#include "logtee.h"
+
+// Log-linear latency histogram: 32 sub-buckets per power of two nanoseconds
+#define SUBBITS  5
+#define NBUCKETS (64 << SUBBITS)
+
+struct hist {
+	unsigned long long count[NBUCKETS];
+};
+
+static unsigned bucket(unsigned long long ns) {
+	if (ns < (1u << SUBBITS))
+		return ns;
+	unsigned msb = 63 - __builtin_clzll(ns);
+	return ((msb - SUBBITS + 1) << SUBBITS) | ((ns >> (msb - SUBBITS)) & ((1u << SUBBITS) - 1));
+}
+
+static unsigned long long bucketfloor(unsigned b) {
+	if (b < (1u << SUBBITS))
+		return b;
+	unsigned msb = (b >> SUBBITS) + SUBBITS - 1;
+	return (1ull << msb) | ((unsigned long long)(b & ((1u << SUBBITS) - 1)) << (msb - SUBBITS));
+}
+
+static unsigned long long nsnow() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static long ncalls = 10000000;
+static int nthreads = 8, nruns = 3;
+static pthread_barrier_t start;
+
+static void *worker(void *arg) {
+	struct hist *h = arg;
+	long n = ncalls / nthreads;
+	pthread_barrier_wait(&start);
+	for (long i = 0; i < n; ++i) {
+		unsigned long long t0 = nsnow();
+		LOGI("worker line %ld: %s\n", i, "lorem ipsum dolor sit amet");
+		h->count[bucket(nsnow() - t0)]++;
+	}
+	return NULL;
+}
+
+struct result {
+	const char *name;
+	double rate;              // calls per second
+	unsigned long long p99;   // nanoseconds
+};
+
+static int run(const char *path, struct result *r) {
+	struct hist *hists = calloc(nthreads, sizeof(*hists));
+	pthread_t *threads = calloc(nthreads, sizeof(*threads));
+	if (hists == NULL || threads == NULL) {
+		perror("calloc");
+		return -1;
+	}
+
+	LOG_reset();
+	LOG_teepath(path, 0);
+	pthread_barrier_init(&start, NULL, nthreads + 1);
+	for (int i = 0; i < nthreads; ++i)
+		pthread_create(threads + i, NULL, worker, hists + i);
+	unsigned long long t0 = nsnow();
+	pthread_barrier_wait(&start);
+	for (int i = 0; i < nthreads; ++i)
+		pthread_join(threads[i], NULL);
+	unsigned long long elapsed = nsnow() - t0;
+	pthread_barrier_destroy(&start);
+	LOG_reset();
+
+	unsigned long long total = 0, seen = 0;
+	for (int i = 0; i < nthreads; ++i)
+		for (unsigned b = 0; b < NBUCKETS; ++b)
+			total += hists[i].count[b];
+	r->p99 = 0;
+	for (unsigned b = 0; b < NBUCKETS && seen * 100 < total * 99; ++b) {
+		for (int i = 0; i < nthreads; ++i)
+			seen += hists[i].count[b];
+		r->p99 = bucketfloor(b);
+	}
+	r->rate = total * 1e9 / elapsed;
+	free(hists);
+	free(threads);
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	const char *baseline = "bench.baseline";
+	double tolerance = 25;
+	int write = 0, opt;
+	while ((opt = getopt(argc, argv, "n:j:r:t:b:w")) != -1) {
+		switch (opt) {
+			case 'n': ncalls = atol(optarg); break;
+			case 'j': nthreads = atoi(optarg); break;
+			case 'r': nruns = atoi(optarg); break;
+			case 't': tolerance = atof(optarg); break;
+			case 'b': baseline = optarg; break;
+			case 'w': write = 1; break;
+			default:
+				fprintf(stderr, "usage: %s [-n calls] [-j threads] [-r runs] [-t tolerance%%] [-b baseline] [-w]\n", argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+	if (nthreads < 1 || nruns < 1 || ncalls < nthreads) {
+		fprintf(stderr, "%s: need at least one run and one call per thread\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	char tmpfs[64];
+	snprintf(tmpfs, sizeof tmpfs, "/dev/shm/logtee-bench-%d.log", getpid());
+	struct result results[] = { { "devnull", 0, 0 }, { "tmpfs", 0, 0 } };
+	const char *paths[] = { "/dev/null", tmpfs };
+	for (size_t i = 0; i < sizeof results / sizeof *results; ++i) {
+		for (int k = 0; k < nruns; ++k) {
+			struct result r = results[i];
+			int rc = run(paths[i], &r);
+			unlink(tmpfs);
+			if (rc == -1)
+				return EXIT_FAILURE;
+			if (k == 0 || r.rate > results[i].rate)
+				results[i].rate = r.rate;
+			if (k == 0 || r.p99 < results[i].p99)
+				results[i].p99 = r.p99;
+		}
+		printf("%-8s %12.0f calls/s  p99 %8llu ns  (%ld calls, %d threads, best of %d)\n",
+				results[i].name, results[i].rate, results[i].p99, ncalls, nthreads, nruns);
+	}
+
+	if (write) {
+		FILE *fp = fopen(baseline, "w");
+		if (fp == NULL) {
+			perror(baseline);
+			return EXIT_FAILURE;
+		}
+		fprintf(fp, "# name calls/s p99-ns (%ld calls, %d threads)\n", ncalls, nthreads);
+		for (size_t i = 0; i < sizeof results / sizeof *results; ++i)
+			fprintf(fp, "%s %.0f %llu\n", results[i].name, results[i].rate, results[i].p99);
+		fclose(fp);
+		printf("baseline written to %s\n", baseline);
+		return EXIT_SUCCESS;
+	}
+
+	FILE *fp = fopen(baseline, "r");
+	if (fp == NULL) {
+		perror(baseline);
+		return EXIT_FAILURE;
+	}
+	int failed = 0;
+	char line[256], name[64];
+	double rate;
+	unsigned long long p99;
+	while (fgets(line, sizeof line, fp) != NULL) {
+		if (*line == '#' || sscanf(line, "%63s %lf %llu", name, &rate, &p99) != 3)
+			continue;
+		for (size_t i = 0; i < sizeof results / sizeof *results; ++i) {
+			if (strcmp(name, results[i].name) != 0)
+				continue;
+			if (results[i].rate < rate * (1 - tolerance / 100)) {
+				printf("FAIL: %s throughput %.0f calls/s, baseline %.0f (-%.0f%% allowed)\n",
+						name, results[i].rate, rate, tolerance);
+				failed = 1;
+			}
+			if (results[i].p99 > p99 * (1 + tolerance / 100)) {
+				printf("FAIL: %s p99 latency %llu ns, baseline %llu (+%.0f%% allowed)\n",
+						name, results[i].p99, p99, tolerance);
+				failed = 1;
+			}
+		}
+	}
+	fclose(fp);
+	if (!failed)
+		printf("bench: ok, within %.0f%% of %s\n", tolerance, baseline);
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
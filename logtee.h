@@ -12,8 +12,31 @@
  * Any number of log targets can be specified in a `Tee' with LOG_teepath()
  * and LOG_teefile(FILE*). Output within the Tee is unordered.
  *
+ * LOG_teebinary() targets get a compact binary encoding instead of text:
+ * level prefixes, callback prefixes, call sites and format strings are sent
+ * once per segment in a dictionary and referenced by id, with only the
+ * rendered arguments of each conversion stored per line. Segments restart
+ * the dictionary so each one decodes on its own (LOG_binnext(), logtool).
+ *
+ * LOG_teeshm() targets need no FILE*: lines go to a shared memory ring
+ * that local readers follow without ever holding up the writer.
+ * LOG_teecircular() keeps the same ring in a fixed-size file, and
+ * LOG_teememory() in memory for the process itself to query.
+ *
+ * LOG_teemetrics() counts lines per level and call site instead of
+ * writing them; LOG_metricsdump() exports the counters.
+ *
  * LOG_reset() removes all logging targets (in which case logging is a no-op)
  *
+ * All entry points are thread-safe: lines are formatted in a per-thread
+ * buffer and written to the Tee under a process-wide mutex, so a line is
+ * never interleaved with another. The prefix callback runs under that
+ * mutex and must not log itself.
+ *
+ * LOG_async() moves the writes to a background thread: callers only format
+ * and queue, and Error lines have their own lane that is written first.
+ * LOG_batch() hands over many formatted lines at once, written together.
+ *
  * Comes with predefined log levels and each log target has a setting that
  * controls the minimum priority levels for output to make it into the log.
  * Levels (-Infinity,+Infinity) proceded with increasing numbers denoting
@@ -22,9 +45,15 @@
  * Predefined loging priorities with appropriate prefixes and behavior are
  * implemented in terms of levels.
  *
- * Levels can be extended.
+ * Levels can be extended. The predefined ones get their prefix at compile
+ * time, unless LOG_addlevel() replaced it.
+ *
+ * Callback can be set to provide a prefix to each line (such as timestamps,
+ * for which LOG_now() is a nanosecond wall clock that costs a TSC read)
  *
- * Callback can be set to provide a prefix to each line (such as timestamps)
+ * The LOGX() macros record their call site (__FILE__, __LINE__) as
+ * LOG_at() does; LOG_profile(1) accumulates per-site cost that LOG_fornerds()
+ * and LOG_profiledump() report, most expensive first.
  *
  * LOG() is the workhorse of the library but is normally abstracted from in
  * user code with wrappers with predefined semantics. LOGW(char*,...) marks
@@ -38,6 +67,9 @@
  */
 
 #pragma once
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // clocks, O_CLOEXEC and syscall() under -std=c99
+#endif
 #include <errno.h>
 #include <stdarg.h>
 #include <stdlib.h>
@@ -45,6 +77,52 @@
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
+#include <stddef.h>
+#include <wchar.h>
+#include <inttypes.h>
+#if defined(__GLIBC__)
+# include <execinfo.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+# include <cpuid.h>
+#endif
+#if defined(__linux__)
+# include <sys/syscall.h>
+# include <sys/inotify.h>
+# include <poll.h>
+#endif
+
+/**
+ * USDT probes for perf/bpftrace (provider "logtee"), compiled out without
+ * <sys/sdt.h> or with LOGTEE_NO_SDT. A probe site is a single nop until a
+ * tracer attaches, e.g.
+ *   bpftrace -e 'usdt:./app:logtee:write_error { printf("%d\n", arg2); }'
+ *
+ *   enqueue(level, bytes)              line accepted by the gate and formatted
+ *   drop(level, bytes)                 line lost (no memory)
+ *   flush_start(level, bytes)          before writing a line to the Tee
+ *   flush_end(level, bytes, ntargets)  after, with the number of targets written
+ *   write_error(level, bytes, target)  fprintf/fflush failed on target #target
+ *   rotate(level, bytes, target)       target wrapped or was rotated
+ */
+#if !defined(LOGTEE_NO_SDT) && defined(__has_include)
+# if __has_include(<sys/sdt.h>)
+#  include <sys/sdt.h>
+#  define _LOG_PROBE2(name, a, b)    DTRACE_PROBE2(logtee, name, a, b)
+#  define _LOG_PROBE3(name, a, b, c) DTRACE_PROBE3(logtee, name, a, b, c)
+# endif
+#endif
+#if !defined(_LOG_PROBE2)
+# define _LOG_PROBE2(name, a, b)    do { (void)(a); (void)(b); } while (0)
+# define _LOG_PROBE3(name, a, b, c) do { (void)(a); (void)(b); (void)(c); } while (0)
+#endif
 
 #if defined(__cplusplus)
 extern "C" {
@@ -56,31 +134,76 @@ extern "C" {
 # define	USTATE(T,id,...) extern T id;
 #endif
 
+	enum { _LOG_TEXT, _LOG_BINARY, _LOG_RING, _LOG_METRICS };
+
 	struct _l_fplist {
-		FILE                    *fp;
+		FILE                    *fp;    // NULL for _LOG_RING and _LOG_METRICS
 		int                     level;
+		int                     kind;
+		struct _l_bintee        *bin;   // _LOG_BINARY encoder state
+		struct _l_ring          *ring;  // _LOG_RING broadcast ring
+		unsigned                fails;  // consecutive write errors
+		int                     err;    // errno of the last one
+		uint64_t                errors; // write errors in total
+		uint64_t                retry;  // paused until (_LOG_nsnow()), 0 when closed
+		uint64_t                backoff;// ns, the last pause
 		struct _l_fplist        *next;
 	}; USTATE(struct _l_fplist, _fplist, {
 			.fp = NULL,
 			.level = 0,
+			.kind = _LOG_TEXT,
+			.bin = NULL,
+			.ring = NULL,
 			.next = NULL,
 			});
+	USTATE(int, _LOG_nbinary, 0);
 
 	struct _l_loglevel {
 		int level;
 		const char *prefix;
 	}; USTATE(struct _l_loglevel, *_loglevels, NULL);
 
+	// default formats reminiscent of Xorg logs...
+#	define _LOG_PREFIX_D "(DD): "
+#	define _LOG_PREFIX_I "(II): "
+#	define _LOG_PREFIX_W "(WW): "
+#	define _LOG_PREFIX_E "(EE): "
+#	define _LOG_PREFIX_F "(FF): "
 	USTATE(const struct _l_loglevel, _builtin_levels[5], {
-			// default formats reminiscent of Xorg logs...
-			{ -1, "(DD): " }, /* Debug   */
-			{ 0, "(II): " },  /* Info    */
-			{ 1, "(WW): " },  /* Warning */
-			{ 2, "(EE): " },  /* Error   */
-			{ 3, "(FF): " },  /* Fatal   */
+			{ -1, _LOG_PREFIX_D }, /* Debug   */
+			{ 0, _LOG_PREFIX_I },  /* Info    */
+			{ 1, _LOG_PREFIX_W },  /* Warning */
+			{ 2, _LOG_PREFIX_E },  /* Error   */
+			{ 3, _LOG_PREFIX_F },  /* Fatal   */
 			});
 
 	USTATE(size_t, _numlevels, 0);
+	USTATE(int, _LOG_prefixover, 0); // LOG_addlevel() replaced a builtin prefix
+
+	// Builtin prefix of level, NULL if none
+	static const char *_LOG_builtinprefix(int level) {
+		switch (level) {
+			case -1: return _LOG_PREFIX_D;
+			case 0: return _LOG_PREFIX_I;
+			case 1: return _LOG_PREFIX_W;
+			case 2: return _LOG_PREFIX_E;
+			case 3: return _LOG_PREFIX_F;
+			default: return NULL;
+		}
+	}
+
+	// Guards the Tee, the levels and the callback; held while writing a line
+	USTATE(pthread_mutex_t, _LOG_mtx, PTHREAD_MUTEX_INITIALIZER);
+	USTATE(pthread_once_t, _LOG_once, PTHREAD_ONCE_INIT);
+	USTATE(pthread_key_t, _LOG_tlskey, 0);
+
+	// Lowest threshold among the tees: lines below it are discarded before
+	// formatting (INT_MAX while there are no targets)
+	USTATE(int, _LOG_minlevel, INT_MAX);
+
+	// Per-thread threshold override, see LOG_threadlevel()
+#	define LOG_THREADLEVEL_NONE INT_MAX
+	USTATE(__thread int, _LOG_tlevel, LOG_THREADLEVEL_NONE);
 
 	// Called at each invocation of LOG() and its output prepended to the line
 	typedef const char *(*_prefix_callback_t)();
@@ -90,162 +213,3893 @@ extern "C" {
 #         define LINE_MAX               2048
 #       endif
 
-#	define LOGD(fmt,...) LOG(-1, fmt, ##__VA_ARGS__)
-#       define LOGI(fmt,...) LOG(0, fmt, ##__VA_ARGS__)
-#       define LOGW(fmt,...) LOG(1, fmt, ##__VA_ARGS__)
-#       define LOGE(fmt,...) LOG(2, fmt, ##__VA_ARGS__)
-#       define LOGF(fmt,...) (void)(LOG(3, fmt, ##__VA_ARGS__), exit(EXIT_FAILURE))
+#       if !defined(LOGTEE_BT_DEPTH)
+#         define LOGTEE_BT_DEPTH        16
+#       endif
+
+	// Lines at or above this level get a backtrace appended (INT_MAX: never)
+	USTATE(int, _LOG_btlevel, INT_MAX);
+
+	// Executable mappings, so return addresses can be printed as
+	// module+offset for offline symbolization (addr2line -e module offset)
+	struct _l_btmodule {
+		uintptr_t start, end, bias;
+		char *path;
+	}; USTATE(struct _l_btmodule, *_LOG_btmodules, NULL);
+	USTATE(size_t, _LOG_btnmodules, 0);
+
+#       if !defined(LOGTEE_PROFILE_SITES)
+#         define LOGTEE_PROFILE_SITES   1024 /* per thread, power of two */
+#       endif
+
+	// Per call site cost, see LOG_profile()
+	struct LOG_site {
+		const char *file;
+		int line, level;
+		unsigned long long calls;     // LOG() invocations, gated or not
+		unsigned long long accepted;  // lines that passed the gate
+		unsigned long long bytes;     // bytes written, over all targets
+		unsigned long long ns;        // time spent formatting
+	};
+
+	// Owned and updated by one thread, read by LOG_profiledump()
+	struct _l_sitetab {
+		struct _l_sitetab *next;
+		struct LOG_site other;        // sites that didn't fit
+		struct LOG_site sites[LOGTEE_PROFILE_SITES];
+	};
+	USTATE(int, _LOG_profiling, 0);
+	USTATE(struct _l_sitetab *, _LOG_sitetabs, NULL);  // live threads
+	USTATE(struct _l_sitetab *, _LOG_retired, NULL);   // merged at thread exit
+
+#       if !defined(LOGTEE_METRIC_SITES)
+#         define LOGTEE_METRIC_SITES    1024
+#       endif
+#       if !defined(LOGTEE_METRIC_FIELDS)
+#         define LOGTEE_METRIC_FIELDS   16
+#       endif
+
+	/*
+	 * Metrics target state, see LOG_teemetrics(). Updated by the logging
+	 * threads with atomic adds and read, both without the mutex, so neither
+	 * counting nor exporting holds up logging. Counters live as long as the
+	 * process, like the dashboards'.
+	 */
+	struct _l_field {
+		const char *name, *fmt;       // value of conversion #arg of fmt
+		int arg;
+		unsigned long long count;
+		double sum, min, max;
+	};
+	struct _l_metrics {
+		struct _l_levelcount {
+			int level, used;          // used: 0 free, 1 being claimed, 2 set
+			unsigned long long lines, bytes;
+		} levels[32];
+		struct _l_sitecount {
+			const char *file;         // a copy, keyed by contents
+			int line, level, used;    // like _l_levelcount's
+			unsigned long long lines;
+		} sites[LOGTEE_METRIC_SITES], other;
+		struct _l_field fields[LOGTEE_METRIC_FIELDS];
+	};
+	USTATE(struct _l_metrics *, _LOG_metrics, NULL);
+	USTATE(int, _LOG_nfields, 0);
+	USTATE(int, _LOG_metricslevel, INT_MAX); // of the metrics tee, INT_MAX: none
+
+#       if !defined(LOGTEE_BIN_MAXARGS)
+#         define LOGTEE_BIN_MAXARGS     32
+#       endif
+#       if !defined(LOGTEE_DICT_SIZE)
+#         define LOGTEE_DICT_SIZE       1024    /* dictionary entries per segment */
+#       endif
+#       if !defined(LOGTEE_SEGMENT_SIZE)
+#         define LOGTEE_SEGMENT_SIZE    (1 << 20)
+#       endif
+
+	// A line split into the renderings of its conversions, for binary targets
+	struct _l_binargs {
+		int nargs;                      // -1: send the rendered line instead
+		uint64_t ts;                    // _LOG_ticks(), converted when written
+		int cpu;                        // where ts was read, -1 if unknown
+		const char *arg[LOGTEE_BIN_MAXARGS];
+		size_t len[LOGTEE_BIN_MAXARGS];
+		char buf[LINE_MAX];
+	};
+
+#       if !defined(LOGTEE_CONTEXT_LINE)
+#         define LOGTEE_CONTEXT_LINE    256     /* bytes kept of each context line */
+#       endif
+#       if !defined(LOGTEE_CONTEXT_STR)
+#         define LOGTEE_CONTEXT_STR     64      /* bytes kept of each %s argument */
+#       endif
+#       if !defined(LOGTEE_CONTEXT_TRIGGER)
+#         define LOGTEE_CONTEXT_TRIGGER 2       /* Error */
+#       endif
+
+	// Lines at or above _LOG_ctxlevel that some tee filters out are kept in
+	// a per-thread ring of _LOG_ctxdepth, see LOG_context()
+	USTATE(int, _LOG_ctxlevel, INT_MAX);
+	USTATE(int, _LOG_ctxdepth, 0);
+
+	// A context line, rendered or as its format and captured arguments
+	struct _l_ctxrec {
+		int level, saved_errno;
+		int deferred;                   // data: format, then arguments
+		size_t len;
+		char data[LOGTEE_CONTEXT_LINE];
+	};
+	struct _l_ctx {
+		int depth, n, next;             // ring of depth, n lines in it
+		struct _l_ctxrec rec[];
+	};
+
+	// Per-thread state, allocated on a thread's first accepted line
+	struct _l_tls {
+		char line[LINE_MAX];
+		long tid;                       // kernel thread id where available
+		struct _l_sitetab *sites;
+		struct _l_ctx *ctx;
+		struct _l_binargs bin;
+	}; USTATE(__thread struct _l_tls *, _LOG_tlsp, NULL);
+
+	// What LOG_try() did with a line
+	enum LOG_status {
+		LOG_ACCEPTED,                   // written or queued
+		LOG_FILTERED,                   // below the level of every tee
+		LOG_DROPPED,                    // lane full, Tee busy, over budget, out of memory or no tee took it
+		LOG_TRUNCATED,                  // written or queued, cut to LINE_MAX - 1 bytes
+	};
+
+	/*
+	 * A LOGX() of a string literal without arguments or conversions, e.g.
+	 * LOGE("Nooo!\n"), skips formatting: the literal is written as is, its
+	 * length known at compile time. The checks fold away for literals;
+	 * anything else (a pointer, an array not known at compile time, "%%")
+	 * takes LOG_at(). __builtin_constant_p() doesn't evaluate its argument,
+	 * so an array such as bufs[i++] is evaluated once, by the call.
+	 */
+#if defined(__cplusplus)
+#	define _LOG_ISLIT(fmt, ...) 0
+#else
+#	define _LOG_ISLIT(fmt, ...) (sizeof(#__VA_ARGS__) == 1 \
+		&& __builtin_types_compatible_p(__typeof__(fmt), char[sizeof(fmt)]) && sizeof(fmt) <= LINE_MAX \
+		&& __builtin_constant_p(__builtin_strlen(fmt)) \
+		&& __builtin_strlen(fmt) == sizeof(fmt) - 1 && __builtin_strchr(fmt, '%') == NULL)
+#endif
+	// The LOGX() macros hand over their level's builtin prefix and its
+	// length, so the level table is only searched when LOG_addlevel()
+	// replaced it
+#	define _LOG_X(level, prefix, fmt, ...) (_LOG_ISLIT(fmt, __VA_ARGS__) \
+		? _LOG_lit(__FILE__, __LINE__, level, prefix, sizeof(prefix) - 1, fmt, sizeof(fmt)) \
+		: _LOG_atp(__FILE__, __LINE__, level, prefix, sizeof(prefix) - 1, fmt, ##__VA_ARGS__))
+
+#	define LOGD(fmt,...) _LOG_X(-1, _LOG_PREFIX_D, fmt, ##__VA_ARGS__)
+#       define LOGI(fmt,...) _LOG_X(0, _LOG_PREFIX_I, fmt, ##__VA_ARGS__)
+#       define LOGW(fmt,...) _LOG_X(1, _LOG_PREFIX_W, fmt, ##__VA_ARGS__)
+#       define LOGE(fmt,...) _LOG_X(2, _LOG_PREFIX_E, fmt, ##__VA_ARGS__)
+#       define LOGF(fmt,...) (void)(_LOG_X(3, _LOG_PREFIX_F, fmt, ##__VA_ARGS__), exit(EXIT_FAILURE))
 
 #       define PLOGI(fmt,...) LOGI(fmt ": %s\n", ##__VA_ARGS__, strerror(errno))
 #       define PLOGW(fmt,...) LOGW(fmt ": %s\n", ##__VA_ARGS__, strerror(errno))
 #       define PLOGE(fmt,...) LOGE(fmt ": %s\n", ##__VA_ARGS__, strerror(errno))
 #       define PLOGF(fmt,...) LOGF(fmt ": %s\n", ##__VA_ARGS__, strerror(errno))
 
-	static void _LOG_cleanup() {
-		for (struct _l_fplist *fpl = &_fplist; fpl != NULL; fpl = fpl->next)
-			if (fpl->fp != NULL && fileno(fpl->fp) != STDIN_FILENO
-					&& fileno(fpl->fp) != STDERR_FILENO)
+	/*
+	 * Memory budget. The writer side allocates through _LOG_malloc() and
+	 * friends, which keep each block's size in front of it and count it, and
+	 * shared memory rings are counted too. Over LOGTEE_BUDGET_BATCH percent
+	 * of LOG_budget() LOG_batch() goes out in chunks of half LOGTEE_BATCH
+	 * lines, halved again past each of the next thresholds, so batches hold
+	 * the lanes and the Tee for less. Over LOGTEE_BUDGET_DEBUG percent Debug
+	 * lines are dropped and context capture stops, over LOGTEE_BUDGET_INFO
+	 * percent Info lines as well, and allocations that would go over the
+	 * budget fail with ENOMEM.
+	 */
+#       if !defined(LOGTEE_BUDGET_BATCH)
+#         define LOGTEE_BUDGET_BATCH    50
+#       endif
+#       if !defined(LOGTEE_BUDGET_DEBUG)
+#         define LOGTEE_BUDGET_DEBUG    75
+#       endif
+#       if !defined(LOGTEE_BUDGET_INFO)
+#         define LOGTEE_BUDGET_INFO     90
+#       endif
+	USTATE(size_t, _LOG_memused, 0);
+	USTATE(size_t, _LOG_membudget, 0);           // 0: no limit
+	USTATE(int, _LOG_memfloor, INT_MIN);         // lines below are dropped
+	USTATE(int, _LOG_membatchshift, 0);          // LOG_batch() chunks: LOGTEE_BATCH >> this
+	USTATE(uint64_t, _LOG_memdropped, 0);
+
+	union _l_memhdr {                   // C99 has no max_align_t
+		size_t size;
+		long double ld;
+		long long ll;
+		void *p;
+		void (*fn)(void);
+	};
+
+	/*
+	 * Sets the floor and batch size for the current usage. Another thread can charge
+	 * between our load and store, so whoever finds the usage changed after
+	 * storing goes again: the last store is always for the latest usage.
+	 */
+	static void _LOG_memlevel() {
+		for (;;) {
+			size_t used = __atomic_load_n(&_LOG_memused, __ATOMIC_SEQ_CST);
+			size_t budget = __atomic_load_n(&_LOG_membudget, __ATOMIC_SEQ_CST);
+			int floor = INT_MIN;
+			if (budget != 0 && used >= budget / 100 * LOGTEE_BUDGET_INFO)
+				floor = 1;
+			else if (budget != 0 && used >= budget / 100 * LOGTEE_BUDGET_DEBUG)
+				floor = 0;
+			int shift = budget != 0 && used >= budget / 100 * LOGTEE_BUDGET_BATCH;
+			shift += (floor != INT_MIN) + (floor == 1);
+			__atomic_store_n(&_LOG_memfloor, floor, __ATOMIC_SEQ_CST);
+			__atomic_store_n(&_LOG_membatchshift, shift, __ATOMIC_SEQ_CST);
+			if (__atomic_load_n(&_LOG_memused, __ATOMIC_SEQ_CST) == used
+					&& __atomic_load_n(&_LOG_membudget, __ATOMIC_SEQ_CST) == budget)
+				break;
+		}
+	}
+
+	// Counts n more (or less) bytes, -1 and ENOMEM when over the budget
+	static int _LOG_memcharge(ssize_t n) {
+		size_t budget = __atomic_load_n(&_LOG_membudget, __ATOMIC_RELAXED);
+		size_t used = __atomic_add_fetch(&_LOG_memused, (size_t)n, __ATOMIC_SEQ_CST);
+		if (n > 0 && budget != 0 && used > budget) {
+			__atomic_sub_fetch(&_LOG_memused, (size_t)n, __ATOMIC_SEQ_CST);
+			_LOG_memlevel();
+			errno = ENOMEM;
+			return -1;
+		}
+		_LOG_memlevel();
+		return 0;
+	}
+
+	static void *_LOG_memblock(union _l_memhdr *h, size_t size) {
+		if (h == NULL) {
+			_LOG_memcharge(-(ssize_t)(sizeof(*h) + size));
+			return NULL;
+		}
+		h->size = size;
+		return h + 1;
+	}
+
+	static void *_LOG_malloc(size_t size) {
+		if (size > SIZE_MAX / 2 || _LOG_memcharge(sizeof(union _l_memhdr) + size) == -1)
+			return NULL;
+		return _LOG_memblock(malloc(sizeof(union _l_memhdr) + size), size);
+	}
+
+	static void *_LOG_calloc(size_t n, size_t size) {
+		if (size != 0 && n > SIZE_MAX / 2 / size)
+			return NULL;
+		if (_LOG_memcharge(sizeof(union _l_memhdr) + n * size) == -1)
+			return NULL;
+		return _LOG_memblock(calloc(1, sizeof(union _l_memhdr) + n * size), n * size);
+	}
+
+	static void _LOG_free(void *p) {
+		if (p == NULL)
+			return;
+		union _l_memhdr *h = (union _l_memhdr *)p - 1;
+		_LOG_memcharge(-(ssize_t)(sizeof(*h) + h->size));
+		free(h);
+	}
+
+	static void *_LOG_realloc(void *p, size_t size) {
+		if (p == NULL)
+			return _LOG_malloc(size);
+		union _l_memhdr *h = (union _l_memhdr *)p - 1;
+		size_t old = h->size;
+		if (size > SIZE_MAX / 2 || _LOG_memcharge((ssize_t)size - (ssize_t)old) == -1)
+			return NULL;
+		if ((h = realloc(h, sizeof(*h) + size)) == NULL) {
+			_LOG_memcharge((ssize_t)old - (ssize_t)size);
+			return NULL;
+		}
+		h->size = size;
+		return h + 1;
+	}
+
+	static char *_LOG_strdup(const char *s) {
+		size_t n = strlen(s) + 1;
+		char *p = _LOG_malloc(n);
+		return p ? memcpy(p, s, n) : NULL;
+	}
+
+	static void _LOG_binfree(struct _l_bintee *bt);
+	static void _LOG_ringfree(struct _l_ring *ring);
+	static void _LOG_asyncstop();
+
+	static int _LOG_used(const struct _l_fplist *t) {
+		return t->fp != NULL || t->ring != NULL || t->kind == _LOG_METRICS;
+	}
+
+	// Empties the Tee, closing each distinct FILE* once. Called locked.
+	static void _LOG_closeall() {
+		for (struct _l_fplist *fpl = &_fplist; fpl != NULL; fpl = fpl->next) {
+			if (!_LOG_used(fpl))
+				continue;
+			int shared = 0; // same FILE* teed more than once
+			for (struct _l_fplist *n = fpl->next; n != NULL && !shared && fpl->fp; n = n->next)
+				shared = n->fp == fpl->fp;
+			if (fpl->fp != NULL && !shared && fileno(fpl->fp) != STDIN_FILENO
+					&& fileno(fpl->fp) != STDOUT_FILENO && fileno(fpl->fp) != STDERR_FILENO)
 				fclose(fpl->fp);
+			_LOG_binfree(fpl->bin);
+			_LOG_ringfree(fpl->ring);
+			fpl->bin = NULL;
+			fpl->ring = NULL;
+			fpl->kind = _LOG_TEXT;
+			fpl->fp = NULL;
+			fpl->level = 0;
+			fpl->fails = 0, fpl->err = 0, fpl->errors = 0;
+			fpl->retry = 0, fpl->backoff = 0;
+		}
+		__atomic_store_n(&_LOG_minlevel, INT_MAX, __ATOMIC_RELAXED);
+		__atomic_store_n(&_LOG_metricslevel, INT_MAX, __ATOMIC_RELAXED);
+		__atomic_store_n(&_LOG_nbinary, 0, __ATOMIC_RELAXED);
 	}
 
-	inline static void __attribute__(( format(printf, 2, 3) ))
-		LOG(int level, const char *fmt, ...) {
-			if (_loglevels == NULL) { // initialize state if necessary
-				atexit(_LOG_cleanup);
-				if ((_loglevels = malloc(sizeof(_builtin_levels))) == NULL)
-					goto malloc_fail;
-				memcpy(_loglevels, _builtin_levels, sizeof(_builtin_levels));
-				_numlevels = sizeof(_builtin_levels)/sizeof(*_loglevels);;
-			}
+	static void _LOG_cleanup() {
+		_LOG_asyncstop();
+		pthread_mutex_lock(&_LOG_mtx);
+		_LOG_closeall();
+		pthread_mutex_unlock(&_LOG_mtx);
+	}
 
-			static char *logline = NULL; // allocated once, freed at exit
-			if (logline == NULL && (logline = malloc(sizeof(char) * LINE_MAX)) == NULL)
-				goto malloc_fail;
-			*logline = '\0';
+	static uint32_t _LOG_strhash(const char *s) {
+		uint32_t h = 2166136261u;
+		while (*s)
+			h = (h ^ (unsigned char)*s++) * 16777619u;
+		return h;
+	}
 
-			// Bail out early when no log targets are defined
-			if (_fplist.fp == NULL)
-				return;
+	static void _LOG_sitemerge(struct LOG_site *to, const struct LOG_site *from) {
+		to->calls += __atomic_load_n(&from->calls, __ATOMIC_RELAXED);
+		to->accepted += __atomic_load_n(&from->accepted, __ATOMIC_RELAXED);
+		to->bytes += __atomic_load_n(&from->bytes, __ATOMIC_RELAXED);
+		to->ns += __atomic_load_n(&from->ns, __ATOMIC_RELAXED);
+	}
 
-			va_list ap;
-			va_start(ap, fmt);
-			vsnprintf(logline, LINE_MAX, fmt, ap);
-			va_end(ap);
+	// Slot for a site in `tab': its entry, a free entry, or NULL when full
+	static struct LOG_site *_LOG_siteslot(struct _l_sitetab *tab, const char *file, int line) {
+		size_t h = ((uintptr_t)file ^ (uintptr_t)line * 2654435761u) % LOGTEE_PROFILE_SITES;
+		for (size_t n = 0; n < LOGTEE_PROFILE_SITES * 3 / 4; ++n, h = (h + 1) % LOGTEE_PROFILE_SITES) {
+			struct LOG_site *site = tab->sites + h;
+			if (site->file == NULL || (site->file == file && site->line == line))
+				return site;
+		}
+		return NULL;
+	}
+
+	// Slot for a site in merged table `tab', by the contents of file
+	static struct LOG_site *_LOG_sitenamed(struct _l_sitetab *tab, const char *file, int line) {
+		size_t h = (_LOG_strhash(file) ^ (uint32_t)line * 2654435761u) % LOGTEE_PROFILE_SITES;
+		for (size_t n = 0; n < LOGTEE_PROFILE_SITES * 3 / 4; ++n, h = (h + 1) % LOGTEE_PROFILE_SITES) {
+			struct LOG_site *site = tab->sites + h;
+			if (site->file == NULL || (site->line == line && strcmp(site->file, file) == 0))
+				return site;
+		}
+		return NULL;
+	}
 
-			// Determine level, if no such level then no extra annnotation included
-			struct _l_loglevel *llev = NULL;
-			for (size_t i=0; _loglevels != NULL && i < _numlevels; ++i)
-				if (_loglevels[i].level == level)
-					llev = _loglevels+i;
+	// Adds every site of `from' to `to', one per file name and line
+	// whichever copies of the name the threads logged with. Called locked.
+	static void _LOG_sitetabmerge(struct _l_sitetab *to, struct _l_sitetab *from) {
+		for (size_t i = 0; i < LOGTEE_PROFILE_SITES; ++i) {
+			const struct LOG_site *site = from->sites + i;
+			const char *file = __atomic_load_n(&site->file, __ATOMIC_ACQUIRE);
+			if (file == NULL)
+				continue;
+			struct LOG_site *slot = _LOG_sitenamed(to, file, site->line);
+			if (slot == NULL) {
+				slot = &to->other;
+			} else if (slot->file == NULL) {
+				slot->file = file;
+				slot->line = site->line;
+				slot->level = site->level;
+			}
+			_LOG_sitemerge(slot, site);
+		}
+		_LOG_sitemerge(&to->other, &from->other);
+	}
 
-			for (struct _l_fplist *lfp = &_fplist; lfp != NULL; lfp = lfp->next) {
-				if (lfp->fp == NULL || lfp->level > level)
-					continue;
-				fprintf(lfp->fp, "%s%s%s", _prefix_callback ? _prefix_callback() : "",
-						llev ? llev->prefix : "", logline);
-				fflush(lfp->fp);
+	static void _LOG_tlsfree(void *p) {
+		struct _l_tls *tls = p;
+		if (tls->sites != NULL) { // keep the exiting thread's profile
+			pthread_mutex_lock(&_LOG_mtx);
+			struct _l_sitetab **tp = &_LOG_sitetabs;
+			while (*tp != tls->sites)
+				tp = &(*tp)->next;
+			*tp = tls->sites->next;
+			if (_LOG_retired == NULL) {
+				_LOG_retired = tls->sites;
+				_LOG_retired->next = NULL;
+				tls->sites = NULL;
+			} else {
+				_LOG_sitetabmerge(_LOG_retired, tls->sites);
 			}
+			pthread_mutex_unlock(&_LOG_mtx);
+			_LOG_free(tls->sites);
+		}
+		_LOG_free(tls->ctx);
+		_LOG_free(tls);
+		// a LOG() from a later destructor gets a fresh block, and the key
+		// set again, so it is freed in the next round of destructors
+		_LOG_tlsp = NULL;
+	}
+
+	static unsigned long long _LOG_nsnow() {
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+	}
+
+	/*
+	 * Timestamps: the hot path only reads the cycle counter (TSC on x86 when
+	 * the kernel uses it as its clocksource, CNTVCT on arm64, otherwise
+	 * CLOCK_MONOTONIC in ns), and the writer converts ticks to CLOCK_REALTIME
+	 * ns with a calibration that is redone every LOGTEE_CLOCK_RECAL ns. The
+	 * rate is measured over the whole run, the anchor follows clock steps.
+	 * Readers of the calibration retry around `seq', odd while it changes.
+	 */
+#       if !defined(LOGTEE_CLOCK_RECAL)
+#         define LOGTEE_CLOCK_RECAL     1000000000ull   /* ns between calibrations */
+#       endif
+	enum { _LOG_CLOCK_MONO, _LOG_CLOCK_TSC };
+	struct _l_clock {
+		unsigned seq, busy;
+		int source, rdtscp;
+		uint64_t tick0, mono0;          // first sample, for the rate
+		uint64_t tick, real;            // anchor
+		double nspertick;               // 0 until calibrated
+		uint64_t next;                  // tick of the next calibration
+	}; USTATE(struct _l_clock, _LOG_clock, { 0 });
+
+	static inline uint64_t _LOG_ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+		if (__builtin_expect(__atomic_load_n(&_LOG_clock.source, __ATOMIC_RELAXED) == _LOG_CLOCK_TSC, 1))
+			return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+		uint64_t v;
+		__asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(v));
+		return v;
+#endif
+		return _LOG_nsnow();
+	}
+
+	/**
+	 *  _LOG_ticks() and the CPU it was read on, when the ticks are per CPU
+	 *  (TSC): Linux keeps the CPU number in TSC_AUX, which rdtscp returns.
+	 */
+	static inline uint64_t _LOG_tickscpu(int *cpu) {
+		*cpu = -1;
+#if defined(__x86_64__) || defined(__i386__)
+		if (__builtin_expect(__atomic_load_n(&_LOG_clock.rdtscp, __ATOMIC_RELAXED), 1)) {
+			unsigned aux;
+			uint64_t t = __builtin_ia32_rdtscp(&aux);
+			*cpu = aux & 0xfff;
+			return t;
+		}
+#endif
+		return _LOG_ticks();
+	}
+
+	static uint64_t _LOG_realnow() {
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+	}
 
+	// Picks the tick source and takes the first sample, from _LOG_init()
+	static void _LOG_clockinit() {
+		int source = _LOG_CLOCK_MONO;
+#if defined(__x86_64__) || defined(__i386__)
+		// the kernel only keeps "tsc" when it is invariant and synchronized
+		char cs[16] = "";
+		FILE *fp = fopen("/sys/devices/system/clocksource/clocksource0/current_clocksource", "re");
+		if (fp != NULL) {
+			if (fgets(cs, sizeof cs, fp) != NULL && strcmp(cs, "tsc\n") == 0)
+				source = _LOG_CLOCK_TSC;
+			fclose(fp);
+		}
+		unsigned a, b, c, d;
+		if (source == _LOG_CLOCK_TSC && __get_cpuid(0x80000001, &a, &b, &c, &d) && (d & 1u << 27))
+			__atomic_store_n(&_LOG_clock.rdtscp, 1, __ATOMIC_RELAXED);
+#elif defined(__aarch64__)
+		source = _LOG_CLOCK_TSC;
+#endif
+		__atomic_store_n(&_LOG_clock.source, source, __ATOMIC_RELAXED);
+		_LOG_clock.mono0 = _LOG_nsnow();
+		_LOG_clock.tick0 = _LOG_ticks();
+	}
+
+	// Calibrates at `now', unless another thread is doing it
+	static void __attribute__((noinline)) _LOG_clockcal(uint64_t now) {
+		struct _l_clock *c = &_LOG_clock;
+		if (__atomic_exchange_n(&c->busy, 1, __ATOMIC_ACQUIRE))
 			return;
-malloc_fail:
-			fprintf(stderr, "%s: malloc: %s\n", __func__, strerror(errno));
+		if (now < __atomic_load_n(&c->next, __ATOMIC_RELAXED) && c->nspertick != 0) {
+			__atomic_store_n(&c->busy, 0, __ATOMIC_RELEASE);
 			return;
 		}
+		double nspertick = 1;
+		uint64_t mono, tick, real;
+		for (;;) { // a rate from under 100us is too coarse
+			mono = _LOG_nsnow();
+			tick = _LOG_ticks();
+			real = _LOG_realnow();
+			if (c->source != _LOG_CLOCK_TSC || tick <= c->tick0)
+				break;
+			if (mono - c->mono0 >= 100000) {
+				nspertick = (double)(mono - c->mono0) / (tick - c->tick0);
+				break;
+			}
+		}
+		__atomic_store_n(&c->seq, c->seq + 1, __ATOMIC_RELAXED);
+		__atomic_store_n(&c->tick, tick, __ATOMIC_RELEASE); // after the odd seq
+		__atomic_store_n(&c->real, real, __ATOMIC_RELEASE);
+		__atomic_store(&c->nspertick, &nspertick, __ATOMIC_RELEASE);
+		// early calibrations are short, so redo the first one soon
+		uint64_t wait = mono - c->mono0 < LOGTEE_CLOCK_RECAL / 16 ? LOGTEE_CLOCK_RECAL / 64 : LOGTEE_CLOCK_RECAL;
+		__atomic_store_n(&c->next, tick + (uint64_t)(wait / nspertick), __ATOMIC_RELAXED);
+		__atomic_store_n(&c->seq, c->seq + 1, __ATOMIC_RELEASE);
+		__atomic_store_n(&c->busy, 0, __ATOMIC_RELEASE);
+	}
+
+	// CLOCK_REALTIME ns of a _LOG_ticks() value
+	static uint64_t _LOG_tickstons(uint64_t ticks) {
+		struct _l_clock *c = &_LOG_clock;
+		unsigned seq;
+		uint64_t tick, real;
+		double nspertick;
+		if (ticks >= __atomic_load_n(&c->next, __ATOMIC_RELAXED))
+			_LOG_clockcal(ticks);
+		do {
+			while ((seq = __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE)) & 1 || seq == 0)
+				if (seq == 0) // first calibration, still in another thread
+					_LOG_clockcal(ticks);
+			tick = __atomic_load_n(&c->tick, __ATOMIC_ACQUIRE); // before the seq check
+			real = __atomic_load_n(&c->real, __ATOMIC_ACQUIRE);
+			__atomic_load(&c->nspertick, &nspertick, __ATOMIC_ACQUIRE);
+		} while (__atomic_load_n(&c->seq, __ATOMIC_RELAXED) != seq);
+		return real + (int64_t)((double)(int64_t)(ticks - tick) * nspertick);
+	}
+
+	static void _LOG_init() {
+		_LOG_clockinit();
+		atexit(_LOG_cleanup);
+		pthread_key_create(&_LOG_tlskey, _LOG_tlsfree);
+	}
+
+	static struct _l_tls *_LOG_tls() {
+		if (_LOG_tlsp == NULL && (_LOG_tlsp = _LOG_calloc(1, sizeof(*_LOG_tlsp))) != NULL) {
+			pthread_setspecific(_LOG_tlskey, _LOG_tlsp); // freed at thread exit
+#if defined(__linux__) && defined(SYS_gettid)
+			_LOG_tlsp->tid = syscall(SYS_gettid);
+#else
+			_LOG_tlsp->tid = (long)getpid();
+#endif
+		}
+		return _LOG_tlsp;
+	}
+
+	// Next context slot of the calling thread, NULL when off or without memory
+	static struct _l_ctxrec *_LOG_ctxslot(struct _l_tls *tls, int level) {
+		int depth = __atomic_load_n(&_LOG_ctxdepth, __ATOMIC_RELAXED);
+		struct _l_ctx *ctx = tls->ctx;
+		if (depth <= 0)
+			return NULL;
+		if (ctx == NULL || ctx->depth != depth) {
+			_LOG_free(ctx);
+			if ((ctx = tls->ctx = _LOG_calloc(1, sizeof(*ctx) + depth * sizeof(*ctx->rec))) == NULL)
+				return NULL;
+			ctx->depth = depth;
+		}
+		struct _l_ctxrec *rec = ctx->rec + ctx->next;
+		ctx->next = (ctx->next + 1) % depth;
+		if (ctx->n < depth)
+			++ctx->n;
+		rec->level = level;
+		return rec;
+	}
 
 	/**
-	 *  Clean slate
+	 *  The calling thread's profile entry for a site, NULL without memory.
+	 *  Sites are keyed by the __FILE__ literal's address and __LINE__,
+	 *  reports merge them by name, see _LOG_sitetabmerge().
 	 */
-	inline static void LOG_reset() {
-		for (struct _l_fplist *fp = &_fplist; fp; fp = fp->next) {
-			if (fileno(fp->fp) != STDOUT_FILENO && fileno(fp->fp) != STDERR_FILENO)
-				fclose(fp->fp);
-			fp->fp = NULL;
-			fp->level = 0;
+	static struct LOG_site *_LOG_site(struct _l_tls *tls, const char *file, int line, int level) {
+		struct _l_sitetab *tab = tls->sites;
+		if (tab == NULL) {
+			if ((tab = tls->sites = _LOG_calloc(1, sizeof(*tab))) == NULL)
+				return NULL;
+			tab->other.file = "(other)";
+			pthread_mutex_lock(&_LOG_mtx);
+			tab->next = _LOG_sitetabs;
+			_LOG_sitetabs = tab;
+			pthread_mutex_unlock(&_LOG_mtx);
 		}
+		struct LOG_site *site = _LOG_siteslot(tab, file, line);
+		if (site == NULL)
+			return &tab->other;
+		if (site->file == NULL) {
+			site->line = line;
+			site->level = level;
+			__atomic_store_n(&site->file, file, __ATOMIC_RELEASE); // publish
+		}
+		return site;
+	}
 
-		_prefix_callback = NULL;
+#	define _LOG_SITEADD(site, field, n) \
+		__atomic_store_n(&(site)->field, (site)->field + (n), __ATOMIC_RELAXED)
 
+	// (Re)initialize the level table with the builtins. Called locked.
+	static int _LOG_levelsinit() {
 		if (_loglevels != NULL) {
-			free(_loglevels);
-			if ((_loglevels = malloc(sizeof(_builtin_levels))) == NULL)
-				fprintf(stderr, "%s: malloc: %s\n", __func__, strerror(errno));
+			for (size_t i = sizeof(_builtin_levels)/sizeof(*_loglevels); i < _numlevels; ++i)
+				_LOG_free((char *)_loglevels[i].prefix); // strdup()ed by LOG_addlevel
+			_LOG_free(_loglevels);
+		}
+		_numlevels = 0;
+		_LOG_prefixover = 0;
+		if ((_loglevels = _LOG_malloc(sizeof(_builtin_levels))) == NULL)
+			return -1;
+		memcpy(_loglevels, _builtin_levels, sizeof(_builtin_levels));
+		_numlevels = sizeof(_builtin_levels)/sizeof(*_loglevels);
+		return 0;
+	}
+
+	/**
+	 *  Raw return addresses only: no unwinding past the fixed array and no
+	 *  symbolization on this path (never backtrace_symbols()).
+	 */
+	static size_t __attribute__((noinline)) _LOG_btcapture(void **frames) {
+#if defined(__GLIBC__)
+		int n = backtrace(frames, LOGTEE_BT_DEPTH);
+		return n > 0 ? (size_t)n : 0;
+#else
+		(void)frames;
+		return 0;
+#endif
+	}
+
+	static void _LOG_btloadmaps() {
+		FILE *maps = fopen("/proc/self/maps", "r");
+		if (maps == NULL)
+			return;
+		for (size_t i = 0; i < _LOG_btnmodules; ++i)
+			_LOG_free(_LOG_btmodules[i].path);
+		_LOG_btnmodules = 0;
+
+		char line[4096 + 128], perms[5], *path;
+		uintptr_t start, end, offset, base = 0;
+		int pathpos;
+		while (fgets(line, sizeof line, maps) != NULL) {
+			pathpos = 0;
+			if (sscanf(line, "%" SCNxPTR "-%" SCNxPTR " %4s %" SCNxPTR " %*s %*s %n",
+						&start, &end, perms, &offset, &pathpos) < 4 || pathpos == 0)
+				continue;
+			if (*(path = line + pathpos) != '/')
+				continue;
+			path[strcspn(path, "\n")] = '\0';
+			if (offset == 0) { // first mapping of an object: its load address
+				base = start;
+				// ET_EXEC objects are not relocated, their addresses are absolute.
+				// Read from the file: the mapping may be a truncated data file.
+				char ehdr[18];
+				uint16_t type = 0;
+				int fd = open(path, O_RDONLY | O_CLOEXEC);
+				if (fd != -1 && pread(fd, ehdr, sizeof ehdr, 0) == (ssize_t)sizeof ehdr
+						&& memcmp(ehdr, "\177ELF", 4) == 0)
+					memcpy(&type, ehdr + 16, sizeof type); // e_type, host order
+				if (type == 2)
+					base = 0;
+				if (fd != -1)
+					close(fd);
+			}
+			if (perms[2] != 'x')
+				continue;
+			struct _l_btmodule *m = _LOG_realloc(_LOG_btmodules, sizeof(*m) * (_LOG_btnmodules + 1));
+			if (m == NULL)
+				break;
+			_LOG_btmodules = m;
+			m += _LOG_btnmodules;
+			if ((m->path = _LOG_strdup(path)) == NULL)
+				break;
+			m->start = start, m->end = end, m->bias = base;
+			++_LOG_btnmodules;
+		}
+		fclose(maps);
+	}
+
+	// Address-to-module cache lookup, rereads the maps on a miss (dlopen())
+	static const struct _l_btmodule *_LOG_btmodule(uintptr_t addr) {
+		for (int pass = 0; pass < 2; ++pass) {
+			size_t lo = 0, hi = _LOG_btnmodules;
+			while (lo < hi) { // /proc/self/maps is sorted by address
+				size_t mid = lo + (hi - lo) / 2;
+				if (addr < _LOG_btmodules[mid].start)
+					hi = mid;
+				else if (addr >= _LOG_btmodules[mid].end)
+					lo = mid + 1;
+				else
+					return _LOG_btmodules + mid;
+			}
+			if (pass == 0)
+				_LOG_btloadmaps();
+		}
+		return NULL;
+	}
+
+	static void _LOG_btwrite(FILE *fp, const char *prefix, void *const *frames, size_t n) {
+		// skip _LOG_btcapture() and LOG() themselves
+		for (size_t i = 2; i < n; ++i) {
+			const struct _l_btmodule *m = _LOG_btmodule((uintptr_t)frames[i]);
+			if (m != NULL)
+				fprintf(fp, "%s  #%zu %s(+0x%" PRIxPTR ") [%p]\n", prefix, i - 2,
+						m->path, (uintptr_t)frames[i] - m->bias, frames[i]);
 			else
-				memcpy(_loglevels, _builtin_levels, sizeof(_builtin_levels));
-			_numlevels = sizeof(_builtin_levels) / sizeof(*_loglevels);
+				fprintf(fp, "%s  #%zu [%p]\n", prefix, i - 2, frames[i]);
 		}
 	}
 
-	inline static void LOG_teefile(FILE *file, int level) {
-		if (file == NULL) return;
-		if (fileno(file) != STDOUT_FILENO && fileno(file) != STDERR_FILENO) {
-			if (fseek(file, 0, SEEK_END) == -1)
-				PLOGW("%s: fseek(SEEK_END)", __func__);
-			if (fcntl(fileno(file), F_SETFD, FD_CLOEXEC) == -1)
-				PLOGW("%s: fcntl(FD_CLOEXEC)", __func__);
+	/*
+	 * printf format walking, shared by the binary encoder and decoder
+	 */
+
+	// One conversion specification: `len' bytes from '%' through `conv'
+	struct _l_spec {
+		size_t len;
+		char conv;                      // '%' for "%%"
+		char length;                    // 0 or one of "HhlqLjzt" (H: hh, q: ll)
+		int prec;                       // -1: none, -2: '*'
+	};
+
+	// Parses the specification at p ('%'), -1 when unsupported (positional)
+	static int _LOG_fmtspec(const char *p, struct _l_spec *sp) {
+		const char *s = p++;
+		sp->length = 0;
+		sp->prec = -1;
+		if (*p == '%') {
+			sp->conv = '%', sp->len = 2;
+			return 0;
 		}
-		for (struct _l_fplist *fp = &_fplist; fp; fp = fp->next) {
-			if (fp->fp == NULL) { // empty slot
-				fp->fp = file;
-				fp->level = level;
+		const char *q = p;
+		while (*q >= '0' && *q <= '9')
+			++q;
+		if (*q == '$')
+			return -1;
+		p += strspn(p, "-+ #0'I");
+		if (*p == '*')
+			++p;
+		else while (*p >= '0' && *p <= '9')
+			++p;
+		if (*p == '.') {
+			sp->prec = 0;
+			if (*++p == '*')
+				sp->prec = -2, ++p;
+			else while (*p >= '0' && *p <= '9')
+				sp->prec = sp->prec * 10 + *p++ - '0';
+		}
+		if (*p == '*' || *p == '$')
+			return -1;
+		switch (*p) {
+			case 'h': sp->length = p[1] == 'h' ? (++p, 'H') : 'h'; ++p; break;
+			case 'l': sp->length = p[1] == 'l' ? (++p, 'q') : 'l'; ++p; break;
+			case 'q': case 'L': case 'j': case 'z': case 't': sp->length = *p++; break;
+		}
+		if (*p == '\0' || strchr("diouxXfFeEgGaAcspnm", *p) == NULL)
+			return -1;
+		sp->conv = *p;
+		sp->len = p + 1 - s;
+		return 0;
+	}
+
+	// The arguments of one conversion
+	struct _l_arg {
+		int nstar, star[2];             // '*' width and precision, in order
+		union {
+			long long i;
+			unsigned long long u;
+			double d;
+			long double ld;
+			const void *p;
+		} v;
+	};
+
+	// Consumes one conversion's arguments ('*' included) from ap
+	static void _LOG_fmtget(const char *p, const struct _l_spec *sp, va_list *ap, struct _l_arg *a) {
+		a->nstar = 0;
+		for (size_t i = 0; i < sp->len; ++i)
+			if (p[i] == '*' && a->nstar < 2)
+				a->star[a->nstar++] = va_arg(*ap, int);
+		switch (sp->conv) {
+			case 'd': case 'i':
+				switch (sp->length) {
+					case 'l': a->v.i = va_arg(*ap, long); break;
+					case 'q': case 'L': a->v.i = va_arg(*ap, long long); break;
+					case 'j': a->v.i = va_arg(*ap, intmax_t); break;
+					case 'z': a->v.i = va_arg(*ap, ssize_t); break;
+					case 't': a->v.i = va_arg(*ap, ptrdiff_t); break;
+					default: a->v.i = va_arg(*ap, int);
+				}
 				break;
-			} else if (fp->next == NULL) { // expand by new entry
-				if ((fp->next = malloc(sizeof(*fp))) == NULL) {
-					LOGE("%s: malloc: %s.\n", __func__, strerror(errno));
-					return;
+			case 'o': case 'u': case 'x': case 'X':
+				switch (sp->length) {
+					case 'l': a->v.u = va_arg(*ap, unsigned long); break;
+					case 'q': case 'L': a->v.u = va_arg(*ap, unsigned long long); break;
+					case 'j': a->v.u = va_arg(*ap, uintmax_t); break;
+					case 'z': a->v.u = va_arg(*ap, size_t); break;
+					case 't': a->v.u = va_arg(*ap, ptrdiff_t); break;
+					default: a->v.u = va_arg(*ap, unsigned);
 				}
-				fp->next->next = NULL;
-				fp->next->fp = file;
-				fp->next->level = level;
 				break;
+			case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+				if (sp->length == 'L')
+					a->v.ld = va_arg(*ap, long double);
+				else
+					a->v.d = va_arg(*ap, double);
+				break;
+			case 'c':
+				a->v.i = sp->length == 'l' ? (long long)va_arg(*ap, wint_t) : va_arg(*ap, int);
+				break;
+			case 's':
+				a->v.p = sp->length == 'l' ? (const void *)va_arg(*ap, const wchar_t *)
+					: va_arg(*ap, const char *);
+				break;
+			case 'p': case 'n':
+				a->v.p = va_arg(*ap, void *);
+				break;
+		}
+	}
+
+	// Renders one conversion from its arguments, returns snprintf()'s result or -1
+	static int _LOG_fmtput(const char *p, const struct _l_spec *sp, const struct _l_arg *a, char *buf, size_t n) {
+		char spec[64];
+		size_t k = 0;
+		for (size_t i = 0, star = 0; i < sp->len; ++i) {
+			if (k + 16 >= sizeof spec)
+				return -1;
+			if (p[i] != '*') {
+				spec[k++] = p[i];
+			} else if (i > 0 && p[i - 1] == '.') {
+				int prec = a->star[star++];
+				if (prec < 0) // as if omitted
+					--k;
+				else
+					k += sprintf(spec + k, "%d", prec);
+			} else {
+				k += sprintf(spec + k, "%d", a->star[star++]);
 			}
 		}
+		spec[k] = '\0';
+
+		switch (sp->conv) {
+			case 'd': case 'i':
+				switch (sp->length) {
+					case 'l': return snprintf(buf, n, spec, (long)a->v.i);
+					case 'q': case 'L': return snprintf(buf, n, spec, a->v.i);
+					case 'j': return snprintf(buf, n, spec, (intmax_t)a->v.i);
+					case 'z': return snprintf(buf, n, spec, (ssize_t)a->v.i);
+					case 't': return snprintf(buf, n, spec, (ptrdiff_t)a->v.i);
+					default: return snprintf(buf, n, spec, (int)a->v.i);
+				}
+			case 'o': case 'u': case 'x': case 'X':
+				switch (sp->length) {
+					case 'l': return snprintf(buf, n, spec, (unsigned long)a->v.u);
+					case 'q': case 'L': return snprintf(buf, n, spec, a->v.u);
+					case 'j': return snprintf(buf, n, spec, (uintmax_t)a->v.u);
+					case 'z': return snprintf(buf, n, spec, (size_t)a->v.u);
+					case 't': return snprintf(buf, n, spec, (ptrdiff_t)a->v.u);
+					default: return snprintf(buf, n, spec, (unsigned)a->v.u);
+				}
+			case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+				if (sp->length == 'L')
+					return snprintf(buf, n, spec, a->v.ld);
+				return snprintf(buf, n, spec, a->v.d);
+			case 'c':
+				if (sp->length == 'l')
+					return snprintf(buf, n, spec, (wint_t)a->v.i);
+				return snprintf(buf, n, spec, (int)a->v.i);
+			case 's':
+				if (sp->length == 'l')
+					return snprintf(buf, n, spec, (const wchar_t *)a->v.p);
+				return snprintf(buf, n, spec, (const char *)a->v.p);
+			case 'p':
+				return snprintf(buf, n, spec, a->v.p);
+			case 'n': // stored by vsnprintf() already
+				if (n > 0)
+					*buf = '\0';
+				return 0;
+			case 'm':
+				return snprintf(buf, n, spec, 0);
+		}
+		return -1;
 	}
 
-	inline static void LOG_teepath(const char *path, int level) {
-		FILE *fp;
+	/**
+	 *  Renders one conversion, consuming its arguments ('*' included) from
+	 *  ap. Returns snprintf()'s result or -1.
+	 */
+	static int _LOG_fmtarg(const char *p, const struct _l_spec *sp, va_list *ap, char *buf, size_t n) {
+		struct _l_arg a;
+		_LOG_fmtget(p, sp, ap, &a);
+		return _LOG_fmtput(p, sp, &a, buf, n);
+	}
 
-		if (path == NULL)
-			fp = stderr;
-		else if (strcmp(path, "-") == 0)
-			fp = stdout;
-		else if ((fp = fopen(path, "a")) == NULL)
-			LOGW("%s: can't open '%s' for logging: %s.\n",
-					__func__, path, strerror(errno));
-		LOG_teefile(fp, level);
+	/*
+	 * Deferred formatting for context lines: the format and each
+	 * conversion's arguments are copied into the record as they are, and
+	 * only rendered when the context is written. Per conversion: the '*'
+	 * ints, then the value in its promoted type, or for %s a u32 length
+	 * (UINT32_MAX: NULL) and at most LOGTEE_CONTEXT_STR bytes, NUL ended.
+	 */
+
+	static size_t _LOG_argsize(const struct _l_spec *sp) {
+		switch (sp->conv) {
+			case 'd': case 'i': case 'c': return sizeof(long long);
+			case 'o': case 'u': case 'x': case 'X': return sizeof(unsigned long long);
+			case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+				return sp->length == 'L' ? sizeof(long double) : sizeof(double);
+			case 'p': return sizeof(void *);
+		}
+		return 0; // %n, %m
 	}
 
-	inline static void LOG_addlevel(int level, const char *prefix) {
-		if (prefix == NULL || *prefix == '\0') {
-			LOGW("%s: invalid prefix.\n", __func__);
-			return;
+	// Captures fmt and its arguments into d, -1 when they do not fit
+	static ssize_t _LOG_argcapture(char *d, size_t size, const char *fmt, va_list args) {
+		size_t used = strlen(fmt) + 1;
+		if (used > size / 2)
+			return -1;
+		memcpy(d, fmt, used);
+		ssize_t rc = -1;
+		va_list ap;
+		va_copy(ap, args);
+		for (const char *p = strchr(fmt, '%'); p != NULL; p = strchr(p, '%')) {
+			struct _l_spec sp;
+			struct _l_arg a;
+			if (_LOG_fmtspec(p, &sp) == -1)
+				goto out;
+			if (sp.conv == '%') {
+				p += sp.len;
+				continue;
+			}
+			_LOG_fmtget(p, &sp, &ap, &a);
+			size_t n = _LOG_argsize(&sp);
+			if (used + a.nstar * sizeof(int) + n + (sp.conv == 's' ? sizeof(uint32_t) + 1 : 0) > size)
+				goto out;
+			memcpy(d + used, a.star, a.nstar * sizeof(int));
+			used += a.nstar * sizeof(int);
+			if (sp.conv == 's') {
+				int prec = sp.prec == -2 ? a.star[a.nstar - 1] : sp.prec;
+				size_t csize = sp.length == 'l' ? sizeof(wchar_t) : 1;
+				size_t max = (size - used - sizeof(uint32_t) - 1) / csize;
+				if (max > LOGTEE_CONTEXT_STR / csize)
+					max = LOGTEE_CONTEXT_STR / csize;
+				if (prec >= 0 && (size_t)prec < max)
+					max = prec; // the string may end right there, unterminated
+				uint32_t len = a.v.p == NULL ? UINT32_MAX : sp.length == 'l'
+					? wcsnlen(a.v.p, max) : strnlen(a.v.p, max);
+				memcpy(d + used, &len, sizeof len);
+				used += sizeof len;
+				if (len != UINT32_MAX) {
+					memcpy(d + used, a.v.p, len * csize);
+					used += len * csize;
+				}
+				d[used++] = '\0';
+			} else {
+				memcpy(d + used, &a.v, n);
+				used += n;
+			}
+			p += sp.len;
 		}
-		_loglevels = realloc( _loglevels, sizeof(*_loglevels) * ++_numlevels );
-		if (_loglevels == NULL) {
-			PLOGE("%s: realloc", __func__);
-			_numlevels = 0;
-		} else {
-			_loglevels[_numlevels-1].level = level;
-			_loglevels[_numlevels-1].prefix = strdup(prefix);
+		rc = used;
+out:
+		va_end(ap);
+		return rc;
+	}
+
+	// Renders a captured line into buf like vsnprintf(), returns the bytes written
+	static size_t _LOG_argrender(const char *d, char *buf, size_t n) {
+		const char *fmt = d;
+		const char *arg = d + strlen(fmt) + 1;
+		size_t used = 0;
+		wchar_t wide[LOGTEE_CONTEXT_STR / sizeof(wchar_t) + 1];
+		for (const char *p = fmt; *p != '\0' && used + 1 < n; ) {
+			struct _l_spec sp;
+			struct _l_arg a;
+			if (*p != '%') {
+				size_t lit = strcspn(p, "%");
+				if (lit > n - 1 - used)
+					lit = n - 1 - used;
+				memcpy(buf + used, p, lit);
+				used += lit, p += lit;
+				continue;
+			}
+			_LOG_fmtspec(p, &sp); // checked by _LOG_argcapture()
+			if (sp.conv == '%') {
+				buf[used++] = '%';
+				p += sp.len;
+				continue;
+			}
+			a.nstar = 0;
+			for (size_t i = 0; i < sp.len; ++i)
+				if (p[i] == '*' && a.nstar < 2)
+					memcpy(a.star + a.nstar++, arg, sizeof(int)), arg += sizeof(int);
+			if (sp.conv == 's') {
+				uint32_t len;
+				memcpy(&len, arg, sizeof len);
+				arg += sizeof len;
+				a.v.p = NULL;
+				if (len != UINT32_MAX && sp.length == 'l') {
+					memcpy(wide, arg, len * sizeof(wchar_t));
+					wide[len] = L'\0';
+					a.v.p = wide;
+					arg += len * sizeof(wchar_t);
+				} else if (len != UINT32_MAX) {
+					a.v.p = arg;
+					arg += len;
+				}
+				++arg;
+			} else {
+				size_t size = _LOG_argsize(&sp);
+				memcpy(&a.v, arg, size);
+				arg += size;
+			}
+			int len = _LOG_fmtput(p, &sp, &a, buf + used, n - used);
+			if (len < 0)
+				break;
+			used += (size_t)len < n - used ? (size_t)len : n - used - 1;
+			p += sp.len;
 		}
+		if (n > 0)
+			buf[used] = '\0';
+		return used;
 	}
 
-	inline static void LOG_prefixcallback(_prefix_callback_t cback) {
-		_prefix_callback = cback ? cback : _prefix_callback;
+	// Keeps a line filtered out by every tee. Off the hot path on purpose.
+	static void __attribute__((noinline))
+		_LOG_ctxsave(int level, const char *fmt, va_list ap, int saved_errno) {
+			if (level < __atomic_load_n(&_LOG_memfloor, __ATOMIC_RELAXED))
+				return; // short of memory
+			pthread_once(&_LOG_once, _LOG_init);
+			struct _l_tls *tls = _LOG_tls();
+			struct _l_ctxrec *rec = tls ? _LOG_ctxslot(tls, level) : NULL;
+			if (rec == NULL)
+				return;
+			rec->saved_errno = saved_errno;
+			ssize_t len = _LOG_argcapture(rec->data, sizeof(rec->data), fmt, ap);
+			if ((rec->deferred = len >= 0)) {
+				rec->len = len;
+			} else { // too big to capture, keep it rendered
+				errno = saved_errno;
+				int n = vsnprintf(rec->data, sizeof(rec->data), fmt, ap);
+				rec->len = n < 0 ? 0 : n >= (int)sizeof(rec->data) ? sizeof(rec->data) - 1 : (size_t)n;
+			}
+			errno = saved_errno;
+		}
+
+	// Writes the context lines `fp' filtered out, oldest first. Called locked.
+	static int _LOG_ctxwrite(FILE *fp, int tlevel, const struct _l_ctx *ctx, const char *cbprefix) {
+		int total = 0;
+		char line[LINE_MAX];
+		for (int i = 0; i < ctx->n; ++i) {
+			const struct _l_ctxrec *rec = ctx->rec + (ctx->next - ctx->n + i + ctx->depth) % ctx->depth;
+			if (rec->level >= tlevel)
+				continue;
+			const char *prefix = "", *text = rec->data;
+			for (size_t k = 0; k < _numlevels; ++k)
+				if (_loglevels[k].level == rec->level)
+					prefix = _loglevels[k].prefix;
+			size_t len = rec->len;
+			if (rec->deferred) {
+				errno = rec->saved_errno; // for %m
+				len = _LOG_argrender(rec->data, line, sizeof line);
+				text = line;
+			}
+			len = strnlen(text, len); // as far as "%s" gets
+			int rc = fprintf(fp, "%s%s[context] %.*s%s", cbprefix, prefix, (int)len, text,
+					len > 0 && text[len - 1] == '\n' ? "" : "\n");
+			if (rc < 0)
+				return -1;
+			total += rc;
+		}
+		return total;
 	}
 
 	/**
-	 *  Dump interal state
+	 *  Values of the metrics fields extracted from fmt's arguments: bit i of
+	 *  the result is set when fields[i] matched, with its value in v[i].
 	 */
-	__attribute__((__used__)) static void LOG_fornerds() {
-		fprintf(stderr, "LOG: pid=%u, ppid=%u\n", getpid(), getppid());
-		fprintf(stderr, "LOG: number of levels: %zu, &levels=%p, &*levelp=%p\n", _numlevels, _loglevels, &_loglevels);
-		fprintf(stderr, "LOG: &fplist=%p, log targets: ", &_fplist);
-		for (struct _l_fplist *fpl = &_fplist; fpl != NULL; fpl = fpl->next) {
-			if (fpl->fp != NULL) {
-				fprintf(stderr, "<FILE*=%p(fd%u),level=%i> ", fpl->fp, fileno(fpl->fp), fpl->level);
-			}
+	static uint32_t _LOG_fieldvalues(const char *fmt, va_list args, double *v) {
+		uint32_t found = 0;
+		int nfields = __atomic_load_n(&_LOG_nfields, __ATOMIC_ACQUIRE);
+		for (int i = 0; i < nfields; ++i) {
+			const struct _l_field *f = _LOG_metrics->fields + i;
+			if (strcmp(f->fmt, fmt) != 0)
+				continue;
+			char buf[64], *end;
+			int arg = 0;
+			va_list ap;
+			va_copy(ap, args);
+			for (const char *p = strchr(fmt, '%'); p != NULL; p = strchr(p, '%')) {
+				struct _l_spec sp;
+				if (_LOG_fmtspec(p, &sp) == -1)
+					break;
+				if (sp.conv != '%' && (_LOG_fmtarg(p, &sp, &ap, buf, sizeof(buf)) < 0 || ++arg == f->arg)) {
+					if (arg == f->arg && (v[i] = strtod(buf, &end), end != buf))
+						found |= 1u << i;
+					break;
+				}
+				p += sp.len;
+			}
+			va_end(ap);
+		}
+		return found;
+	}
+
+	// Whether the metrics tee takes a line, see _LOG_emit()
+	static int _LOG_metricstakes(int level, int tlevel) {
+		const int mlevel = __atomic_load_n(&_LOG_metricslevel, __ATOMIC_RELAXED);
+		return mlevel != INT_MAX && (level >= mlevel
+				|| (mlevel == __atomic_load_n(&_LOG_minlevel, __ATOMIC_RELAXED) && tlevel <= level));
+	}
+
+	// Claims a free metrics slot (*used 0) or waits until it is set; 1 if claimed
+	static int _LOG_metricsclaim(int *used) {
+		int u = 0;
+		if (__atomic_compare_exchange_n(used, &u, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+			return 1;
+		while (u == 1) // being set by another thread
+			u = __atomic_load_n(used, __ATOMIC_ACQUIRE);
+		return 0;
+	}
+
+	// Adds v to *d (op 0), or keeps the smaller (op < 0) or larger (op > 0)
+	static void _LOG_fieldupdate(double *d, double v, int op) {
+		double old, new;
+		__atomic_load(d, &old, __ATOMIC_RELAXED);
+		do {
+			new = op == 0 ? old + v : (op < 0 ? v < old : v > old) ? v : old;
+			if (new == old)
+				return;
+		} while (!__atomic_compare_exchange(d, &old, &new, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	}
+
+	// Counts a line on the metrics target, without the mutex. Sites are
+	// keyed by the contents of file: the same file:line is one site,
+	// whichever copy of the name it was logged with.
+	static void _LOG_metricsadd(int level, const char *file, int line, size_t bytes, uint32_t found,
+			const double *v) {
+		struct _l_metrics *m = _LOG_metrics;
+		for (size_t i = 0, h = (unsigned)level % 32; i < 32; ++i, h = (h + 1) % 32) {
+			struct _l_levelcount *c = m->levels + h;
+			if (__atomic_load_n(&c->used, __ATOMIC_ACQUIRE) != 2 && _LOG_metricsclaim(&c->used)) {
+				c->level = level;
+				__atomic_store_n(&c->used, 2, __ATOMIC_RELEASE);
+			} else if (c->level != level) {
+				continue;
+			}
+			__atomic_add_fetch(&c->lines, 1, __ATOMIC_RELAXED);
+			__atomic_add_fetch(&c->bytes, bytes, __ATOMIC_RELAXED);
+			break;
+		}
+		if (file != NULL) {
+			struct _l_sitecount *c = &m->other;
+			size_t h = (_LOG_strhash(file) ^ (uint32_t)line * 2654435761u) % LOGTEE_METRIC_SITES;
+			for (size_t n = 0; n < LOGTEE_METRIC_SITES * 3 / 4; ++n, h = (h + 1) % LOGTEE_METRIC_SITES) {
+				struct _l_sitecount *s = m->sites + h;
+				if (__atomic_load_n(&s->used, __ATOMIC_ACQUIRE) != 2 && _LOG_metricsclaim(&s->used)) {
+					s->line = line;
+					s->level = level;
+					if ((s->file = _LOG_strdup(file)) == NULL) { // counted as other
+						__atomic_store_n(&s->used, 0, __ATOMIC_RELEASE);
+						break;
+					}
+					__atomic_store_n(&s->used, 2, __ATOMIC_RELEASE);
+				} else if (__atomic_load_n(&s->used, __ATOMIC_RELAXED) != 2 || s->line != line
+						|| strcmp(s->file, file) != 0) {
+					continue;
+				}
+				c = s;
+				break;
+			}
+			__atomic_add_fetch(&c->lines, 1, __ATOMIC_RELAXED);
+		}
+		for (int i = 0; found != 0; ++i, found >>= 1) {
+			struct _l_field *f = m->fields + i;
+			if (!(found & 1))
+				continue;
+			_LOG_fieldupdate(&f->min, v[i], -1);
+			_LOG_fieldupdate(&f->max, v[i], 1);
+			_LOG_fieldupdate(&f->sum, v[i], 0);
+			__atomic_add_fetch(&f->count, 1, __ATOMIC_RELEASE);
+		}
+	}
+
+	// Fills b for binary targets. Lines that would be truncated, or with
+	// unsupported formats, are sent rendered (nargs == -1).
+	static void _LOG_binsplit(struct _l_binargs *b, const char *fmt, va_list args) {
+		size_t used = 0, total = 0;
+		va_list ap;
+		va_copy(ap, args);
+		b->nargs = 0;
+		for (const char *p = fmt; *p != '\0'; ) {
+			struct _l_spec sp;
+			if (*p != '%') {
+				size_t lit = strcspn(p, "%");
+				total += lit, p += lit;
+				continue;
+			}
+			if (_LOG_fmtspec(p, &sp) == -1)
+				goto rendered;
+			if (sp.conv != '%') {
+				if (b->nargs == LOGTEE_BIN_MAXARGS)
+					goto rendered;
+				int n = _LOG_fmtarg(p, &sp, &ap, b->buf + used, sizeof(b->buf) - used);
+				if (n < 0 || used + n >= sizeof(b->buf))
+					goto rendered;
+				b->arg[b->nargs] = b->buf + used;
+				b->len[b->nargs++] = n;
+				used += n, total += n;
+			} else {
+				++total;
+			}
+			p += sp.len;
+		}
+		if (total >= LINE_MAX) {
+rendered:
+			b->nargs = -1;
+		}
+		va_end(ap);
+	}
+
+	/*
+	 * CRC32C (Castagnoli), with the SSE4.2 instruction where the CPU has it
+	 */
+	USTATE(pthread_once_t, _LOG_crconce, PTHREAD_ONCE_INIT);
+	USTATE(uint32_t, _LOG_crctab[256], { 0 });
+	USTATE(int, _LOG_crchw, 0);
+
+	static void _LOG_crcinit() {
+		for (uint32_t i = 0; i < 256; ++i) {
+			uint32_t c = i;
+			for (int k = 0; k < 8; ++k)
+				c = c & 1 ? c >> 1 ^ 0x82f63b78u : c >> 1;
+			_LOG_crctab[i] = c;
+		}
+#if defined(__x86_64__)
+		unsigned a, b, c, d;
+		_LOG_crchw = __get_cpuid(1, &a, &b, &c, &d) && (c & 1u << 20);
+#endif
+	}
+
+	static uint32_t _LOG_crc32csw(uint32_t crc, const void *buf, size_t len) {
+		const unsigned char *p = buf;
+		crc = ~crc;
+		while (len-- > 0)
+			crc = _LOG_crctab[(crc ^ *p++) & 0xff] ^ crc >> 8;
+		return ~crc;
+	}
+
+#if defined(__x86_64__)
+	__attribute__((target("sse4.2"))) static uint32_t _LOG_crc32chw(uint32_t crc, const void *buf, size_t len) {
+		const unsigned char *p = buf;
+		uint64_t c = ~crc;
+		for (; len >= 8; len -= 8, p += 8) {
+			uint64_t w;
+			memcpy(&w, p, 8);
+			c = __builtin_ia32_crc32di(c, w);
+		}
+		uint32_t c32 = (uint32_t)c;
+		while (len-- > 0)
+			c32 = __builtin_ia32_crc32qi(c32, *p++);
+		return ~c32;
+	}
+#endif
+
+	// Extends crc (0 to start) with len bytes at buf
+	static uint32_t _LOG_crc32c(uint32_t crc, const void *buf, size_t len) {
+		pthread_once(&_LOG_crconce, _LOG_crcinit);
+#if defined(__x86_64__)
+		if (_LOG_crchw)
+			return _LOG_crc32chw(crc, buf, len);
+#endif
+		return _LOG_crc32csw(crc, buf, len);
+	}
+
+	/*
+	 * Binary encoding. A file starts with "LTEE" and a version byte, then
+	 * records of: tag byte, varint payload length, payload.
+	 *   'S' segment:    varint number. Forgets all dictionary entries.
+	 *   'D' dictionary: varint id (from 1), string bytes
+	 *   'L' line:       zigzag level, varint ids of level prefix, callback
+	 *                   prefix, site file (0: none), varint site line,
+	 *                   varint format id (0: the only argument is the whole
+	 *                   rendered line), varint argument count, then
+	 *                   (varint length, bytes) per conversion, then varint
+	 *                   timestamp (CLOCK_REALTIME ns), varint thread id
+	 *                   and varint CPU + 1 the timestamp was taken on
+	 *                   (0: unknown, or a clock shared by all CPUs)
+	 *   'C' check:      CRC32C (4 bytes, little endian) of the records
+	 *                   since the last check or segment record, whichever
+	 *                   came later (writers append with a new segment)
+	 * Readers ignore fields past the ones they know, so records can grow.
+	 * Each write ends with a check record, so a torn or corrupt tail is
+	 * found by the first check that fails or is missing (logtool verify).
+	 */
+#	define LOGTEE_BIN_MAGIC    "LTEE"
+#	define LOGTEE_BIN_VERSION  1
+
+	struct _l_dictent {
+		uint32_t hash, id;
+		char *str;
+	};
+
+	struct _l_bintee {
+		uint64_t segment, segbytes;
+		uint32_t nextid;
+		struct _l_dictent dict[2 * LOGTEE_DICT_SIZE];
+		unsigned char *out;
+		size_t outsize;
+	};
+
+	static size_t _LOG_putvarint(unsigned char *p, uint64_t v) {
+		size_t n = 0;
+		for (; v >= 0x80; v >>= 7)
+			p[n++] = (unsigned char)v | 0x80;
+		p[n++] = (unsigned char)v;
+		return n;
+	}
+
+	static int _LOG_getvarint(const unsigned char **p, const unsigned char *end, uint64_t *v) {
+		*v = 0;
+		for (unsigned shift = 0; *p < end && shift < 64; shift += 7) {
+			unsigned char c = *(*p)++;
+			*v |= (uint64_t)(c & 0x7f) << shift;
+			if (!(c & 0x80))
+				return 0;
+		}
+		return -1;
+	}
+
+	static size_t _LOG_putrec(unsigned char *p, char tag, const void *payload, size_t len) {
+		size_t n = 0;
+		p[n++] = tag;
+		n += _LOG_putvarint(p + n, len);
+		memcpy(p + n, payload, len);
+		return n + len;
+	}
+
+	// Appends the 'C' record for the len bytes before p, returns its size
+	static size_t _LOG_putcheck(unsigned char *p, size_t len) {
+		uint32_t crc = _LOG_crc32c(0, p - len, len);
+		unsigned char le[4] = { crc & 0xff, crc >> 8 & 0xff, crc >> 16 & 0xff, crc >> 24 };
+		return _LOG_putrec(p, 'C', le, sizeof le);
+	}
+
+	static void _LOG_dictclear(struct _l_bintee *bt) {
+		for (size_t i = 0; i < 2 * LOGTEE_DICT_SIZE; ++i) {
+			_LOG_free(bt->dict[i].str);
+			bt->dict[i].str = NULL;
+		}
+		bt->nextid = 1;
+	}
+
+	// Id of str (0 for NULL), emitting its dictionary record at *out if new
+	static uint32_t _LOG_dictid(struct _l_bintee *bt, const char *str, unsigned char **out) {
+		if (str == NULL)
+			return 0;
+		uint32_t h = _LOG_strhash(str);
+		size_t i = h % (2 * LOGTEE_DICT_SIZE);
+		for (; bt->dict[i].str != NULL; i = (i + 1) % (2 * LOGTEE_DICT_SIZE))
+			if (bt->dict[i].hash == h && strcmp(bt->dict[i].str, str) == 0)
+				return bt->dict[i].id;
+		if ((bt->dict[i].str = _LOG_strdup(str)) == NULL)
+			return 0;
+		bt->dict[i].hash = h;
+		bt->dict[i].id = bt->nextid++;
+
+		size_t len = strlen(str);
+		unsigned char *p = *out;
+		*p++ = 'D';
+		p += _LOG_putvarint(p, _LOG_putvarint((unsigned char[10]){ 0 }, bt->dict[i].id) + len);
+		p += _LOG_putvarint(p, bt->dict[i].id);
+		memcpy(p, str, len);
+		*out = p + len;
+		return bt->dict[i].id;
+	}
+
+	static void _LOG_binfree(struct _l_bintee *bt) {
+		if (bt == NULL)
+			return;
+		_LOG_dictclear(bt);
+		_LOG_free(bt->out);
+		_LOG_free(bt);
+	}
+
+	/**
+	 *  Encodes one line to a binary target. Called locked, returns the
+	 *  bytes written or -1.
+	 */
+	static int _LOG_binwrite(struct _l_fplist *t, int level, const char *prefix, const char *cbprefix,
+			const char *file, int line, const char *fmt, const struct _l_binargs *b, long tid,
+			const char *logline, size_t bytes) {
+		struct _l_bintee *bt = t->bin;
+		const char *strs[] = { prefix, cbprefix, file, b->nargs >= 0 ? fmt : NULL };
+		size_t need = 104 + (b->nargs >= 0 ? 0 : bytes);
+		for (size_t i = 0; i < sizeof strs / sizeof *strs; ++i)
+			need += strs[i] ? strlen(strs[i]) + 16 : 0;
+		for (int i = 0; i < b->nargs; ++i)
+			need += b->len[i] + 10;
+		if (need > bt->outsize) {
+			unsigned char *out = _LOG_realloc(bt->out, need * 2);
+			if (out == NULL)
+				return -1;
+			bt->out = out, bt->outsize = need * 2;
+		}
+
+		unsigned char *p = bt->out, rec[32];
+		if (bt->nextid + 4 > LOGTEE_DICT_SIZE || bt->segbytes >= LOGTEE_SEGMENT_SIZE) {
+			_LOG_dictclear(bt);
+			p += _LOG_putrec(p, 'S', rec, _LOG_putvarint(rec, ++bt->segment));
+			bt->segbytes = 0;
+		}
+		uint32_t ids[4];
+		for (size_t i = 0; i < 4; ++i)
+			if ((ids[i] = _LOG_dictid(bt, strs[i], &p)) == 0 && strs[i] != NULL)
+				goto fail; // out of memory
+
+		// 'L' header fields, then the arguments
+		size_t n = _LOG_putvarint(rec, ((uint64_t)level << 1) ^ (uint64_t)(level >> (sizeof(int) * 8 - 1)));
+		n += _LOG_putvarint(rec + n, ids[0]);
+		n += _LOG_putvarint(rec + n, ids[1]);
+		n += _LOG_putvarint(rec + n, ids[2]);
+		n += _LOG_putvarint(rec + n, line);
+		n += _LOG_putvarint(rec + n, ids[3]);
+		n += _LOG_putvarint(rec + n, b->nargs >= 0 ? b->nargs : 1);
+		size_t payload = n;
+		if (b->nargs >= 0)
+			for (int i = 0; i < b->nargs; ++i)
+				payload += _LOG_putvarint((unsigned char[10]){ 0 }, b->len[i]) + b->len[i];
+		else
+			payload += _LOG_putvarint((unsigned char[10]){ 0 }, bytes) + bytes;
+		unsigned char tail[30];
+		size_t ntail = _LOG_putvarint(tail, b->ts);
+		ntail += _LOG_putvarint(tail + ntail, (uint64_t)tid);
+		ntail += _LOG_putvarint(tail + ntail, (uint64_t)(b->cpu + 1));
+		payload += ntail;
+		*p++ = 'L';
+		p += _LOG_putvarint(p, payload);
+		memcpy(p, rec, n);
+		p += n;
+		if (b->nargs >= 0) {
+			for (int i = 0; i < b->nargs; ++i) {
+				p += _LOG_putvarint(p, b->len[i]);
+				memcpy(p, b->arg[i], b->len[i]);
+				p += b->len[i];
+			}
+		} else {
+			p += _LOG_putvarint(p, bytes);
+			memcpy(p, logline, bytes);
+			p += bytes;
+		}
+		memcpy(p, tail, ntail);
+		p += ntail;
+		p += _LOG_putcheck(p, p - bt->out);
+
+		size_t len = p - bt->out;
+		if (fwrite(bt->out, 1, len, t->fp) != len)
+			goto fail;
+		bt->segbytes += len;
+		return (int)len;
+fail:
+		// entries just added to the dictionary never reached the file, so
+		// the next line starts a new segment instead of referring to them
+		_LOG_dictclear(bt);
+		bt->segbytes = LOGTEE_SEGMENT_SIZE;
+		return -1;
+	}
+
+	// Starts a binary target: file header when empty, then a fresh segment
+	static struct _l_bintee *_LOG_binopen(FILE *fp) {
+		struct _l_bintee *bt = _LOG_calloc(1, sizeof(*bt));
+		if (bt == NULL)
+			return NULL;
+		bt->nextid = 1;
+		unsigned char hdr[24], seg[8];
+		size_t n = 0;
+		if (ftell(fp) <= 0) {
+			memcpy(hdr, LOGTEE_BIN_MAGIC, 4);
+			hdr[4] = LOGTEE_BIN_VERSION;
+			n = 5;
+		}
+		size_t start = n;
+		n += _LOG_putrec(hdr + n, 'S', seg, _LOG_putvarint(seg, 0));
+		n += _LOG_putcheck(hdr + n, n - start);
+		if (fwrite(hdr, 1, n, fp) != n || fflush(fp) == EOF) {
+			_LOG_free(bt);
+			return NULL;
+		}
+		return bt;
+	}
+
+	/*
+	 * Binary decoding
+	 */
+
+	// A decoded line; strings point into the reader and live until its next call
+	struct LOG_binrecord {
+		int level;
+		const char *prefix, *cbprefix, *file, *fmt;   // NULL when absent
+		int line;
+		uint64_t segment;
+		uint64_t ts;                                  // CLOCK_REALTIME ns, 0 if unknown
+		long tid;
+		int cpu;                                      // that ts was read on, -1 if unknown
+		size_t nargs;
+		const char *args[LOGTEE_BIN_MAXARGS];
+		size_t arglens[LOGTEE_BIN_MAXARGS];
+		const char *text;                             // the line as text targets got it
+		size_t textlen;
+	};
+
+	struct LOG_binreader {
+		FILE *fp;
+		int started;
+		uint64_t segment;
+		uint32_t crc;                                 // of the records since the last check
+		uint64_t checks;                              // check records that matched
+		long verified;                                // offset past the last of them
+		char **dict;                                  // by id - 1
+		size_t ndict, dictsize;
+		unsigned char *buf;
+		size_t bufsize;
+		char *text;
+		size_t textsize;
+	};
+
+	inline static void LOG_binreader_init(struct LOG_binreader *r, FILE *fp) {
+		memset(r, 0, sizeof(*r));
+		r->fp = fp;
+	}
+
+	inline static void LOG_binreader_free(struct LOG_binreader *r) {
+		for (size_t i = 0; i < r->ndict; ++i)
+			free(r->dict[i]);
+		free(r->dict);
+		free(r->buf);
+		free(r->text);
+	}
+
+	static const char *_LOG_bindict(const struct LOG_binreader *r, uint64_t id) {
+		return id > 0 && id <= r->ndict ? r->dict[id - 1] : NULL;
+	}
+
+	static int _LOG_bintext(struct LOG_binreader *r, struct LOG_binrecord *rec) {
+		size_t need = 1 + (rec->cbprefix ? strlen(rec->cbprefix) : 0)
+			+ (rec->prefix ? strlen(rec->prefix) : 0) + (rec->fmt ? strlen(rec->fmt) : 0);
+		for (size_t i = 0; i < rec->nargs; ++i)
+			need += rec->arglens[i];
+		if (need > r->textsize) {
+			char *text = realloc(r->text, need);
+			if (text == NULL)
+				return -1;
+			r->text = text, r->textsize = need;
+		}
+		char *p = r->text;
+		for (const char *s = rec->cbprefix; s && *s; )
+			*p++ = *s++;
+		for (const char *s = rec->prefix; s && *s; )
+			*p++ = *s++;
+		size_t arg = 0;
+		if (rec->fmt == NULL) {
+			if (rec->nargs != 1)
+				return -1;
+			memcpy(p, rec->args[0], rec->arglens[0]);
+			p += rec->arglens[0];
+		} else for (const char *f = rec->fmt; *f != '\0'; ) {
+			struct _l_spec sp;
+			if (*f != '%') {
+				*p++ = *f++;
+			} else if (_LOG_fmtspec(f, &sp) == -1 || (sp.conv != '%' && arg == rec->nargs)) {
+				return -1;
+			} else {
+				if (sp.conv == '%')
+					*p++ = '%';
+				else
+					memcpy(p, rec->args[arg], rec->arglens[arg]), p += rec->arglens[arg++];
+				f += sp.len;
+			}
+		}
+		*p = '\0';
+		rec->text = r->text;
+		rec->textlen = p - r->text;
+		return 0;
+	}
+
+	/**
+	 *  Reads the next line. Returns 1 with rec filled, 0 at the end of the
+	 *  data written so far (the reader stays at the last complete record, so
+	 *  it can be called again as the file grows) and -1 on corrupt input,
+	 *  including a failed check record. Lines are handed out before the
+	 *  check that covers them is read.
+	 */
+	inline static int LOG_binnext(struct LOG_binreader *r, struct LOG_binrecord *rec) {
+		for (;;) {
+			long start = ftell(r->fp);
+			unsigned char hdr[11];
+			size_t got;
+			if (!r->started) {
+				if ((got = fread(hdr, 1, 5, r->fp)) < 5)
+					goto incomplete;
+				if (memcmp(hdr, LOGTEE_BIN_MAGIC, 4) != 0 || hdr[4] != LOGTEE_BIN_VERSION)
+					return -1;
+				r->started = 1;
+				continue;
+			}
+
+			// tag and length, then the payload
+			int c = fgetc(r->fp);
+			if (c == EOF)
+				goto incomplete;
+			uint64_t len = 0;
+			size_t n = 0;
+			do {
+				int b = fgetc(r->fp);
+				if (b == EOF)
+					goto incomplete;
+				hdr[n++] = b;
+			} while ((hdr[n - 1] & 0x80) && n < sizeof hdr);
+			const unsigned char *hp = hdr;
+			if (_LOG_getvarint(&hp, hdr + n, &len) == -1 || len > (1u << 30))
+				return -1;
+			if (len + 1 > r->bufsize) {
+				unsigned char *buf = realloc(r->buf, len + 1);
+				if (buf == NULL)
+					return -1;
+				r->buf = buf, r->bufsize = len + 1;
+			}
+			if (fread(r->buf, 1, len, r->fp) != len)
+				goto incomplete;
+			r->buf[len] = '\0';
+			if (c == 'C') {
+				uint32_t want = len == 4 ? r->buf[0] | r->buf[1] << 8 | r->buf[2] << 16 | (uint32_t)r->buf[3] << 24 : 0;
+				if (len != 4 || want != r->crc)
+					return -1;
+				r->crc = 0, ++r->checks, r->verified = ftell(r->fp);
+				continue;
+			}
+			unsigned char tag = (unsigned char)c;
+			if (c == 'S')
+				r->crc = 0;
+			r->crc = _LOG_crc32c(_LOG_crc32c(_LOG_crc32c(r->crc, &tag, 1), hdr, n), r->buf, len);
+
+			const unsigned char *p = r->buf, *end = r->buf + len;
+			uint64_t v[7];
+			switch (c) {
+			case 'S':
+				if (_LOG_getvarint(&p, end, &r->segment) == -1)
+					return -1;
+				for (size_t i = 0; i < r->ndict; ++i)
+					free(r->dict[i]);
+				r->ndict = 0;
+				break;
+			case 'D':
+				if (_LOG_getvarint(&p, end, v) == -1 || v[0] != r->ndict + 1)
+					return -1;
+				if (r->ndict == r->dictsize) {
+					size_t size = r->dictsize ? 2 * r->dictsize : 64;
+					char **dict = realloc(r->dict, size * sizeof(*dict));
+					if (dict == NULL)
+						return -1;
+					r->dict = dict, r->dictsize = size;
+				}
+				if ((r->dict[r->ndict] = malloc(end - p + 1)) == NULL)
+					return -1;
+				memcpy(r->dict[r->ndict], p, end - p);
+				r->dict[r->ndict++][end - p] = '\0';
+				break;
+			case 'L':
+				for (size_t i = 0; i < 7; ++i)
+					if (_LOG_getvarint(&p, end, v + i) == -1)
+						return -1;
+				if (v[6] > LOGTEE_BIN_MAXARGS)
+					return -1;
+				rec->level = (int)((v[0] >> 1) ^ -(v[0] & 1));
+				rec->prefix = _LOG_bindict(r, v[1]);
+				rec->cbprefix = _LOG_bindict(r, v[2]);
+				rec->file = _LOG_bindict(r, v[3]);
+				rec->line = (int)v[4];
+				rec->fmt = _LOG_bindict(r, v[5]);
+				rec->segment = r->segment;
+				rec->nargs = v[6];
+				for (size_t i = 0; i < rec->nargs; ++i) {
+					uint64_t alen;
+					if (_LOG_getvarint(&p, end, &alen) == -1 || alen > (uint64_t)(end - p))
+						return -1;
+					rec->args[i] = (const char *)p;
+					rec->arglens[i] = alen;
+					p += alen;
+				}
+				rec->ts = 0, rec->tid = 0, rec->cpu = -1;
+				if (p < end) {
+					if (_LOG_getvarint(&p, end, &rec->ts) == -1 || _LOG_getvarint(&p, end, v) == -1)
+						return -1;
+					rec->tid = (long)v[0];
+				}
+				if (p < end) {
+					if (_LOG_getvarint(&p, end, v) == -1)
+						return -1;
+					rec->cpu = (int)v[0] - 1;
+				}
+				return _LOG_bintext(r, rec) == -1 ? -1 : 1;
+			default: // unknown records are skipped
+				break;
+			}
+			continue;
+incomplete:
+			clearerr(r->fp);
+			fseek(r->fp, start, SEEK_SET);
+			return 0;
+		}
+	}
+
+	/*
+	 * Merging timestamped records (several binary logs, or one log's threads)
+	 * into one order. TSC readings can be slightly off between CPUs, so the
+	 * per-CPU offset is estimated from the threads that moved: a thread's
+	 * next record is later than its previous one, so a move from CPU x to y
+	 * bounds offset[y] - offset[x] by the (raw) time between the two. Moves
+	 * both ways bound it from both sides and the middle is taken, as NTP
+	 * does with round trips. CPUs are then chained from the lowest one.
+	 */
+	struct LOG_mergeitem {
+		uint64_t ts;                    // as recorded, corrected by LOG_merge()
+		long tid;
+		int cpu;                        // -1 if unknown
+		unsigned stream;                // e.g. the file, with the tid names a thread
+		size_t index;                   // position in the input, set by LOG_merge()
+		void *data;                     // the caller's
+	};
+
+	struct _l_migration {
+		int x, y;
+		int64_t diff;                   // least raw time seen between x and y
+	};
+
+	static int _LOG_threadcmp(const void *a, const void *b) {
+		const struct LOG_mergeitem *p = *(const struct LOG_mergeitem *const *)a;
+		const struct LOG_mergeitem *q = *(const struct LOG_mergeitem *const *)b;
+		if (p->stream != q->stream)
+			return p->stream < q->stream ? -1 : 1;
+		if (p->tid != q->tid)
+			return p->tid < q->tid ? -1 : 1;
+		return p->index < q->index ? -1 : p->index > q->index;
+	}
+
+	static int _LOG_paircmp(const void *a, const void *b) {
+		const struct _l_migration *p = a, *q = b;
+		return p->x != q->x ? p->x - q->x : p->y - q->y;
+	}
+
+	static int _LOG_migrationcmp(const void *a, const void *b) {
+		const struct _l_migration *p = a, *q = b;
+		int c = _LOG_paircmp(a, b);
+		return c ? c : p->diff < q->diff ? -1 : p->diff > q->diff;
+	}
+
+	static int _LOG_mergecmp(const void *a, const void *b) {
+		const struct LOG_mergeitem *p = a, *q = b;
+		if (p->ts != q->ts)
+			return p->ts < q->ts ? -1 : 1;
+		return p->index < q->index ? -1 : p->index > q->index;
+	}
+
+	/**
+	 *  Sorts items by timestamp, after removing the estimated offset of each
+	 *  CPU; ties and each thread's own order stay as they were input, with a
+	 *  thread's records given in the order it wrote them. The offsets taken
+	 *  off go to offsets[cpu] for cpu < noffsets. Returns 0, or -1 without
+	 *  memory (items are untouched).
+	 */
+	inline static int LOG_merge(struct LOG_mergeitem *items, size_t n, int64_t *offsets, size_t noffsets) {
+		int ncpus = 0;
+		for (size_t i = 0; i < n; ++i) {
+			items[i].index = i;
+			if (items[i].cpu >= ncpus)
+				ncpus = items[i].cpu + 1;
+		}
+		struct LOG_mergeitem **byth = malloc((n ? n : 1) * sizeof(*byth));
+		struct _l_migration *m = malloc((n ? n : 1) * sizeof(*m));
+		int64_t *off = calloc(ncpus ? ncpus : 1, sizeof(*off));
+		char *known = calloc(ncpus ? ncpus : 1, 1);
+		if (byth == NULL || m == NULL || off == NULL || known == NULL) {
+			free(byth), free(m), free(off), free(known);
+			return -1;
+		}
+		for (size_t i = 0; i < n; ++i)
+			byth[i] = items + i;
+		qsort(byth, n, sizeof(*byth), _LOG_threadcmp);
+
+		// the least raw time of each move between two CPUs
+		size_t nm = 0;
+		for (size_t i = 1; i < n; ++i) {
+			const struct LOG_mergeitem *a = byth[i - 1], *b = byth[i];
+			if (a->stream == b->stream && a->tid == b->tid && a->cpu != b->cpu && a->cpu >= 0 && b->cpu >= 0)
+				m[nm++] = (struct _l_migration){ a->cpu, b->cpu, (int64_t)(b->ts - a->ts) };
+		}
+		qsort(m, nm, sizeof(*m), _LOG_migrationcmp);
+		size_t npairs = 0;
+		for (size_t i = 0; i < nm; ++i)
+			if (npairs == 0 || m[npairs - 1].x != m[i].x || m[npairs - 1].y != m[i].y)
+				m[npairs++] = m[i];
+
+		// estimate offset[y] - offset[x] per pair, then chain them
+		for (int root = 0; root < ncpus; ++root) {
+			if (known[root])
+				continue;
+			known[root] = 1;
+			for (int changed = 1; changed; ) {
+				changed = 0;
+				for (size_t i = 0; i < npairs; ++i) {
+					int x = m[i].x, y = m[i].y;
+					if (known[x] == known[y])
+						continue;
+					struct _l_migration key = { y, x, 0 }, *back =
+						bsearch(&key, m, npairs, sizeof(*m), _LOG_paircmp);
+					int64_t upper = m[i].diff, d;
+					if (back != NULL) // back->diff bounds offset[x] - offset[y]
+						d = upper / 2 - back->diff / 2;
+					else
+						d = upper < 0 ? upper : 0;
+					if (known[x])
+						off[y] = off[x] + d, known[y] = 1;
+					else
+						off[x] = off[y] - d, known[x] = 1;
+					changed = 1;
+				}
+			}
+		}
+
+		for (size_t i = 0; i < n; ++i)
+			if (items[i].cpu >= 0)
+				items[i].ts -= off[items[i].cpu];
+		// no thread goes back in time, should the estimate be short
+		for (size_t i = 1; i < n; ++i) {
+			struct LOG_mergeitem *a = byth[i - 1], *b = byth[i];
+			if (a->stream == b->stream && a->tid == b->tid && b->ts < a->ts)
+				b->ts = a->ts;
+		}
+		qsort(items, n, sizeof(*items), _LOG_mergecmp);
+		for (int cpu = 0; offsets != NULL && (size_t)cpu < noffsets; ++cpu)
+			offsets[cpu] = cpu < ncpus ? off[cpu] : 0;
+		free(byth), free(m), free(off), free(known);
+		return 0;
+	}
+
+#if defined(__linux__)
+	/*
+	 * Follow reader (Linux): maps a text log and hands out its lines in
+	 * place, waking on inotify instead of polling. A line view points into
+	 * the mapping and stays valid until the next LOG_follownext() call.
+	 * Rotation by rename or delete is followed once the old file is read to
+	 * its last complete line; a truncated file is read again from the start,
+	 * though truncating under a reader can fault it (SIGBUS), so rotate by
+	 * renaming.
+	 */
+	struct LOG_lineview {
+		const char *ptr;    // not NUL terminated
+		size_t len;         // without the '\n'
+	};
+
+	struct LOG_follower {
+		char *path;
+		int fd, ifd, wd, dwd;
+		dev_t dev;
+		ino_t ino;
+		const char *map;
+		size_t maplen;
+		off_t size, off;    // mapped file size, next unread byte
+	};
+
+	// Maps f->fd through its current size, with room to grow in place
+	static int _LOG_followmap(struct LOG_follower *f) {
+		struct stat st;
+		if (fstat(f->fd, &st) == -1)
+			return -1;
+		if (st.st_size < f->off)  // truncated
+			f->off = 0;
+		if ((size_t)st.st_size > f->maplen) {
+			size_t page = sysconf(_SC_PAGESIZE), len = st.st_size * 2 > (1 << 20) ? st.st_size * 2 : (1 << 20);
+			len = (len + page - 1) / page * page;
+			void *map = mmap(NULL, len, PROT_READ, MAP_SHARED, f->fd, 0);
+			if (map == MAP_FAILED)
+				return -1;
+			if (f->map != NULL)
+				munmap((void *)f->map, f->maplen);
+			f->map = map, f->maplen = len;
+		}
+		f->size = st.st_size;
+		return 0;
+	}
+
+	static int _LOG_followopen(struct LOG_follower *f) {
+		int fd = open(f->path, O_RDONLY | O_CLOEXEC);
+		struct stat st;
+		if (fd == -1 || fstat(fd, &st) == -1) {
+			if (fd != -1)
+				close(fd);
+			return -1;
+		}
+		if (f->fd != -1)
+			close(f->fd);
+		if (f->map != NULL)
+			munmap((void *)f->map, f->maplen);
+		if (f->wd != -1)
+			inotify_rm_watch(f->ifd, f->wd);
+		f->fd = fd, f->dev = st.st_dev, f->ino = st.st_ino;
+		f->map = NULL, f->maplen = 0, f->size = f->off = 0;
+		f->wd = inotify_add_watch(f->ifd, f->path, IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+		return _LOG_followmap(f);
+	}
+
+	inline static void LOG_followclose(struct LOG_follower *f) {
+		if (f->map != NULL)
+			munmap((void *)f->map, f->maplen);
+		if (f->fd != -1)
+			close(f->fd);
+		if (f->ifd != -1)
+			close(f->ifd);
+		free(f->path);
+		f->path = NULL, f->map = NULL, f->fd = f->ifd = -1;
+	}
+
+	/**
+	 *  Opens path for following, positioned before its last `last' complete
+	 *  lines (all of them when negative). Returns 0 or -1 with errno set.
+	 */
+	inline static int LOG_followopen(struct LOG_follower *f, const char *path, long last) {
+		memset(f, 0, sizeof(*f));
+		f->fd = f->wd = f->dwd = -1;
+		if ((f->path = strdup(path)) == NULL || (f->ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1) {
+			free(f->path);
+			return -1;
+		}
+		// the directory watch sees the replacement of a rotated file appear
+		char *dir = strdup(path), *slash = dir ? strrchr(dir, '/') : NULL;
+		if (dir != NULL) {
+			if (slash == dir)
+				slash[1] = '\0';
+			else if (slash != NULL)
+				*slash = '\0';
+			f->dwd = inotify_add_watch(f->ifd, slash ? dir : ".", IN_CREATE | IN_MOVED_TO);
+			free(dir);
+		}
+		if (_LOG_followopen(f) == -1) {
+			int e = errno;
+			LOG_followclose(f);
+			errno = e;
+			return -1;
+		}
+		if (last >= 0) {
+			off_t end = f->size, off;
+			while (end > 0 && f->map[end - 1] != '\n')  // partial last line
+				--end;
+			for (off = end; off > 0 && last > 0; --off)
+				if (off < end && f->map[off - 1] == '\n' && --last == 0)
+					break;
+			f->off = off;
+		}
+		return 0;
+	}
+
+	/**
+	 *  Waits up to timeout_ms (-1: forever) for the next complete line.
+	 *  Returns 1 with v set, 0 on timeout and -1 on error.
+	 */
+	inline static int LOG_follownext(struct LOG_follower *f, struct LOG_lineview *v, int timeout_ms) {
+		for (;;) {
+			if (f->off < f->size) {
+				const char *p = f->map + f->off, *nl = memchr(p, '\n', f->size - f->off);
+				if (nl != NULL) {
+					v->ptr = p, v->len = nl - p;
+					f->off += v->len + 1;
+					return 1;
+				}
+			}
+			off_t seen = f->size, off = f->off;
+			if (_LOG_followmap(f) == -1)
+				return -1;
+			if (f->size != seen || f->off != off)
+				continue;
+
+			// drained: move on if the path now names another file
+			struct stat st;
+			if (stat(f->path, &st) == 0 && (st.st_dev != f->dev || st.st_ino != f->ino)) {
+				if (_LOG_followopen(f) == -1 && errno != ENOENT)
+					return -1;
+				continue;
+			}
+
+			struct pollfd pfd = { .fd = f->ifd, .events = POLLIN };
+			int n = poll(&pfd, 1, timeout_ms);
+			if (n == 0)
+				return 0;
+			if (n == -1 && errno != EINTR)
+				return -1;
+			char events[4096];
+			while (read(f->ifd, events, sizeof events) > 0)
+				;
+		}
+	}
+#endif
+
+	/*
+	 * Broadcast ring: lines in a power-of-two byte ring that the writer
+	 * overwrites oldest first, never waiting for readers. Records are
+	 *   uint64 seq, uint32 length, int32 level, bytes padded to 8
+	 * and a length of UINT32_MAX marks the unused end of a lap. Positions
+	 * count bytes from the start and grow forever; `tail' is the oldest
+	 * intact record. The writer moves tail past records before overwriting
+	 * them, so a reader that copied a record and still finds tail at or
+	 * before it knows the copy is whole (seqlock style). All ring words are
+	 * accessed atomically, which lets readers live in other processes.
+	 * The same layout backs shared memory rings, circular files and memory
+	 * rings, which are unlinked shared memory only this process can map.
+	 */
+#	define LOGTEE_RING_MAGIC    "LTEERING"
+#	define LOGTEE_RING_VERSION  1
+#	define _LOG_RINGWRAP        UINT32_MAX
+	enum { _LOG_RINGFILE, _LOG_RINGSHM, _LOG_RINGMEM };
+
+	struct _l_ringhdr {
+		char magic[8];
+		uint32_t version, hdrsize;
+		uint64_t size;                          // data bytes
+		uint64_t seq;                           // records written
+		uint64_t head __attribute__((aligned(64)));
+		uint64_t tail;
+	};
+
+	struct _l_ring {
+		struct _l_ringhdr *hdr;                 // mapping, data follows at hdrsize
+		size_t maplen;
+		char *name;                             // shared memory object, file or label
+		int type;                               // _LOG_RINGFILE...
+		int fd;                                 // _LOG_RINGMEM: what readers map
+		struct _l_memring *mem;                 // _LOG_RINGMEM: its reader entry
+		dev_t dev;
+		ino_t ino;
+		char scratch[2 * LINE_MAX];
+	};
+
+	/*
+	 * Memory rings by name for their readers, under a mutex of their own:
+	 * LOG() never takes _LOG_memmtx and readers never take _LOG_mtx. An
+	 * entry shares the tee's mapping and fd, and whoever drops the last
+	 * reference, the tee or a snapshot, unmaps them.
+	 */
+	struct _l_memring {
+		struct _l_memring *next;
+		const char *name;                       // the ring's, while listed
+		struct _l_ringhdr *hdr;
+		size_t maplen;
+		int fd, refs;
+	};
+	USTATE(pthread_mutex_t, _LOG_memmtx, PTHREAD_MUTEX_INITIALIZER);
+	USTATE(struct _l_memring *, _LOG_memrings, NULL);
+
+	// The memory ring `name' with a reference taken, NULL and ENOENT if none
+	static struct _l_memring *_LOG_memringget(const char *name) {
+		pthread_mutex_lock(&_LOG_memmtx);
+		struct _l_memring *m = _LOG_memrings;
+		while (m != NULL && strcmp(m->name, name) != 0)
+			m = m->next;
+		if (m != NULL)
+			++m->refs;
+		pthread_mutex_unlock(&_LOG_memmtx);
+		if (m == NULL)
+			errno = ENOENT;
+		return m;
+	}
+
+	static void _LOG_memringput(struct _l_memring *m) {
+		pthread_mutex_lock(&_LOG_memmtx);
+		int last = --m->refs == 0;
+		pthread_mutex_unlock(&_LOG_memmtx);
+		if (last) {
+			munmap(m->hdr, m->maplen);
+			close(m->fd);
+			_LOG_free(m);
+		}
+	}
+
+	static uint64_t *_LOG_ringword(const struct _l_ringhdr *h, uint64_t pos) {
+		return (uint64_t *)((char *)h + h->hdrsize + (pos & (h->size - 1)));
+	}
+
+	static void _LOG_ringfree(struct _l_ring *ring) {
+		if (ring == NULL)
+			return;
+		if (ring->mem != NULL) { // unlisted at once, unmapped by the last reader
+			pthread_mutex_lock(&_LOG_memmtx);
+			struct _l_memring **mp = &_LOG_memrings;
+			while (*mp != ring->mem)
+				mp = &(*mp)->next;
+			*mp = ring->mem->next;
+			pthread_mutex_unlock(&_LOG_memmtx);
+			_LOG_memringput(ring->mem);
+		} else {
+			munmap(ring->hdr, ring->maplen);
+		}
+		if (ring->type == _LOG_RINGSHM)
+			shm_unlink(ring->name);
+		if (ring->type == _LOG_RINGMEM && ring->mem == NULL)
+			close(ring->fd);
+		if (ring->type != _LOG_RINGFILE)
+			_LOG_memcharge(-(ssize_t)ring->maplen);
+		_LOG_free(ring->name);
+		_LOG_free(ring);
+	}
+
+	// Appends a line. Called locked, returns the bytes stored.
+	static int _LOG_ringwrite(struct _l_ring *ring, int level, const char *cbprefix, const char *prefix,
+			const char *line, int target) {
+		struct _l_ringhdr *h = ring->hdr;
+		int n = snprintf(ring->scratch, sizeof(ring->scratch), "%s%s%s", cbprefix, prefix, line);
+		size_t len = n < 0 ? 0 : (size_t)n >= sizeof(ring->scratch) ? sizeof(ring->scratch) - 1 : (size_t)n;
+		if (len > h->size / 4)
+			len = h->size / 4;
+		size_t padded = (len + 7) & ~(size_t)7;
+		memset(ring->scratch + len, 0, padded - len);
+
+		uint64_t head = h->head, tail = h->tail, size = h->size;
+		uint64_t skip = (head & (size - 1)) + 16 + padded > size ? size - (head & (size - 1)) : 0;
+		uint64_t end = head + skip + 16 + padded;
+		while (end - tail > size) { // retire the oldest records first
+			uint64_t w = *_LOG_ringword(h, tail + 8);
+			uint32_t rlen = (uint32_t)w;
+			tail += rlen == _LOG_RINGWRAP ? size - (tail & (size - 1)) : 16 + ((rlen + 7) & ~7u);
+		}
+		__atomic_store_n(&h->tail, tail, __ATOMIC_RELAXED);
+
+		// release stores: a reader that sees any of them sees the new tail
+		if (skip > 0) {
+			__atomic_store_n(_LOG_ringword(h, head + 8), (uint64_t)_LOG_RINGWRAP, __ATOMIC_RELEASE);
+			_LOG_PROBE3(rotate, level, len, target);
+		}
+		uint64_t pos = head + skip, seq = h->seq;
+		__atomic_store_n(_LOG_ringword(h, pos), seq, __ATOMIC_RELEASE);
+		__atomic_store_n(_LOG_ringword(h, pos + 8), (uint64_t)(uint32_t)level << 32 | len, __ATOMIC_RELEASE);
+		for (size_t i = 0; i < padded; i += 8) {
+			uint64_t w;
+			memcpy(&w, ring->scratch + i, 8);
+			__atomic_store_n(_LOG_ringword(h, pos + 16 + i), w, __ATOMIC_RELEASE);
+		}
+		__atomic_store_n(&h->seq, seq + 1, __ATOMIC_RELAXED);
+		__atomic_store_n(&h->head, end, __ATOMIC_RELEASE);
+		return (int)len;
+	}
+
+	static uint64_t _LOG_ringmagic() {
+		uint64_t magic;
+		memcpy(&magic, LOGTEE_RING_MAGIC, sizeof(magic));
+		return magic;
+	}
+
+	static int _LOG_ringvalid(const struct _l_ringhdr *h, size_t maplen) {
+		uint64_t head, tail;
+		do { // a live writer may retire past a head read before its tail
+			head = __atomic_load_n(&h->head, __ATOMIC_ACQUIRE);
+			tail = __atomic_load_n(&h->tail, __ATOMIC_ACQUIRE);
+		} while (head != __atomic_load_n(&h->head, __ATOMIC_ACQUIRE));
+		return __atomic_load_n((const uint64_t *)h->magic, __ATOMIC_ACQUIRE) == _LOG_ringmagic()
+			&& h->version == LOGTEE_RING_VERSION && h->size > 0 && (h->size & (h->size - 1)) == 0
+			&& h->hdrsize >= sizeof(*h) && h->hdrsize + h->size <= maplen
+			&& head >= tail && head - tail <= h->size;
+	}
+
+	// Memory rings: a shared memory object that is gone from /dev/shm at once
+	static int _LOG_memfd() {
+		static unsigned n;
+		char name[64];
+		for (int tries = 0; tries < 100; ++tries) {
+			snprintf(name, sizeof name, "/logtee-mem-%d-%u", (int)getpid(), __atomic_fetch_add(&n, 1, __ATOMIC_RELAXED));
+			int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+			if (fd != -1) {
+				shm_unlink(name);
+				return fd;
+			}
+			if (errno != EEXIST)
+				break;
+		}
+		return -1;
+	}
+
+	/**
+	 *  Ring of `size' data bytes (a power of two) in shared memory object or
+	 *  file `name', or in memory labelled `name'. A file that already holds
+	 *  a ring of that size is carried on, so a circular log survives restarts.
+	 */
+	static struct _l_ring *_LOG_ringopen(const char *name, size_t size, int type) {
+		struct _l_ring *ring = _LOG_calloc(1, sizeof(*ring));
+		struct stat st;
+		if (ring == NULL)
+			return NULL;
+		ring->maplen = sizeof(struct _l_ringhdr) + size;
+		ring->type = type;
+		if (type != _LOG_RINGFILE && _LOG_memcharge(ring->maplen) == -1) { // shared memory is ours too
+			_LOG_free(ring);
+			return NULL;
+		}
+		int fd = type == _LOG_RINGSHM ? shm_open(name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)
+			: type == _LOG_RINGMEM ? _LOG_memfd() : open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+		int keep = type == _LOG_RINGFILE && fd != -1 && fstat(fd, &st) == 0 && (size_t)st.st_size == ring->maplen;
+		if (fd == -1 || (!keep && (ftruncate(fd, 0) == -1 || ftruncate(fd, ring->maplen) == -1))
+				|| (ring->hdr = mmap(NULL, ring->maplen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED
+				|| (ring->name = _LOG_strdup(name)) == NULL || fstat(fd, &st) == -1) {
+			int e = errno;
+			if (fd != -1) {
+				if (ring->hdr != NULL && ring->hdr != MAP_FAILED)
+					munmap(ring->hdr, ring->maplen);
+				close(fd);
+				if (type == _LOG_RINGSHM)
+					shm_unlink(name);
+			}
+			if (type != _LOG_RINGFILE)
+				_LOG_memcharge(-(ssize_t)ring->maplen);
+			_LOG_free(ring->name);
+			_LOG_free(ring);
+			errno = e;
+			return NULL;
+		}
+		if (type == _LOG_RINGMEM)
+			ring->fd = fd;
+		else
+			close(fd);
+		ring->dev = st.st_dev, ring->ino = st.st_ino;
+		if (keep && _LOG_ringvalid(ring->hdr, ring->maplen) && ring->hdr->size == size)
+			return ring;
+		memset(ring->hdr, 0, sizeof(*ring->hdr));
+		ring->hdr->version = LOGTEE_RING_VERSION;
+		ring->hdr->hdrsize = sizeof(struct _l_ringhdr);
+		ring->hdr->size = size;
+		__atomic_store_n((uint64_t *)ring->hdr->magic, _LOG_ringmagic(), __ATOMIC_RELEASE);
+		if (type == _LOG_RINGMEM) { // listed for readers once set up
+			struct _l_memring *m = _LOG_calloc(1, sizeof(*m));
+			if (m == NULL) {
+				_LOG_ringfree(ring);
+				return NULL;
+			}
+			*m = (struct _l_memring){ NULL, ring->name, ring->hdr, ring->maplen, fd, 1 };
+			pthread_mutex_lock(&_LOG_memmtx);
+			m->next = _LOG_memrings;
+			_LOG_memrings = ring->mem = m;
+			pthread_mutex_unlock(&_LOG_memmtx);
+		}
+		return ring;
+	}
+
+	/**
+	 *  Ring reader. LOG_ringnext() copies the next line into buf (NUL
+	 *  terminated, cut at size - 1) and fills line; line->lost counts the
+	 *  lines overwritten before this reader got to them. Returns 1, 0 when
+	 *  there is nothing new (or the reader got to `end', if set), -1 on a
+	 *  corrupt ring.
+	 */
+	struct LOG_ringline {
+		uint64_t seq;
+		int level;
+		size_t len;
+		uint64_t lost;
+	};
+
+	struct LOG_ringreader {
+		const struct _l_ringhdr *hdr;
+		size_t maplen;
+		uint64_t pos, seq;
+		uint64_t end;                           // 0, or a head to stop at
+	};
+
+	inline static int LOG_ringnext(struct LOG_ringreader *r, char *buf, size_t size, struct LOG_ringline *line) {
+		const struct _l_ringhdr *h = r->hdr;
+		for (;;) {
+			if (r->pos == __atomic_load_n(&h->head, __ATOMIC_ACQUIRE) || (r->end != 0 && r->pos >= r->end))
+				return 0;
+			uint64_t tail = __atomic_load_n(&h->tail, __ATOMIC_ACQUIRE);
+			if (r->pos < tail)
+				r->pos = tail;
+			if (r->end != 0 && r->pos >= r->end) // lapped past it
+				return 0;
+			uint64_t seq = __atomic_load_n(_LOG_ringword(h, r->pos), __ATOMIC_ACQUIRE);
+			uint64_t w = __atomic_load_n(_LOG_ringword(h, r->pos + 8), __ATOMIC_ACQUIRE);
+			uint32_t len = (uint32_t)w;
+			size_t copied = 0;
+			if (len != _LOG_RINGWRAP) {
+				if (len > h->size / 2)
+					goto torn;
+				for (size_t i = 0; i < len; i += 8) {
+					uint64_t d = __atomic_load_n(_LOG_ringword(h, r->pos + 16 + i), __ATOMIC_ACQUIRE);
+					size_t n = len - i < 8 ? len - i : 8;
+					if (copied + n >= size)
+						n = size > copied ? size - copied - 1 : 0;
+					memcpy(buf + copied, &d, n);
+					copied += n;
+				}
+			}
+torn:
+			// still intact after the copy?
+			if (__atomic_load_n(&h->tail, __ATOMIC_RELAXED) > r->pos)
+				continue;
+			if (len == _LOG_RINGWRAP) {
+				r->pos += h->size - (r->pos & (h->size - 1));
+				continue;
+			}
+			if (len > h->size / 2)
+				return -1;
+			if (size > 0)
+				buf[copied] = '\0';
+			line->seq = seq;
+			line->level = (int32_t)(w >> 32);
+			line->len = len;
+			line->lost = r->seq == UINT64_MAX ? 0 : seq - r->seq;
+			r->seq = seq + 1;
+			r->pos += 16 + ((len + 7) & ~7u);
+			return 1;
+		}
+	}
+
+	static int _LOG_ringattach(struct LOG_ringreader *r, int fd, int recent) {
+		struct stat st;
+		memset(r, 0, sizeof(*r));
+		if (fd == -1)
+			return -1;
+		if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(struct _l_ringhdr)
+				|| (r->hdr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+			int e = errno;
+			close(fd);
+			r->hdr = NULL;
+			errno = e ? e : EINVAL;
+			return -1;
+		}
+		close(fd);
+		r->maplen = st.st_size;
+		if (!_LOG_ringvalid(r->hdr, r->maplen)) {
+			munmap((void *)r->hdr, r->maplen);
+			r->hdr = NULL;
+			errno = EINVAL;
+			return -1;
+		}
+		r->pos = __atomic_load_n(recent ? &r->hdr->tail : &r->hdr->head, __ATOMIC_ACQUIRE);
+		r->seq = UINT64_MAX; // nothing lost before the first line
+		return 0;
+	}
+
+	/**
+	 *  Attaches to a LOG_teeshm() ring: from its oldest line when `recent',
+	 *  else from the next line written. Returns 0 or -1 with errno set.
+	 */
+	inline static int LOG_shmattach(struct LOG_ringreader *r, const char *name, int recent) {
+		return _LOG_ringattach(r, shm_open(name, O_RDONLY | O_CLOEXEC, 0), recent);
+	}
+
+	/**
+	 *  Same for a LOG_teecircular() file, which needn't have a writer: its
+	 *  lines come out oldest first however often the ring wrapped.
+	 */
+	inline static int LOG_circularattach(struct LOG_ringreader *r, const char *path, int recent) {
+		return _LOG_ringattach(r, open(path, O_RDONLY | O_CLOEXEC), recent);
+	}
+
+	inline static void LOG_ringdetach(struct LOG_ringreader *r) {
+		if (r->hdr != NULL)
+			munmap((void *)r->hdr, r->maplen);
+		r->hdr = NULL;
+	}
+
+	// A formatted line on its way to the Tee
+	struct _l_line {
+		int level, tlevel;              // tlevel: the thread override
+		const char *prefix;             // builtin one known at compile time, or NULL
+		size_t plen;
+		const char *file, *fmt;
+		int line;
+		long tid;
+		const char *text;
+		size_t bytes;
+		struct _l_binargs *bin;
+		const struct _l_ctx *ctx;
+		void *const *frames;
+		size_t nframes;
+	};
+
+#       if !defined(LOGTEE_BATCH)
+#         define LOGTEE_BATCH           256     /* lines per LOG_batch() write */
+#       endif
+
+	// A LOG_batch() line that passed the gate
+	struct _l_bline {
+		int level;
+		uint32_t len;
+		const char *text;
+	};
+
+	/*
+	 * Circuit breaker: LOGTEE_BREAKER_FAILS write errors in a row pause a
+	 * tee, so a full disk or a closed pipe doesn't cost every line a failing
+	 * syscall. A paused tee gets one line again after the backoff, starting
+	 * at LOGTEE_BREAKER_BACKOFF ms and doubled while the retries fail, up to
+	 * LOGTEE_BREAKER_MAX. Pausing and recovering are logged to the others.
+	 */
+#       if !defined(LOGTEE_BREAKER_FAILS)
+#         define LOGTEE_BREAKER_FAILS   3
+#       endif
+#       if !defined(LOGTEE_BREAKER_BACKOFF)
+#         define LOGTEE_BREAKER_BACKOFF 100     /* ms */
+#       endif
+#       if !defined(LOGTEE_BREAKER_MAX)
+#         define LOGTEE_BREAKER_MAX     60000   /* ms */
+#       endif
+
+	// Counts a write error on t, 1 when it pauses t. Called locked.
+	static int _LOG_breakfail(struct _l_fplist *t, int err) {
+		++t->errors, t->err = err;
+		if (++t->fails < LOGTEE_BREAKER_FAILS)
+			return 0;
+		int tripped = t->retry == 0;
+		uint64_t max = LOGTEE_BREAKER_MAX * 1000000ull;
+		t->backoff = tripped ? LOGTEE_BREAKER_BACKOFF * 1000000ull : t->backoff < max / 2 ? t->backoff * 2 : max;
+		t->retry = _LOG_nsnow() + t->backoff;
+		return tripped;
+	}
+
+	static unsigned long long _LOG_emit(const struct _l_line *l, int *lost);
+
+	// Tells the other tees that tee #target paused or recovered. Called locked.
+	static void _LOG_breaknote(int target) {
+		struct _l_fplist *t = &_fplist;
+		for (int i = 0; i < target; ++i)
+			t = t->next;
+		char text[160];
+		int n = t->retry != 0
+			? snprintf(text, sizeof text, "logtee: target #%d failing (%s), paused for %" PRIu64 " ms\n",
+					target, strerror(t->err), t->backoff / 1000000)
+			: snprintf(text, sizeof text, "logtee: target #%d recovered\n", target);
+		struct _l_binargs *bin = _LOG_malloc(sizeof(*bin)); // LINE_MAX of scratch, off the stack
+		if (bin == NULL)
+			return;
+		bin->nargs = -1, bin->cpu = -1, bin->ts = _LOG_ticks();
+		struct _l_line l = { 1, LOG_THREADLEVEL_NONE, NULL, 0, NULL, text, 0, 0, text, (size_t)n, bin, NULL,
+			NULL, 0 };
+		if (_LOG_tlsp != NULL)
+			l.tid = _LOG_tlsp->tid;
+		_LOG_emit(&l, NULL);
+		_LOG_free(bin);
+	}
+
+	// Prefix of level, NULL if no such level (no extra annotation). Called locked.
+	static const char *_LOG_levelprefix(int level) {
+		const char *prefix = NULL;
+		for (size_t i=0; _loglevels != NULL && i < _numlevels; ++i)
+			if (_loglevels[i].level == level)
+				prefix = _loglevels[i].prefix;
+		return prefix;
+	}
+
+	// Settles a write of rc bytes (-1: failed) to tee #target with the
+	// breaker, noting a state change in notes. Called locked, returns the
+	// bytes written.
+	static unsigned long long _LOG_settle(struct _l_fplist *lfp, int target, long rc, int level, size_t bytes,
+			uint64_t *notes) {
+		if ((lfp->fp != NULL && fflush(lfp->fp) == EOF) | (rc < 0)) {
+			int err = errno;
+			_LOG_PROBE3(write_error, level, bytes, target);
+			if (lfp->fp != NULL)
+				clearerr(lfp->fp); // so a retry can tell
+			if (_LOG_breakfail(lfp, err) && target < 64)
+				*notes |= 1ull << target;
+			return 0;
+		}
+		if (__builtin_expect(lfp->fails != 0, 0)) {
+			if (lfp->retry != 0 && target < 64)
+				*notes |= 1ull << target;
+			lfp->fails = 0, lfp->retry = 0;
+		}
+		return rc;
+	}
+
+	// Writes l to every target that takes it. Called locked, returns the bytes written;
+	// *lost (if not NULL) tells whether it reached none while some paused or failed.
+	static unsigned long long _LOG_emit(const struct _l_line *l, int *lost) {
+		const int level = l->level;
+		if (l->bin->ts != 0)
+			l->bin->ts = _LOG_tickstons(l->bin->ts);
+		const char *prefix = l->prefix;
+		size_t plen = l->plen;
+		if (prefix == NULL || _LOG_prefixover) {
+			prefix = _LOG_levelprefix(level);
+			plen = prefix ? strlen(prefix) : 0;
+		}
+
+		int target = 0, ntargets = 0, written = 0, missed = 0;
+		uint64_t notes = 0; // tees whose breaker changed state
+		unsigned long long emitted = 0;
+		_LOG_PROBE2(flush_start, level, l->bytes);
+		for (struct _l_fplist *lfp = &_fplist; lfp != NULL; lfp = lfp->next, ++target) {
+			if (!_LOG_used(lfp) || lfp->kind == _LOG_METRICS) // the caller counts it
+				continue;
+			// a thread override only lowers the most verbose tees
+			if (lfp->level > level && (lfp->level != _LOG_minlevel || l->tlevel > level))
+				continue;
+			if (__builtin_expect(lfp->retry != 0, 0) && _LOG_nsnow() < lfp->retry) {
+				++missed; // paused
+				continue;
+			}
+			const char *cbprefix = _prefix_callback ? _prefix_callback() : "";
+			int rc;
+			if (lfp->kind == _LOG_RING) {
+				rc = _LOG_ringwrite(lfp->ring, level, cbprefix, prefix ? prefix : "", l->text, target);
+			} else if (lfp->kind == _LOG_BINARY) {
+				rc = _LOG_binwrite(lfp, level, prefix, *cbprefix ? cbprefix : NULL,
+						l->file, l->line, l->fmt, l->bin, l->tid, l->text, l->bytes);
+			} else {
+				int crc = l->ctx != NULL ? _LOG_ctxwrite(lfp->fp, lfp->level, l->ctx, cbprefix) : 0;
+				size_t cblen = strlen(cbprefix), tlen = strlen(l->text); // a %c of '\0' ends the text
+				rc = fwrite(cbprefix, 1, cblen, lfp->fp) == cblen && fwrite(prefix ? prefix : "", 1, plen, lfp->fp) == plen
+					&& fwrite(l->text, 1, tlen, lfp->fp) == tlen ? (int)(cblen + plen + tlen) : -1;
+				if (rc >= 0)
+					rc = crc < 0 ? crc : rc + crc;
+				if (l->nframes > 0)
+					_LOG_btwrite(lfp->fp, prefix ? prefix : "", l->frames, l->nframes);
+			}
+			emitted += _LOG_settle(lfp, target, rc, level, l->bytes, &notes);
+			if (lfp->fails == 0)
+				++written;
+			else
+				++missed;
+			++ntargets;
+		}
+		for (target = 0; notes != 0; ++target, notes >>= 1)
+			if (notes & 1)
+				_LOG_breaknote(target);
+		_LOG_PROBE3(flush_end, level, l->bytes, ntargets);
+		if (lost != NULL)
+			*lost = written == 0 && missed > 0;
+		return emitted;
+	}
+
+	// Writes iov to fp in one writev(), through stdio if it has no descriptor
+	static long _LOG_writev(FILE *fp, struct iovec *iov, int n) {
+		int fd = fileno(fp);
+		long total = 0;
+		if (fflush(fp) == EOF) // what stdio holds goes first
+			return -1;
+		for (int i = 0; fd == -1 && i < n; ++i) {
+			if (fwrite(iov[i].iov_base, 1, iov[i].iov_len, fp) != iov[i].iov_len)
+				return -1;
+			total += iov[i].iov_len;
+		}
+		while (fd != -1 && n > 0) {
+			ssize_t w = writev(fd, iov, n);
+			if (w == -1 && errno == EINTR)
+				continue;
+			if (w <= 0)
+				return -1;
+			total += w;
+			for (; n > 0 && (size_t)w >= iov->iov_len; ++iov, --n)
+				w -= iov->iov_len;
+			if (n > 0) // short write, carry on from there
+				iov->iov_base = (char *)iov->iov_base + w, iov->iov_len -= w;
+		}
+		return total;
+	}
+
+	/*
+	 * Writes the n lines of a LOG_batch() to every target that takes any of
+	 * them: one prefix lookup per line, one callback per target, then a
+	 * single writev() to text targets and a single flush to binary ones.
+	 * Called locked, returns the bytes written.
+	 */
+	static unsigned long long _LOG_emitbatch(const struct _l_bline *b, size_t n, int tlevel, long tid,
+			struct _l_binargs *bin) {
+		const char *prefix[LOGTEE_BATCH];
+		int top = INT_MIN;
+		size_t bytes = 0;
+		for (size_t i = 0; i < n; ++i) {
+			prefix[i] = i > 0 && b[i].level == b[i - 1].level ? prefix[i - 1] : _LOG_levelprefix(b[i].level);
+			top = b[i].level > top ? b[i].level : top;
+			bytes += b[i].len;
+		}
+		if (bin->ts != 0)
+			bin->ts = _LOG_tickstons(bin->ts);
+		bin->nargs = -1;
+
+		int target = 0, ntargets = 0;
+		uint64_t notes = 0;
+		unsigned long long emitted = 0;
+		_LOG_PROBE2(flush_start, top, bytes);
+		for (struct _l_fplist *lfp = &_fplist; lfp != NULL; lfp = lfp->next, ++target) {
+			if (!_LOG_used(lfp) || lfp->kind == _LOG_METRICS
+					|| (lfp->level > top && (lfp->level != _LOG_minlevel || tlevel > top)))
+				continue;
+			if (__builtin_expect(lfp->retry != 0, 0) && _LOG_nsnow() < lfp->retry)
+				continue; // paused
+			const char *cbprefix = _prefix_callback ? _prefix_callback() : "";
+			size_t cblen = strlen(cbprefix);
+			struct iovec iov[3 * LOGTEE_BATCH];
+			int niov = 0;
+			long rc = 0;
+			for (size_t i = 0; i < n && rc >= 0; ++i) {
+				const int level = b[i].level;
+				if (lfp->level > level && (lfp->level != _LOG_minlevel || tlevel > level))
+					continue;
+				if (lfp->kind == _LOG_RING) {
+					int w = _LOG_ringwrite(lfp->ring, level, cbprefix, prefix[i] ? prefix[i] : "", b[i].text, target);
+					rc = w < 0 ? -1 : rc + w;
+				} else if (lfp->kind == _LOG_BINARY) {
+					int w = _LOG_binwrite(lfp, level, prefix[i], *cbprefix ? cbprefix : NULL,
+							NULL, 0, NULL, bin, tid, b[i].text, b[i].len);
+					rc = w < 0 ? -1 : rc + w;
+				} else {
+					if (cblen > 0)
+						iov[niov++] = (struct iovec){ (void *)cbprefix, cblen };
+					if (prefix[i] != NULL)
+						iov[niov++] = (struct iovec){ (void *)prefix[i], strlen(prefix[i]) };
+					iov[niov++] = (struct iovec){ (void *)b[i].text, b[i].len };
+				}
+			}
+			if (niov > 0)
+				rc = _LOG_writev(lfp->fp, iov, niov);
+			emitted += _LOG_settle(lfp, target, rc, top, bytes, &notes);
+			++ntargets;
+		}
+		for (target = 0; notes != 0; ++target, notes >>= 1)
+			if (notes & 1)
+				_LOG_breaknote(target);
+		_LOG_PROBE3(flush_end, top, bytes, ntargets);
+		return emitted;
+	}
+
+	/*
+	 * Async mode (LOG_async()): accepted lines are formatted by the caller
+	 * as usual, then queued for a writer thread instead of written under
+	 * the mutex. Each band of levels has its own lane, a byte ring of whole
+	 * records, and the writer always takes the next record from the most
+	 * urgent non-empty lane, so an Error never waits behind queued Debug
+	 * lines. Each lane stays in order; lines of different lanes can come
+	 * out of order, their timestamps (binary targets) tell the real one.
+	 * A full Error lane makes the caller write the line itself, the others
+	 * drop it. Lines carrying context are written by the caller too. Both
+	 * first wait for the Errors queued before them, so they can get ahead
+	 * of lower lanes only. LOG_try() only queues: it drops such an Error,
+	 * and queues a context line without its context, which then goes with
+	 * the next Error. Fewer than 3 lanes merge the bands from the bottom up.
+	 */
+#       if !defined(LOGTEE_LANES)
+#         define LOGTEE_LANES           3       /* Error and up, Info/Warning, below */
+#       endif
+	static int _LOG_lane(int level) {
+		return level >= 2 ? 0 : level >= 0 && LOGTEE_LANES > 2 ? 1 : LOGTEE_LANES - 1;
+	}
+
+	// A queued line: this header, frames, binary argument
+	// lengths and bytes, the text, then copies of file and fmt (the caller
+	// may free them once LOG() returns); padded to 8 bytes. A queued batch
+	// has the level and length of each line instead, then their texts.
+	struct _l_qrec {
+		uint32_t size;                  // 0: the rest of the lane is unused
+		int level, tlevel, line;
+		const char *file, *fmt;         // the caller's: only tell whether copies follow
+		long tid;
+		size_t bytes;
+		uint32_t nframes;
+		int nargs, cpu;
+		uint64_t ts;
+		uint32_t nlines;                // > 0: a LOG_batch() of that many lines
+		const char *prefix;             // see _l_line
+		size_t plen;
+	};
+
+	struct _l_lane {
+		char *buf;
+		size_t size;                    // a power of two
+		uint64_t head, tail;            // byte positions, read from head
+		uint64_t dropped;
+	};
+
+	struct _l_async {
+		pthread_mutex_t mtx;
+		pthread_cond_t more, idle;
+		pthread_t thread;
+		int running, stop, busy;
+		struct _l_binargs *bin;         // the writer's
+		struct _l_lane lane[LOGTEE_LANES];
+	}; USTATE(struct _l_async, _LOG_q, { .mtx = PTHREAD_MUTEX_INITIALIZER,
+		.more = PTHREAD_COND_INITIALIZER, .idle = PTHREAD_COND_INITIALIZER });
+
+#	define _LOG_QALIGN(n) (((n) + 7) & ~(size_t)7)
+
+	/*
+	 * Room for a record of need bytes in lane, for `lines' lines. Called
+	 * with q->mtx held. NULL when stopped (*rc stays -1: write it yourself)
+	 * or when there is no room, then lines other than Errors are dropped.
+	 */
+	static char *_LOG_qreserve(struct _l_async *q, int lane, size_t need, size_t lines, int *rc) {
+		if (!q->running || q->stop)
+			return NULL;
+		struct _l_lane *ln = q->lane + lane;
+		size_t off = ln->tail & (ln->size - 1), pad = ln->size - off < need ? ln->size - off : 0;
+		if (ln->size - (ln->tail - ln->head) < pad + need || need > ln->size / 4) {
+			if (lane != 0) {
+				ln->dropped += lines;
+				*rc = 1;
+			}
+			return NULL;
+		}
+		if (pad > 0) { // records are never split
+			((struct _l_qrec *)(ln->buf + off))->size = 0;
+			ln->tail += pad, off = 0;
+		}
+		return ln->buf + off;
+	}
+
+	// Waits for the writer to get through the Errors queued so far, before
+	// the caller writes a line itself. Called with q->mtx held.
+	static void _LOG_qwaiterrors(struct _l_async *q) {
+		uint64_t upto = q->lane[0].tail;
+		if (pthread_equal(pthread_self(), q->thread)) // logging from the writer
+			return;
+		while (q->running && q->lane[0].head < upto)
+			pthread_cond_wait(&q->idle, &q->mtx);
+	}
+
+	// A line the queue didn't take, going to be written by the caller (-1):
+	// after the Errors queued before it, or dropped (1) with try
+	static int _LOG_qbypass(struct _l_async *q, int try, size_t lines) {
+		if (!q->running)
+			return -1;
+		if (try && !q->stop) {
+			q->lane[0].dropped += lines;
+			return 1;
+		}
+		_LOG_qwaiterrors(q);
+		return -1;
+	}
+
+	// Queues l, 0 when queued, 1 when dropped, -1 to be written by the caller.
+	// With try, a busy lane drops the line instead of waiting.
+	static int _LOG_enqueue(const struct _l_line *l, int try) {
+		struct _l_async *q = &_LOG_q;
+		size_t nargs = l->bin->nargs > 0 ? l->bin->nargs : 0;
+		size_t argbytes = 0;
+		for (size_t i = 0; i < nargs; ++i)
+			argbytes += l->bin->len[i];
+		size_t filelen = l->file != NULL ? strlen(l->file) + 1 : 0, fmtlen = l->fmt != NULL ? strlen(l->fmt) + 1 : 0;
+		size_t need = _LOG_QALIGN(sizeof(struct _l_qrec) + l->nframes * sizeof(void *)
+				+ nargs * sizeof(size_t) + argbytes + l->bytes + 1 + filelen + fmtlen);
+		int lane = _LOG_lane(l->level), rc = -1;
+		if (try ? pthread_mutex_trylock(&q->mtx) != 0 : pthread_mutex_lock(&q->mtx) != 0)
+			return 1;
+		char *p = _LOG_qreserve(q, lane, need, 1, &rc);
+		if (p == NULL) {
+			if (rc == -1)
+				rc = _LOG_qbypass(q, try, 1);
+			goto out;
+		}
+		*(struct _l_qrec *)p = (struct _l_qrec){ (uint32_t)need, l->level, l->tlevel, l->line, l->file, l->fmt,
+			l->tid, l->bytes, (uint32_t)l->nframes, l->bin->nargs, l->bin->cpu, l->bin->ts, 0,
+			l->prefix, l->plen };
+		p += sizeof(struct _l_qrec);
+		memcpy(p, l->frames, l->nframes * sizeof(void *));
+		p += l->nframes * sizeof(void *);
+		memcpy(p, l->bin->len, nargs * sizeof(size_t));
+		p += nargs * sizeof(size_t);
+		for (size_t i = 0; i < nargs; ++i)
+			memcpy(p, l->bin->arg[i], l->bin->len[i]), p += l->bin->len[i];
+		memcpy(p, l->text, l->bytes);
+		p[l->bytes] = '\0';
+		p += l->bytes + 1;
+		if (filelen > 0)
+			memcpy(p, l->file, filelen);
+		if (fmtlen > 0)
+			memcpy(p + filelen, l->fmt, fmtlen);
+		q->lane[lane].tail += need;
+		pthread_cond_signal(&q->more);
+		rc = 0;
+out:
+		pthread_mutex_unlock(&q->mtx);
+		return rc;
+	}
+
+	// Queues the n lines of a batch as one record in the lane of the most
+	// urgent, same return as _LOG_enqueue()
+	static int _LOG_enqueuebatch(const struct _l_bline *b, size_t n, int tlevel, long tid,
+			const struct _l_binargs *bin) {
+		struct _l_async *q = &_LOG_q;
+		int top = INT_MIN;
+		size_t bytes = 0;
+		for (size_t i = 0; i < n; ++i) {
+			top = b[i].level > top ? b[i].level : top;
+			bytes += b[i].len;
+		}
+		size_t need = _LOG_QALIGN(sizeof(struct _l_qrec) + n * 2 * sizeof(uint32_t) + bytes + n);
+		int lane = _LOG_lane(top), rc = -1;
+		pthread_mutex_lock(&q->mtx);
+		char *p = _LOG_qreserve(q, lane, need, n, &rc);
+		if (p == NULL) {
+			if (rc == -1)
+				rc = _LOG_qbypass(q, 0, n);
+			goto out;
+		}
+		*(struct _l_qrec *)p = (struct _l_qrec){ (uint32_t)need, top, tlevel, 0, NULL, NULL,
+			tid, bytes, 0, -1, bin->cpu, bin->ts, (uint32_t)n, NULL, 0 };
+		p += sizeof(struct _l_qrec);
+		for (size_t i = 0; i < n; ++i) {
+			uint32_t w[2] = { (uint32_t)b[i].level, b[i].len };
+			memcpy(p, w, sizeof w), p += sizeof w;
+		}
+		for (size_t i = 0; i < n; ++i) {
+			memcpy(p, b[i].text, b[i].len);
+			p[b[i].len] = '\0', p += b[i].len + 1;
+		}
+		q->lane[lane].tail += need;
+		pthread_cond_signal(&q->more);
+		rc = 0;
+out:
+		pthread_mutex_unlock(&q->mtx);
+		return rc;
+	}
+
+	// The writer thread
+	static void *_LOG_dequeue(void *arg) {
+		struct _l_async *q = &_LOG_q;
+		struct _l_binargs *bin = q->bin;
+		(void)arg;
+		pthread_mutex_lock(&q->mtx);
+		for (;;) {
+			struct _l_lane *ln = NULL;
+			for (int i = 0; i < LOGTEE_LANES && ln == NULL; ++i)
+				if (q->lane[i].head != q->lane[i].tail)
+					ln = q->lane + i;
+			if (ln == NULL) {
+				pthread_cond_broadcast(&q->idle);
+				if (q->stop)
+					break;
+				pthread_cond_wait(&q->more, &q->mtx);
+				continue;
+			}
+			const struct _l_qrec *r = (const struct _l_qrec *)(ln->buf + (ln->head & (ln->size - 1)));
+			if (r->size == 0) { // skip to the start
+				ln->head += ln->size - (ln->head & (ln->size - 1));
+				continue;
+			}
+			// the record stays ours until head moves past it
+			q->busy = 1;
+			pthread_mutex_unlock(&q->mtx);
+
+			const char *p = (const char *)(r + 1);
+			if (r->nlines > 0) {
+				struct _l_bline b[LOGTEE_BATCH];
+				const char *text = p + r->nlines * 2 * sizeof(uint32_t);
+				for (uint32_t i = 0; i < r->nlines; ++i) {
+					uint32_t w[2];
+					memcpy(w, p, sizeof w), p += sizeof w;
+					b[i] = (struct _l_bline){ (int)w[0], w[1], text };
+					text += w[1] + 1;
+				}
+				bin->cpu = r->cpu, bin->ts = r->ts;
+				pthread_mutex_lock(&_LOG_mtx);
+				if (_loglevels != NULL || _LOG_levelsinit() == 0)
+					_LOG_emitbatch(b, r->nlines, r->tlevel, r->tid, bin);
+				pthread_mutex_unlock(&_LOG_mtx);
+				goto next;
+			}
+			void *frames[LOGTEE_BT_DEPTH];
+			memcpy(frames, p, r->nframes * sizeof(void *));
+			p += r->nframes * sizeof(void *);
+			bin->nargs = r->nargs, bin->cpu = r->cpu, bin->ts = r->ts;
+			if (r->nargs > 0) {
+				memcpy(bin->len, p, r->nargs * sizeof(size_t));
+				p += r->nargs * sizeof(size_t);
+				for (int i = 0; i < r->nargs; ++i)
+					bin->arg[i] = p, p += bin->len[i];
+			}
+			const char *file = r->file != NULL ? p + r->bytes + 1 : NULL;
+			const char *fmt = r->fmt != NULL ? p + r->bytes + 1 + (file != NULL ? strlen(file) + 1 : 0) : NULL;
+			struct _l_line l = { r->level, r->tlevel, r->prefix, r->plen, file, fmt, r->line, r->tid, p, r->bytes, bin,
+				NULL, frames, r->nframes };
+			pthread_mutex_lock(&_LOG_mtx);
+			if (_loglevels != NULL || _LOG_levelsinit() == 0)
+				_LOG_emit(&l, NULL);
+			pthread_mutex_unlock(&_LOG_mtx);
+next:
+			pthread_mutex_lock(&q->mtx);
+			ln->head += r->size;
+			q->busy = 0;
+			if (ln == q->lane) // for _LOG_qwaiterrors()
+				pthread_cond_broadcast(&q->idle);
+		}
+		pthread_mutex_unlock(&q->mtx);
+		return NULL;
+	}
+
+	// Waits until the writer thread has written everything queued
+	static void _LOG_drain() {
+		struct _l_async *q = &_LOG_q;
+		pthread_mutex_lock(&q->mtx);
+		for (;;) {
+			int empty = !q->busy;
+			for (int i = 0; i < LOGTEE_LANES; ++i)
+				empty &= q->lane[i].head == q->lane[i].tail;
+			if (empty || !q->running)
+				break;
+			pthread_cond_wait(&q->idle, &q->mtx);
+		}
+		pthread_mutex_unlock(&q->mtx);
+	}
+
+	// Drains and stops the writer thread, if any
+	static void _LOG_asyncstop() {
+		struct _l_async *q = &_LOG_q;
+		pthread_mutex_lock(&q->mtx);
+		if (!q->running) {
+			pthread_mutex_unlock(&q->mtx);
+			return;
+		}
+		q->stop = 1;
+		pthread_cond_signal(&q->more);
+		pthread_mutex_unlock(&q->mtx);
+		pthread_join(q->thread, NULL); // after it wrote what was queued
+
+		pthread_mutex_lock(&q->mtx);
+		__atomic_store_n(&q->running, 0, __ATOMIC_RELAXED);
+		q->stop = 0;
+		_LOG_free(q->bin);
+		q->bin = NULL;
+		for (int i = 0; i < LOGTEE_LANES; ++i) {
+			_LOG_free(q->lane[i].buf);
+			q->lane[i] = (struct _l_lane){ NULL, 0, 0, 0, q->lane[i].dropped };
+		}
+		pthread_cond_broadcast(&q->idle);
+		pthread_mutex_unlock(&q->mtx);
+	}
+
+	// Workhorse behind LOG() and LOG_at(), inlined so backtraces skip 2 frames.
+	// With try it never waits for the Tee, see LOG_try(). prefix is the
+	// builtin prefix of level, of plen bytes, when the caller knows it (NULL:
+	// look it up). litsize is the sizeof of a literal fmt without
+	// conversions, which is used as is.
+	inline static enum LOG_status __attribute__((always_inline))
+		_LOG_v(const char *file, int line, int level, int try, const char *prefix, size_t plen,
+				const char *fmt, size_t litsize, va_list ap) {
+			struct LOG_site *site = NULL;
+			unsigned long long t0 = 0;
+			const int saved_errno = errno; // for %m
+			if (__builtin_expect(__atomic_load_n(&_LOG_profiling, __ATOMIC_RELAXED), 0) && file) {
+				pthread_once(&_LOG_once, _LOG_init);
+				struct _l_tls *tls = _LOG_tls();
+				if (tls != NULL && (site = _LOG_site(tls, file, line, level)) != NULL)
+					_LOG_SITEADD(site, calls, 1);
+			}
+
+			// Global gate, the thread override costs a single TLS load here
+			const int tlevel = _LOG_tlevel;
+			if (level < __atomic_load_n(&_LOG_minlevel, __ATOMIC_RELAXED) && level < tlevel) {
+				if (__builtin_expect(level >= __atomic_load_n(&_LOG_ctxlevel, __ATOMIC_RELAXED), 0))
+					_LOG_ctxsave(level, fmt, ap, saved_errno);
+				return LOG_FILTERED;
+			}
+			if (__builtin_expect(level < __atomic_load_n(&_LOG_memfloor, __ATOMIC_RELAXED), 0)) {
+				__atomic_add_fetch(&_LOG_memdropped, 1, __ATOMIC_RELAXED);
+				_LOG_PROBE2(drop, level, 0);
+				return LOG_DROPPED;
+			}
+
+			pthread_once(&_LOG_once, _LOG_init);
+			struct _l_tls *tls = _LOG_tls();
+			size_t bytes = 0;
+			if (tls == NULL)
+				goto malloc_fail;
+			const char *logline = litsize != 0 ? fmt : tls->line;
+
+			if (site != NULL)
+				t0 = _LOG_nsnow();
+			errno = saved_errno;
+			if (__atomic_load_n(&_LOG_nbinary, __ATOMIC_RELAXED) > 0) {
+				tls->bin.ts = _LOG_tickscpu(&tls->bin.cpu);
+				if (litsize != 0)
+					tls->bin.nargs = 0;
+				else
+					_LOG_binsplit(&tls->bin, fmt, ap);
+			} else {
+				tls->bin.ts = 0;
+				tls->bin.nargs = -1;
+			}
+			double fields[LOGTEE_METRIC_FIELDS];
+			uint32_t found = litsize == 0 && __atomic_load_n(&_LOG_nfields, __ATOMIC_RELAXED) > 0
+				? _LOG_fieldvalues(fmt, ap, fields) : 0;
+			int len = litsize != 0 ? (int)litsize - 1 : vsnprintf(tls->line, LINE_MAX, fmt, ap);
+			bytes = len < 0 ? 0 : len >= LINE_MAX ? LINE_MAX - 1 : (size_t)len;
+			if (site != NULL) {
+				_LOG_SITEADD(site, ns, _LOG_nsnow() - t0);
+				_LOG_SITEADD(site, accepted, 1);
+			}
+			_LOG_PROBE2(enqueue, level, bytes);
+
+			// accepted lines below the trigger may still be filtered by some tee
+			const struct _l_ctx *ctx = NULL;
+			if (__builtin_expect(level >= __atomic_load_n(&_LOG_ctxlevel, __ATOMIC_RELAXED), 0)) {
+				struct _l_ctxrec *rec;
+				if (level < LOGTEE_CONTEXT_TRIGGER && (rec = _LOG_ctxslot(tls, level)) != NULL) {
+					rec->deferred = 0;
+					rec->len = bytes < sizeof(rec->data) ? bytes : sizeof(rec->data) - 1;
+					memcpy(rec->data, logline, rec->len);
+				} else if (level >= LOGTEE_CONTEXT_TRIGGER && tls->ctx != NULL && tls->ctx->n > 0) {
+					ctx = tls->ctx;
+				}
+			}
+
+			void *frames[LOGTEE_BT_DEPTH];
+			size_t nframes = level >= __atomic_load_n(&_LOG_btlevel, __ATOMIC_RELAXED)
+				? _LOG_btcapture(frames) : 0;
+
+			struct _l_line l = { level, tlevel, prefix, plen, file, fmt, line, tls->tid, logline, bytes, &tls->bin,
+				ctx, frames, nframes };
+			unsigned long long emitted = bytes;
+			enum LOG_status status = len >= LINE_MAX ? LOG_TRUNCATED : LOG_ACCEPTED;
+			if (__atomic_load_n(&_LOG_q.running, __ATOMIC_RELAXED) && (ctx == NULL || try)) {
+				int queued = _LOG_enqueue(&l, try); // with try the context waits for the next Error
+				if (queued == 1) {
+					_LOG_PROBE2(drop, level, bytes);
+					status = LOG_DROPPED, emitted = 0;
+					goto done;
+				}
+				if (queued == 0)
+					goto count;
+			} else if (__atomic_load_n(&_LOG_q.running, __ATOMIC_RELAXED)) { // context: behind queued Errors
+				pthread_mutex_lock(&_LOG_q.mtx);
+				_LOG_qwaiterrors(&_LOG_q);
+				pthread_mutex_unlock(&_LOG_q.mtx);
+			}
+
+			if (try ? pthread_mutex_trylock(&_LOG_mtx) != 0 : pthread_mutex_lock(&_LOG_mtx) != 0) {
+				_LOG_PROBE2(drop, level, bytes);
+				return LOG_DROPPED;
+			}
+			if (_loglevels == NULL && _LOG_levelsinit() == -1) {
+				pthread_mutex_unlock(&_LOG_mtx);
+				goto malloc_fail;
+			}
+			int lost;
+			emitted = _LOG_emit(&l, &lost);
+			pthread_mutex_unlock(&_LOG_mtx);
+			if (lost) { // every tee that takes it is paused or failing
+				_LOG_PROBE2(drop, level, bytes);
+				status = LOG_DROPPED;
+			}
+			if (ctx != NULL) // handed out once
+				tls->ctx->n = 0;
+count:
+			if (__builtin_expect(_LOG_metricstakes(level, tlevel), 0))
+				_LOG_metricsadd(level, file, line, bytes, found, fields);
+done:
+			if (site != NULL) // queued lines count as their formatted size
+				_LOG_SITEADD(site, bytes, emitted);
+
+			return status;
+malloc_fail:
+			_LOG_PROBE2(drop, level, bytes);
+			fprintf(stderr, "%s: malloc: %s\n", __func__, strerror(errno));
+			return LOG_DROPPED;
+		}
+
+	inline static void __attribute__(( format(printf, 2, 3) ))
+		LOG(int level, const char *fmt, ...) {
+			va_list ap;
+			va_start(ap, fmt);
+			_LOG_v(NULL, 0, level, 0, NULL, 0, fmt, 0, ap);
+			va_end(ap);
+		}
+
+	/**
+	 *  LOG() attributed to a call site
+	 */
+	inline static void __attribute__(( format(printf, 4, 5) ))
+		LOG_at(const char *file, int line, int level, const char *fmt, ...) {
+			va_list ap;
+			va_start(ap, fmt);
+			_LOG_v(file, line, level, 0, NULL, 0, fmt, 0, ap);
+			va_end(ap);
+		}
+
+	// LOG_at() with the builtin prefix of level, which is what the LOGX() macros use
+	inline static void __attribute__(( format(printf, 6, 7) ))
+		_LOG_atp(const char *file, int line, int level, const char *prefix, size_t plen, const char *fmt, ...) {
+			va_list ap;
+			va_start(ap, fmt);
+			_LOG_v(file, line, level, 0, prefix, plen, fmt, 0, ap);
+			va_end(ap);
+		}
+
+	// _LOG_atp() of a literal without conversions, see _LOG_ISLIT()
+	inline static void _LOG_lit(const char *file, int line, int level, const char *prefix, size_t plen,
+			const char *msg, size_t size, ...) {
+		va_list ap; // none, but the conversion-free paths take one
+		va_start(ap, size);
+		_LOG_v(file, line, level, 0, prefix, plen, msg, size, ap);
+		va_end(ap);
+	}
+
+	/**
+	 *  LOG() for latency-critical code: never waits for the Tee mutex or an
+	 *  async lane, a line that would have to is dropped instead. Returns
+	 *  what happened to the line (enum LOG_status), so the caller can e.g.
+	 *  bump a counter of its own when it was dropped, also when every tee
+	 *  that takes it is paused by its breaker or failed to write it.
+	 *  Without LOG_async() the caller still writes the line itself, so a
+	 *  tee that blocks (a full pipe, a stalled disk) holds it up until that
+	 *  write returns; with LOG_async() it only ever queues.
+	 */
+	inline static enum LOG_status __attribute__(( format(printf, 2, 3) ))
+		LOG_try(int level, const char *fmt, ...) {
+			va_list ap;
+			va_start(ap, fmt);
+			enum LOG_status status = _LOG_v(NULL, 0, level, 1, NULL, 0, fmt, 0, ap);
+			va_end(ap);
+			return status;
+		}
+
+	/**
+	 *  LOG_try() attributed to a call site
+	 */
+	inline static enum LOG_status __attribute__(( format(printf, 4, 5) ))
+		LOG_tryat(const char *file, int line, int level, const char *fmt, ...) {
+			va_list ap;
+			va_start(ap, fmt);
+			enum LOG_status status = _LOG_v(file, line, level, 1, NULL, 0, fmt, 0, ap);
+			va_end(ap);
+			return status;
+		}
+
+	// Writes or queues the lines of a batch that passed the gate, 0 if dropped
+	static size_t _LOG_batchv(const struct _l_bline *b, size_t n, int tlevel) {
+		int top = INT_MIN;
+		size_t bytes = 0;
+		for (size_t i = 0; i < n; ++i) {
+			top = b[i].level > top ? b[i].level : top;
+			bytes += b[i].len;
+		}
+		pthread_once(&_LOG_once, _LOG_init);
+		struct _l_tls *tls = _LOG_tls();
+		if (tls == NULL)
+			goto malloc_fail;
+		tls->bin.nargs = -1;
+		if (__atomic_load_n(&_LOG_nbinary, __ATOMIC_RELAXED) > 0)
+			tls->bin.ts = _LOG_tickscpu(&tls->bin.cpu);
+		else
+			tls->bin.ts = 0;
+		_LOG_PROBE2(enqueue, top, bytes);
+		if (__atomic_load_n(&_LOG_q.running, __ATOMIC_RELAXED)) {
+			int queued = _LOG_enqueuebatch(b, n, tlevel, tls->tid, &tls->bin);
+			if (queued == 1) {
+				_LOG_PROBE2(drop, top, bytes);
+				return 0;
+			}
+			if (queued == 0)
+				goto count;
+		}
+		pthread_mutex_lock(&_LOG_mtx);
+		if (_loglevels == NULL && _LOG_levelsinit() == -1) {
+			pthread_mutex_unlock(&_LOG_mtx);
+			goto malloc_fail;
+		}
+		_LOG_emitbatch(b, n, tlevel, tls->tid, &tls->bin);
+		pthread_mutex_unlock(&_LOG_mtx);
+count:
+		for (size_t i = 0; i < n; ++i)
+			if (__builtin_expect(_LOG_metricstakes(b[i].level, tlevel), 0))
+				_LOG_metricsadd(b[i].level, NULL, 0, b[i].len, 0, NULL);
+		return n;
+malloc_fail:
+		_LOG_PROBE2(drop, top, bytes);
+		fprintf(stderr, "%s: malloc: %s\n", __func__, strerror(errno));
+		return 0;
+	}
+
+	// A line of a LOG_batch()
+	struct LOG_entry {
+		int level;
+		const char *msg;                // already formatted, newline included
+	};
+
+	/**
+	 *  Logs n lines in one go, e.g. the rows of a table dump: one pass over
+	 *  the level gate, then each target gets all the lines it takes in one
+	 *  write (a single writev() for text targets), or async mode queues
+	 *  them as one record, in the lane of the most urgent. The lines stay
+	 *  together in every target. They are not formatted, carry no call site
+	 *  and get no backtrace or context; each is cut to LINE_MAX - 1 bytes.
+	 *  Batches over LOGTEE_BATCH lines go out that many at a time, fewer
+	 *  as the memory budget fills (see LOG_budget()). Returns the number
+	 *  of lines written or queued.
+	 */
+	inline static size_t LOG_batch(const struct LOG_entry *e, size_t n) {
+		const int tlevel = _LOG_tlevel;
+		size_t done = 0;
+		while (n > 0) {
+			struct _l_bline b[LOGTEE_BATCH];
+			size_t k = 0;
+			const int minlevel = __atomic_load_n(&_LOG_minlevel, __ATOMIC_RELAXED);
+			const int floor = __atomic_load_n(&_LOG_memfloor, __ATOMIC_RELAXED);
+			const size_t max = LOGTEE_BATCH >> __atomic_load_n(&_LOG_membatchshift, __ATOMIC_RELAXED);
+			for (; n > 0 && (k < max || k == 0); ++e, --n) {
+				if (e->level < minlevel && e->level < tlevel)
+					continue;
+				if (__builtin_expect(e->level < floor, 0)) {
+					__atomic_add_fetch(&_LOG_memdropped, 1, __ATOMIC_RELAXED);
+					continue;
+				}
+				size_t len = strlen(e->msg);
+				b[k++] = (struct _l_bline){ e->level, (uint32_t)(len < LINE_MAX ? len : LINE_MAX - 1), e->msg };
+			}
+			if (k > 0)
+				done += _LOG_batchv(b, k, tlevel);
+		}
+		return done;
+	}
+
+	/**
+	 *  Clean slate
+	 */
+	inline static void LOG_reset() {
+		_LOG_drain(); // what was logged before goes to the old targets
+		pthread_mutex_lock(&_LOG_mtx);
+		_LOG_closeall();
+
+		_prefix_callback = NULL;
+		__atomic_store_n(&_LOG_btlevel, INT_MAX, __ATOMIC_RELAXED);
+		__atomic_store_n(&_LOG_ctxlevel, INT_MAX, __ATOMIC_RELAXED);
+
+		if (_loglevels != NULL && _LOG_levelsinit() == -1)
+			fprintf(stderr, "%s: malloc: %s\n", __func__, strerror(errno));
+		pthread_mutex_unlock(&_LOG_mtx);
+	}
+
+	// Puts a copy of target t in the Tee. Called locked, -1 without memory.
+	static int _LOG_teeadd(const struct _l_fplist *t) {
+		for (struct _l_fplist *fp = &_fplist; fp; fp = fp->next) {
+			if (!_LOG_used(fp)) { // empty slot
+				struct _l_fplist *next = fp->next;
+				*fp = *t;
+				fp->next = next;
+				break;
+			} else if (fp->next == NULL) { // expand by new entry
+				if ((fp->next = _LOG_calloc(1, sizeof(*fp))) == NULL)
+					return -1;
+				*fp->next = *t;
+				fp->next->next = NULL;
+				break;
+			}
+		}
+		if (t->level < _LOG_minlevel)
+			__atomic_store_n(&_LOG_minlevel, t->level, __ATOMIC_RELAXED);
+		if (t->kind == _LOG_BINARY)
+			__atomic_add_fetch(&_LOG_nbinary, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	static void _LOG_tee(FILE *file, int level, int kind) {
+		if (file == NULL) return;
+		if (fileno(file) != STDOUT_FILENO && fileno(file) != STDERR_FILENO) {
+			if (fseek(file, 0, SEEK_END) == -1)
+				PLOGW("%s: fseek(SEEK_END)", __func__);
+			if (fcntl(fileno(file), F_SETFD, FD_CLOEXEC) == -1)
+				PLOGW("%s: fcntl(FD_CLOEXEC)", __func__);
+		}
+		struct _l_bintee *bin = NULL;
+		pthread_mutex_lock(&_LOG_mtx);
+		if (kind == _LOG_BINARY) {
+			struct stat st, other;
+			for (struct _l_fplist *fp = &_fplist; fp; fp = fp->next) {
+				// each binary target owns its dictionary, two can't share a file
+				if (fp->kind == _LOG_BINARY && fstat(fileno(fp->fp), &other) == 0
+						&& fstat(fileno(file), &st) == 0
+						&& st.st_dev == other.st_dev && st.st_ino == other.st_ino) {
+					int same = file == fp->fp; // fp can be closed once unlocked
+					pthread_mutex_unlock(&_LOG_mtx);
+					if (!same)
+						fclose(file);
+					LOGW("%s: file is already a binary target.\n", __func__);
+					return;
+				}
+			}
+			if ((bin = _LOG_binopen(file)) == NULL) {
+				pthread_mutex_unlock(&_LOG_mtx);
+				PLOGW("%s: can't start binary log", __func__);
+				return;
+			}
+		}
+		struct _l_fplist t = { .fp = file, .level = level, .kind = kind, .bin = bin };
+		if (_LOG_teeadd(&t) == -1) {
+			pthread_mutex_unlock(&_LOG_mtx);
+			_LOG_binfree(bin);
+			LOGE("%s: malloc: %s.\n", __func__, strerror(errno));
+			return;
+		}
+		pthread_mutex_unlock(&_LOG_mtx);
+	}
+
+	static FILE *_LOG_open(const char *path) {
+		FILE *fp;
+
+		if (path == NULL)
+			fp = stderr;
+		else if (strcmp(path, "-") == 0)
+			fp = stdout;
+		else if ((fp = fopen(path, "a")) == NULL)
+			LOGW("%s: can't open '%s' for logging: %s.\n",
+					__func__, path, strerror(errno));
+		return fp;
+	}
+
+	inline static void LOG_teefile(FILE *file, int level) {
+		_LOG_tee(file, level, _LOG_TEXT);
+	}
+
+	inline static void LOG_teepath(const char *path, int level) {
+		LOG_teefile(_LOG_open(path), level);
+	}
+
+	/**
+	 *  Binary (dictionary encoded) targets, decoded with LOG_binnext() or
+	 *  `logtool cat'. Backtraces are only written to text targets.
+	 */
+	inline static void LOG_teebinary(FILE *file, int level) {
+		_LOG_tee(file, level, _LOG_BINARY);
+	}
+
+	inline static void LOG_teebinarypath(const char *path, int level) {
+		LOG_teebinary(_LOG_open(path), level);
+	}
+
+	static void _LOG_teering(const char *name, int level, size_t size, int type) {
+		size_t pow2 = 4096;
+		while (pow2 < size && pow2 < ((size_t)1 << 40))
+			pow2 <<= 1;
+		pthread_mutex_lock(&_LOG_mtx);
+		struct stat st;
+		for (struct _l_fplist *fp = &_fplist; fp && type != _LOG_RINGSHM; fp = fp->next) {
+			// one writer per circular file, each keeps head and tail in memory
+			if (fp->ring != NULL && fp->ring->type == type && (type == _LOG_RINGMEM ? strcmp(name, fp->ring->name) == 0
+						: stat(name, &st) == 0 && st.st_dev == fp->ring->dev && st.st_ino == fp->ring->ino)) {
+				pthread_mutex_unlock(&_LOG_mtx);
+				LOGW("%s: '%s' is already a %s target.\n", __func__, name, type == _LOG_RINGMEM ? "memory" : "circular");
+				return;
+			}
+		}
+		struct _l_ring *ring = _LOG_ringopen(name, pow2, type);
+		if (ring == NULL) {
+			pthread_mutex_unlock(&_LOG_mtx);
+			PLOGW("%s: can't create '%s'", __func__, name);
+			return;
+		}
+		struct _l_fplist t = { .level = level, .kind = _LOG_RING, .ring = ring };
+		int rc = _LOG_teeadd(&t);
+		pthread_mutex_unlock(&_LOG_mtx);
+		if (rc == -1) {
+			_LOG_ringfree(ring);
+			LOGE("%s: malloc: %s.\n", __func__, strerror(errno));
+		}
+	}
+
+	/**
+	 *  Shared memory broadcast ring of `size' bytes (rounded up to a power
+	 *  of two) named as for shm_open(3), e.g. "/myapp-log". Any number of
+	 *  local readers attach with LOG_shmattach(); slow ones are overrun
+	 *  rather than slowing the writer. The object is unlinked on LOG_reset().
+	 */
+	inline static void LOG_teeshm(const char *name, int level, size_t size) {
+		_LOG_teering(name, level, size, _LOG_RINGSHM);
+	}
+
+	/**
+	 *  Circular file of `size' bytes (rounded up to a power of two) that
+	 *  overwrites its oldest lines: bounded disk use for verbose levels,
+	 *  e.g. LOG_teecircular("debug.ring", -1, 64 << 20) next to a Warning
+	 *  tee. Read back in order with LOG_circularattach() or `logtool ring'.
+	 */
+	inline static void LOG_teecircular(const char *path, int level, size_t size) {
+		_LOG_teering(path, level, size, _LOG_RINGFILE);
+	}
+
+	/**
+	 *  In-memory ring of `size' bytes (rounded up to a power of two) keeping
+	 *  the most recent lines, e.g. for an admin endpoint to show the last
+	 *  errors. It is found by `name' (a label, not a file) with
+	 *  LOG_memattach() and LOG_memsnapshot(), which never hold up LOG().
+	 */
+	inline static void LOG_teememory(const char *name, int level, size_t size) {
+		_LOG_teering(name, level, size, _LOG_RINGMEM);
+	}
+
+	/**
+	 *  Attaches a reader to the LOG_teememory() ring `name', as
+	 *  LOG_shmattach(); the reader keeps its own mapping and stays valid
+	 *  after LOG_reset(). Returns 0 or -1 with errno set.
+	 */
+	inline static int LOG_memattach(struct LOG_ringreader *r, const char *name, int recent) {
+		struct _l_memring *m = _LOG_memringget(name);
+		int fd = m != NULL ? fcntl(m->fd, F_DUPFD_CLOEXEC, 0) : -1;
+		if (m != NULL)
+			_LOG_memringput(m);
+		return _LOG_ringattach(r, fd, recent);
+	}
+
+	/**
+	 *  Snapshot of the LOG_teememory() ring `name': hands the last `n' lines
+	 *  (0: all) of at least `level' in it at the time of the call to fn,
+	 *  oldest first. Lines overwritten while it runs are skipped. Returns the
+	 *  number of lines handed out, or -1 with errno set.
+	 */
+	inline static ssize_t LOG_memsnapshot(const char *name, int level, size_t n,
+			void (*fn)(void *arg, const struct LOG_ringline *line, const char *text), void *arg) {
+		struct _l_memring *mem = _LOG_memringget(name); // the tee's own mapping
+		struct LOG_ringline l;
+		if (mem == NULL)
+			return -1;
+		struct LOG_ringreader r = { mem->hdr, mem->maplen, __atomic_load_n(&mem->hdr->tail, __ATOMIC_ACQUIRE),
+			UINT64_MAX, 0 };
+		size_t size = 2 * LINE_MAX, m = 0; // room for the longest record
+		char *buf = malloc(size);
+		uint64_t *seqs = n > 0 ? malloc(n * sizeof(*seqs)) : NULL;
+		if (buf == NULL || (n > 0 && seqs == NULL)) {
+			free(buf);
+			free(seqs);
+			_LOG_memringput(mem);
+			errno = ENOMEM;
+			return -1;
+		}
+		// the seqs of the last n lines, then those lines
+		uint64_t start = r.pos, first = 0;
+		r.end = __atomic_load_n(&r.hdr->head, __ATOMIC_ACQUIRE);
+		ssize_t count = 0;
+		if (r.end != 0) {
+			while (LOG_ringnext(&r, buf, size, &l) == 1)
+				if (l.level >= level && n > 0)
+					seqs[m++ % n] = l.seq;
+			first = m > n ? seqs[m % n] : m > 0 ? seqs[0] : 0;
+			r.pos = start, r.seq = UINT64_MAX;
+			while (LOG_ringnext(&r, buf, size, &l) == 1) {
+				if (l.level >= level && l.seq >= first) {
+					fn(arg, &l, buf);
+					++count;
+				}
+			}
+		}
+		free(buf);
+		free(seqs);
+		_LOG_memringput(mem);
+		return count;
+	}
+
+	inline static void LOG_addlevel(int level, const char *prefix) {
+		if (prefix == NULL || *prefix == '\0') {
+			LOGW("%s: invalid prefix.\n", __func__);
+			return;
+		}
+		char *dup = _LOG_strdup(prefix);
+		struct _l_loglevel *levels = NULL;
+		pthread_mutex_lock(&_LOG_mtx);
+		if (dup != NULL && (_loglevels != NULL || _LOG_levelsinit() == 0)
+				&& (levels = _LOG_realloc(_loglevels, sizeof(*_loglevels) * (_numlevels + 1))) != NULL) {
+			_loglevels = levels;
+			_loglevels[_numlevels].level = level;
+			_loglevels[_numlevels].prefix = dup;
+			++_numlevels;
+			_LOG_prefixover |= _LOG_builtinprefix(level) != NULL;
+		}
+		pthread_mutex_unlock(&_LOG_mtx);
+		if (levels == NULL) {
+			_LOG_free(dup);
+			PLOGE("%s: realloc", __func__);
+		}
+	}
+
+	inline static void LOG_prefixcallback(_prefix_callback_t cback) {
+		pthread_mutex_lock(&_LOG_mtx);
+		_prefix_callback = cback ? cback : _prefix_callback;
+		pthread_mutex_unlock(&_LOG_mtx);
+	}
+
+	/**
+	 *  Override the threshold for lines logged by the calling thread, e.g.
+	 *  LOG_threadlevel(-1) to get Debug output from one connection handler.
+	 *  The override applies to the most verbose tee(s) only, so error-only
+	 *  targets are not flooded. Returns the previous override so it can be
+	 *  scoped to a request; LOG_THREADLEVEL_NONE clears it.
+	 */
+	inline static int LOG_threadlevel(int level) {
+		int prev = _LOG_tlevel;
+		_LOG_tlevel = level;
+		return prev;
+	}
+
+	/**
+	 *  Append a stack trace to lines of at least `level' (e.g. 2 for LOGE and
+	 *  LOGF), INT_MAX disables. Frames are printed as module(+offset) for
+	 *  `addr2line -f -e module offset'; only the first miss per module reads
+	 *  /proc/self/maps.
+	 */
+	inline static void LOG_backtrace(int level) {
+		__atomic_store_n(&_LOG_btlevel, level, __ATOMIC_RELAXED);
+	}
+
+	/**
+	 *  Debug on error: each thread keeps its last `depth' lines of at least
+	 *  `level' that a tee filtered out, and a line of LOGTEE_CONTEXT_TRIGGER
+	 *  (Error) or above first writes them to the text tees that dropped them,
+	 *  marked "[context]". depth 0 turns it off. Lines no tee takes are kept
+	 *  as their format and arguments (%s up to LOGTEE_CONTEXT_STR bytes) and
+	 *  only formatted if dumped, so the Debug calls stay cheap.
+	 *  E.g. LOG_context(32, -1) gives each LOGE() the Debug lines before it.
+	 */
+	inline static void LOG_context(int depth, int level) {
+		__atomic_store_n(&_LOG_ctxdepth, depth > 0 ? depth : 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&_LOG_ctxlevel, depth > 0 ? level : INT_MAX, __ATOMIC_RELAXED);
+	}
+
+	/**
+	 *  CLOCK_REALTIME in nanoseconds, from the cycle counter calibrated
+	 *  against the system clocks. Binary records are stamped the same way.
+	 */
+	inline static uint64_t LOG_now() {
+		pthread_once(&_LOG_once, _LOG_init);
+		return _LOG_tickstons(_LOG_ticks());
+	}
+
+	/**
+	 *  Caps the memory the logger allocates for itself (per-thread buffers,
+	 *  profiles, context rings, binary target state, shared memory rings) at
+	 *  `bytes', 0 for no limit. Nearing it, LOG_batch() writes smaller
+	 *  chunks, then Debug and then Info lines are dropped; past it, what
+	 *  needs more memory fails as without memory.
+	 */
+	inline static void LOG_budget(size_t bytes) {
+		__atomic_store_n(&_LOG_membudget, bytes, __ATOMIC_SEQ_CST);
+		_LOG_memlevel();
+	}
+
+	/**
+	 *  Async mode: LOG() queues accepted lines for a writer thread instead
+	 *  of writing them, in one lane of `lanesize' bytes per band of levels
+	 *  (Error and up, Info and Warning, Debug and below). The writer empties
+	 *  the Error lane first, so errors don't wait behind a Debug storm; a
+	 *  full lane drops its lines, except the Error lane whose callers then
+	 *  write them themselves, after the Errors queued before them (LOG_try()
+	 *  drops them). The prefix callback runs in the writer.
+	 *  0 drains the lanes and goes back to writing in the caller.
+	 *  Returns 0, or -1 without memory or threads.
+	 */
+	inline static int LOG_async(size_t lanesize) {
+		struct _l_async *q = &_LOG_q;
+		_LOG_asyncstop();
+		if (lanesize == 0)
+			return 0;
+		size_t size = 4096;
+		while (size < lanesize && size < SIZE_MAX / 4)
+			size *= 2;
+		if (size < 16 * LINE_MAX) // room for a few of the largest records
+			size = 16 * LINE_MAX;
+		pthread_once(&_LOG_once, _LOG_init);
+		pthread_mutex_lock(&q->mtx);
+		int rc = (q->bin = _LOG_malloc(sizeof(*q->bin))) == NULL ? -1 : 0;
+		for (int i = 0; i < LOGTEE_LANES && rc == 0; ++i) {
+			q->lane[i] = (struct _l_lane){ _LOG_malloc(size), size, 0, 0, q->lane[i].dropped };
+			if (q->lane[i].buf == NULL)
+				rc = -1;
+		}
+		if (rc == 0 && (errno = pthread_create(&q->thread, NULL, _LOG_dequeue, NULL)) != 0)
+			rc = -1;
+		if (rc == -1) {
+			int e = errno;
+			for (int i = 0; i < LOGTEE_LANES; ++i) {
+				_LOG_free(q->lane[i].buf);
+				q->lane[i].buf = NULL, q->lane[i].size = 0;
+			}
+			_LOG_free(q->bin);
+			q->bin = NULL;
+			errno = e;
+		} else {
+			__atomic_store_n(&q->running, 1, __ATOMIC_RELAXED);
+		}
+		pthread_mutex_unlock(&q->mtx);
+		return rc;
+	}
+
+	struct LOG_stats {
+		size_t memused, membudget;      // bytes, budget 0 if unlimited
+		uint64_t memdropped;            // lines dropped to stay within budget
+		size_t queued[LOGTEE_LANES];    // async mode: bytes waiting per lane
+		uint64_t qdropped[LOGTEE_LANES];// and lines dropped on a full lane
+	};
+
+	inline static void LOG_stats(struct LOG_stats *st) {
+		st->memused = __atomic_load_n(&_LOG_memused, __ATOMIC_RELAXED);
+		st->membudget = __atomic_load_n(&_LOG_membudget, __ATOMIC_RELAXED);
+		st->memdropped = __atomic_load_n(&_LOG_memdropped, __ATOMIC_RELAXED);
+		pthread_mutex_lock(&_LOG_q.mtx);
+		for (int i = 0; i < LOGTEE_LANES; ++i) {
+			st->queued[i] = _LOG_q.lane[i].tail - _LOG_q.lane[i].head;
+			st->qdropped[i] = _LOG_q.lane[i].dropped;
+		}
+		pthread_mutex_unlock(&_LOG_q.mtx);
+	}
+
+	/**
+	 *  Per call site profiling of the LOGX() macros: invocations, lines past
+	 *  the gate, bytes written and formatting time. Counters live in
+	 *  per-thread tables, so enabling it adds no contention.
+	 */
+	inline static void LOG_profile(int enable) {
+		__atomic_store_n(&_LOG_profiling, enable, __ATOMIC_RELAXED);
+	}
+
+	static int _LOG_sitecmp(const void *a, const void *b) {
+		const struct LOG_site *x = a, *y = b;
+		if (x->ns != y->ns)
+			return x->ns < y->ns ? 1 : -1;
+		return x->bytes < y->bytes ? 1 : x->bytes > y->bytes ? -1 : 0;
+	}
+
+	/**
+	 *  Fills `sites' with up to `max' profiled sites, most expensive
+	 *  (formatting time, then bytes) first. Returns the number of sites.
+	 */
+	inline static size_t LOG_profilesnapshot(struct LOG_site *sites, size_t max) {
+		struct _l_sitetab *all = calloc(1, sizeof(*all));
+		if (all == NULL)
+			return 0;
+		pthread_mutex_lock(&_LOG_mtx);
+		for (struct _l_sitetab *tab = _LOG_sitetabs; tab != NULL; tab = tab->next)
+			_LOG_sitetabmerge(all, tab);
+		if (_LOG_retired != NULL)
+			_LOG_sitetabmerge(all, _LOG_retired);
+		pthread_mutex_unlock(&_LOG_mtx);
+
+		size_t n = 0;
+		for (size_t i = 0; i < LOGTEE_PROFILE_SITES; ++i)
+			if (all->sites[i].file != NULL)
+				all->sites[n++] = all->sites[i];
+		if (all->other.calls > 0) {
+			all->sites[n] = all->other;
+			all->sites[n++].file = "(other)";
+		}
+		qsort(all->sites, n, sizeof(*all->sites), _LOG_sitecmp);
+		memcpy(sites, all->sites, sizeof(*sites) * (n < max ? n : max));
+		free(all);
+		return n;
+	}
+
+	/**
+	 *  Print the `max' most expensive sites
+	 */
+	inline static void LOG_profiledump(FILE *fp, size_t max) {
+		struct LOG_site *sites = calloc(max, sizeof(*sites));
+		if (sites == NULL)
+			return;
+		size_t n = LOG_profilesnapshot(sites, max);
+		fprintf(fp, "LOG: profile of %zu sites, most expensive first\n", n);
+		fprintf(fp, "LOG: %12s %12s %14s %12s  level  site\n", "calls", "accepted", "bytes", "format-ns");
+		for (size_t i = 0; i < n && i < max; ++i)
+			fprintf(fp, "LOG: %12llu %12llu %14llu %12llu  %5d  %s:%d\n", sites[i].calls,
+					sites[i].accepted, sites[i].bytes, sites[i].ns, sites[i].level,
+					sites[i].file, sites[i].line);
+		free(sites);
+	}
+
+	static struct _l_metrics *_LOG_metricsinit() {
+		if (_LOG_metrics == NULL)
+			_LOG_metrics = _LOG_calloc(1, sizeof(*_LOG_metrics));
+		return _LOG_metrics;
+	}
+
+	/**
+	 *  Metrics target: instead of writing lines, counts them per level and
+	 *  per call site, plus the values of the fields registered with
+	 *  LOG_metricsfield(). LOG_metricsdump() exports them. A second call
+	 *  only changes the threshold.
+	 */
+	inline static void LOG_teemetrics(int level) {
+		pthread_mutex_lock(&_LOG_mtx);
+		for (struct _l_fplist *fp = &_fplist; fp; fp = fp->next) {
+			if (fp->kind == _LOG_METRICS) {
+				fp->level = level;
+				__atomic_store_n(&_LOG_metricslevel, level, __ATOMIC_RELAXED);
+				if (level < _LOG_minlevel)
+					__atomic_store_n(&_LOG_minlevel, level, __ATOMIC_RELAXED);
+				pthread_mutex_unlock(&_LOG_mtx);
+				return;
+			}
+		}
+		struct _l_fplist t = { .level = level, .kind = _LOG_METRICS };
+		int rc = _LOG_metricsinit() == NULL ? -1 : _LOG_teeadd(&t);
+		if (rc != -1)
+			__atomic_store_n(&_LOG_metricslevel, level, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&_LOG_mtx);
+		if (rc == -1)
+			LOGE("%s: malloc: %s.\n", __func__, strerror(errno));
+	}
+
+	/**
+	 *  Aggregates conversion #arg (from 1) of lines logged with format fmt,
+	 *  parsed as a number, as metric `name': count, sum, min and max.
+	 *  E.g. LOG_metricsfield("query_ms", "query took %d ms\n", 1)
+	 */
+	inline static void LOG_metricsfield(const char *name, const char *fmt, int arg) {
+		pthread_mutex_lock(&_LOG_mtx);
+		int n = _LOG_nfields;
+		if (arg < 1 || n == LOGTEE_METRIC_FIELDS || _LOG_metricsinit() == NULL) {
+			pthread_mutex_unlock(&_LOG_mtx);
+			LOGW("%s: can't add field '%s'.\n", __func__, name);
+			return;
+		}
+		struct _l_field *f = _LOG_metrics->fields + n;
+		if ((f->name = _LOG_strdup(name)) == NULL || (f->fmt = _LOG_strdup(fmt)) == NULL) {
+			_LOG_free((char *)f->name);
+			f->name = NULL;
+			pthread_mutex_unlock(&_LOG_mtx);
+			LOGE("%s: malloc: %s.\n", __func__, strerror(errno));
+			return;
+		}
+		f->arg = arg;
+		f->min = __builtin_inf(), f->max = -__builtin_inf();
+		__atomic_store_n(&_LOG_nfields, n + 1, __ATOMIC_RELEASE);
+		pthread_mutex_unlock(&_LOG_mtx);
+	}
+
+	static void _LOG_promlabel(FILE *fp, const char *s) {
+		for (; *s; ++s) {
+			if (*s == '"' || *s == '\\')
+				fputc('\\', fp);
+			if (*s == '\n')
+				fputs("\\n", fp);
+			else
+				fputc(*s, fp);
+		}
+	}
+
+	static int _LOG_sitecountcmp(const void *a, const void *b) {
+		const struct _l_sitecount *x = a, *y = b;
+		int c = strcmp(x->file, y->file);
+		return c != 0 ? c : (x->line > y->line) - (x->line < y->line);
+	}
+
+	static int _LOG_levelcountcmp(const void *a, const void *b) {
+		const struct _l_levelcount *x = a, *y = b;
+		return (x->level > y->level) - (x->level < y->level);
+	}
+
+	/**
+	 *  Writes the metrics in the Prometheus text format. Doesn't take the
+	 *  logging mutex, so it can run on a timer or a scrape handler.
+	 */
+	inline static void LOG_metricsdump(FILE *fp) {
+		const struct _l_metrics *m = __atomic_load_n(&_LOG_metrics, __ATOMIC_ACQUIRE);
+		struct _l_levelcount levels[32];
+		struct _l_sitecount *sites = m ? calloc(LOGTEE_METRIC_SITES + 1, sizeof(*sites)) : NULL;
+		size_t nlevels = 0, nsites = 0;
+		if (sites == NULL)
+			return;
+		for (size_t i = 0; i < 32; ++i) {
+			if (__atomic_load_n(&m->levels[i].used, __ATOMIC_ACQUIRE) != 2)
+				continue;
+			levels[nlevels].level = m->levels[i].level;
+			levels[nlevels].lines = __atomic_load_n(&m->levels[i].lines, __ATOMIC_RELAXED);
+			levels[nlevels++].bytes = __atomic_load_n(&m->levels[i].bytes, __ATOMIC_RELAXED);
+		}
+		for (size_t i = 0; i < LOGTEE_METRIC_SITES; ++i) {
+			if (__atomic_load_n(&m->sites[i].used, __ATOMIC_ACQUIRE) != 2)
+				continue;
+			sites[nsites].file = m->sites[i].file;
+			sites[nsites].line = m->sites[i].line;
+			sites[nsites].level = m->sites[i].level;
+			sites[nsites++].lines = __atomic_load_n(&m->sites[i].lines, __ATOMIC_RELAXED);
+		}
+		qsort(levels, nlevels, sizeof(*levels), _LOG_levelcountcmp);
+		qsort(sites, nsites, sizeof(*sites), _LOG_sitecountcmp);
+		if ((sites[nsites].lines = __atomic_load_n(&m->other.lines, __ATOMIC_RELAXED)) > 0)
+			sites[nsites++].file = "(other)";
+
+		fputs("# TYPE logtee_lines_total counter\n", fp);
+		for (size_t i = 0; i < nlevels; ++i)
+			fprintf(fp, "logtee_lines_total{level=\"%d\"} %llu\n", levels[i].level, levels[i].lines);
+		fputs("# TYPE logtee_bytes_total counter\n", fp);
+		for (size_t i = 0; i < nlevels; ++i)
+			fprintf(fp, "logtee_bytes_total{level=\"%d\"} %llu\n", levels[i].level, levels[i].bytes);
+		fputs("# TYPE logtee_site_lines_total counter\n", fp);
+		for (size_t i = 0; i < nsites; ++i) {
+			fputs("logtee_site_lines_total{file=\"", fp);
+			_LOG_promlabel(fp, sites[i].file);
+			fprintf(fp, "\",line=\"%d\",level=\"%d\"} %llu\n", sites[i].line, sites[i].level, sites[i].lines);
+		}
+		free(sites);
+
+		// count and sum make a summary, min and max are gauges of their own
+		static const char *stat[] = { "count", "sum", "min", "max" };
+		int nfields = __atomic_load_n(&_LOG_nfields, __ATOMIC_ACQUIRE);
+		for (int k = 0; k < 4 && nfields > 0; ++k) {
+			if (k != 1)
+				fprintf(fp, "# TYPE logtee_field%s %s\n", k == 0 ? "" : k == 2 ? "_min" : "_max",
+						k == 0 ? "summary" : "gauge");
+			for (int i = 0; i < nfields; ++i) {
+				const struct _l_field *f = m->fields + i;
+				double value;
+				unsigned long long count = __atomic_load_n(&f->count, __ATOMIC_ACQUIRE);
+				if (k == 0)
+					value = count;
+				else if (count == 0 && k > 1)
+					continue;
+				else
+					__atomic_load(k == 1 ? &f->sum : k == 2 ? &f->min : &f->max, &value, __ATOMIC_RELAXED);
+				fprintf(fp, "logtee_field_%s{field=\"", stat[k]);
+				_LOG_promlabel(fp, f->name);
+				fprintf(fp, "\"} %.17g\n", value);
+			}
+		}
+	}
+
+	/**
+	 *  Dump interal state
+	 */
+	__attribute__((__used__)) static void LOG_fornerds() {
+		pthread_mutex_lock(&_LOG_mtx);
+		fprintf(stderr, "LOG: pid=%u, ppid=%u\n", getpid(), getppid());
+		fprintf(stderr, "LOG: number of levels: %zu, &levels=%p, &*levelp=%p\n", _numlevels, _loglevels, &_loglevels);
+		fprintf(stderr, "LOG: &fplist=%p, log targets: ", &_fplist);
+		for (struct _l_fplist *fpl = &_fplist; fpl != NULL; fpl = fpl->next) {
+			if (fpl->kind == _LOG_METRICS) {
+				fprintf(stderr, "<metrics,level=%i,fields=%i> ", fpl->level, _LOG_nfields);
+			} else if (fpl->ring != NULL) {
+				fprintf(stderr, "<ring=%s,level=%i,size=%" PRIu64 ",lines=%" PRIu64, fpl->ring->name,
+						fpl->level, fpl->ring->hdr->size, __atomic_load_n(&fpl->ring->hdr->seq, __ATOMIC_RELAXED));
+			} else if (fpl->fp != NULL) {
+				fprintf(stderr, "<FILE*=%p(fd%u),level=%i", fpl->fp, fileno(fpl->fp), fpl->level);
+				if (fpl->kind == _LOG_BINARY)
+					fprintf(stderr, ",binary,segment=%" PRIu64 ",dict=%" PRIu32, fpl->bin->segment, fpl->bin->nextid - 1);
+			}
+			if (fpl->kind != _LOG_METRICS && _LOG_used(fpl)) {
+				if (fpl->retry != 0)
+					fprintf(stderr, ",paused(%s),errors=%" PRIu64 ",backoff=%" PRIu64 "ms", strerror(fpl->err),
+							fpl->errors, fpl->backoff / 1000000);
+				else if (fpl->errors != 0)
+					fprintf(stderr, ",ok,errors=%" PRIu64 ",last=%s", fpl->errors, strerror(fpl->err));
+				fputs("> ", stderr);
+			}
 		}
 		fputc('\n', stderr);
+		fprintf(stderr, "LOG: minimum level: %i, thread override: %i\n", _LOG_minlevel, _LOG_tlevel);
+		fprintf(stderr, "LOG: backtrace level: %i, cached modules: %zu\n", _LOG_btlevel, _LOG_btnmodules);
+		fprintf(stderr, "LOG: context level: %i, depth: %i\n", _LOG_ctxlevel, _LOG_ctxdepth);
+		fprintf(stderr, "LOG: memory: %zu bytes, budget %zu, %" PRIu64 " lines dropped\n",
+				__atomic_load_n(&_LOG_memused, __ATOMIC_RELAXED), __atomic_load_n(&_LOG_membudget, __ATOMIC_RELAXED),
+				__atomic_load_n(&_LOG_memdropped, __ATOMIC_RELAXED));
+		pthread_mutex_lock(&_LOG_q.mtx);
+		fprintf(stderr, "LOG: async: %s", _LOG_q.running ? "on" : "off");
+		for (int i = 0; i < LOGTEE_LANES; ++i)
+			fprintf(stderr, ", lane %d: %" PRIu64 " of %zu bytes, %" PRIu64 " dropped", i,
+					_LOG_q.lane[i].tail - _LOG_q.lane[i].head, _LOG_q.lane[i].size, _LOG_q.lane[i].dropped);
+		fputc('\n', stderr);
+		pthread_mutex_unlock(&_LOG_q.mtx);
+		fprintf(stderr, "LOG: clock: %s, %.4f ns/tick\n", _LOG_clock.source == _LOG_CLOCK_TSC ? "cycle counter"
+				: "CLOCK_MONOTONIC", _LOG_clock.nspertick);
+		pthread_mutex_unlock(&_LOG_mtx);
+		if (__atomic_load_n(&_LOG_profiling, __ATOMIC_RELAXED))
+			LOG_profiledump(stderr, 20);
 	}
 
 #if defined(__cplusplus)
@@ -0,0 +1,686 @@
+/**
+ * Command line companion of logtee.h
+ *
+ * logtool cat [file...]                  decode binary logs (LOG_teebinary) to text
+ * logtool columns [-o out] [file...]     convert binary logs to the columnar format
+ * logtool merge [-v] file...             decode binary logs into one stream ordered
+ *                                        by timestamp, corrected for per-CPU clock
+ *                                        skew (LOG_merge), -v reports the offsets
+ * logtool count [-l level] [-i seconds] file
+ *                                        lines at or above level (default 2, errors)
+ *                                        per interval (default 60s) of a columnar file
+ * logtool tail [-f] [-n lines] file      last lines (default 10) of a text log, -f
+ *                                        follows appends and rotation (LOG_follownext)
+ * logtool shm [-f] name                  recent lines of a LOG_teeshm() ring, -f
+ *                                        follows it, reporting lines overrun
+ * logtool ring [-f] file                 same for a LOG_teecircular() file, oldest first
+ * logtool verify [-r] file...            check the CRC32C check records of binary logs,
+ *                                        -r truncates each after its last good one
+ *
+ * `columns' also works as a writer: tee the binary output into it with
+ *   LOG_teebinary(popen("logtool columns -o app.ltc", "w"), 0);
+ *
+ * Columnar format: "LTCOL" and a version byte, then row groups of up to
+ * ROWGROUP lines until the end of the file:
+ *   varint rows, varint first and last timestamp
+ *   5 column chunks, each a varint byte length and its data:
+ *     ts       varint first timestamp (CLOCK_REALTIME ns), then zigzag deltas
+ *     level    varint n, n x (zigzag level, varint length, prefix), then a
+ *              varint index into those per row
+ *     site     varint n, n x (varint length, file, varint line), indices
+ *     thread   varint n, n x varint thread id, indices
+ *     message  varint n, n x (varint length, format string), then per row
+ *              varint format index + 1 and varint argument count followed
+ *              by (varint length, bytes) per argument; index 0 means the one
+ *              argument is the whole message
+ * Messages are the lines without the level and callback prefixes.
+ * Readers skip the chunks they don't need, so `count' reads the timestamps
+ * and levels only.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#define  LOGTEE_UNIQUE_STATE
+#include "logtee.h"
+
+#define COL_MAGIC    "LTCOL"
+#define COL_VERSION  1
+#define ROWGROUP     65536
+
+enum { COL_TS, COL_LEVEL, COL_SITE, COL_THREAD, COL_MESSAGE, NCOLS };
+
+static int usage(const char *argv0) {
+	fprintf(stderr, "usage: %s cat [file...]\n"
+			"       %s columns [-o out] [file...]\n"
+			"       %s merge [-v] file...\n"
+			"       %s count [-l level] [-i seconds] file\n"
+			"       %s tail [-f] [-n lines] file\n"
+			"       %s shm [-f] name\n"
+			"       %s ring [-f] file\n"
+			"       %s verify [-r] file...\n", argv0, argv0, argv0, argv0, argv0, argv0, argv0, argv0);
+	return EXIT_FAILURE;
+}
+
+static void *xrealloc(void *p, size_t size) {
+	if ((p = realloc(p, size)) == NULL) {
+		perror("realloc");
+		exit(EXIT_FAILURE);
+	}
+	return p;
+}
+
+static int cat(FILE *in, const char *name) {
+	struct LOG_binreader r;
+	struct LOG_binrecord rec;
+	int rc;
+	LOG_binreader_init(&r, in);
+	while ((rc = LOG_binnext(&r, &rec)) == 1)
+		fwrite(rec.text, 1, rec.textlen, stdout);
+	if (rc == -1)
+		fprintf(stderr, "%s: corrupt record at offset %ld\n", name, ftell(in));
+	else if (fgetc(in) != EOF)
+		fprintf(stderr, "%s: truncated record at offset %ld\n", name, ftell(in) - 1), rc = -1;
+	LOG_binreader_free(&r);
+	return rc;
+}
+
+// Calls fn on every record of each file (stdin without files)
+static int eachrecord(int argc, char *argv[], void (*fn)(const struct LOG_binrecord *, void *), void *arg) {
+	int rc = EXIT_SUCCESS;
+	for (int i = 0; i < (argc ? argc : 1); ++i) {
+		const char *name = argc ? argv[i] : "-";
+		FILE *in = argc ? fopen(name, "rb") : stdin;
+		if (in == NULL) {
+			perror(name);
+			rc = EXIT_FAILURE;
+			continue;
+		}
+		struct LOG_binreader r;
+		struct LOG_binrecord rec;
+		int n;
+		LOG_binreader_init(&r, in);
+		while ((n = LOG_binnext(&r, &rec)) == 1)
+			fn(&rec, arg);
+		if (n == -1 || fgetc(in) != EOF) {
+			fprintf(stderr, "%s: %s record at offset %ld\n", name, n == -1 ? "corrupt" : "truncated", ftell(in));
+			rc = EXIT_FAILURE;
+		}
+		LOG_binreader_free(&r);
+		if (in != stdin)
+			fclose(in);
+	}
+	return rc;
+}
+
+static int cmd_cat(int argc, char *argv[]) {
+	int rc = EXIT_SUCCESS;
+	if (argc == 0)
+		return cat(stdin, "-") == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+	for (int i = 0; i < argc; ++i) {
+		FILE *in = fopen(argv[i], "rb");
+		if (in == NULL) {
+			perror(argv[i]);
+			rc = EXIT_FAILURE;
+			continue;
+		}
+		if (cat(in, argv[i]) != 0)
+			rc = EXIT_FAILURE;
+		fclose(in);
+	}
+	return rc;
+}
+
+/*
+ * Columnar writer
+ */
+
+struct buf {
+	unsigned char *p;
+	size_t len, size;
+};
+
+static void bufreserve(struct buf *b, size_t n) {
+	if (b->len + n > b->size) {
+		b->size = (b->len + n) * 2;
+		b->p = xrealloc(b->p, b->size);
+	}
+}
+
+static void putvarint(struct buf *b, uint64_t v) {
+	bufreserve(b, 10);
+	b->len += _LOG_putvarint(b->p + b->len, v);
+}
+
+static void putbytes(struct buf *b, const void *p, size_t n) {
+	putvarint(b, n);
+	bufreserve(b, n);
+	memcpy(b->p + b->len, p, n);
+	b->len += n;
+}
+
+static uint64_t zigzag(int64_t v) {
+	return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+// Distinct (string, value) pairs of a row group, ids in insertion order
+struct dict {
+	size_t n, size;
+	char **str;
+	int64_t *val;
+	uint32_t *slot;       // id + 1, 0: free
+	size_t nslots;
+};
+
+static size_t dicthash(const char *s, int64_t v, size_t nslots) {
+	return (_LOG_strhash(s) ^ (uint64_t)v * 0x9e3779b97f4a7c15ull) & (nslots - 1);
+}
+
+static uint32_t dictid(struct dict *d, const char *s, int64_t v) {
+	if (2 * (d->n + 1) > d->nslots) {
+		size_t nslots = d->nslots ? 2 * d->nslots : 256;
+		uint32_t *slot = calloc(nslots, sizeof(*slot));
+		if (slot == NULL) {
+			perror("calloc");
+			exit(EXIT_FAILURE);
+		}
+		for (size_t id = 0; id < d->n; ++id) {
+			size_t h = dicthash(d->str[id], d->val[id], nslots);
+			while (slot[h] != 0)
+				h = (h + 1) & (nslots - 1);
+			slot[h] = id + 1;
+		}
+		free(d->slot);
+		d->slot = slot, d->nslots = nslots;
+	}
+	size_t h = dicthash(s, v, d->nslots);
+	for (; d->slot[h] != 0; h = (h + 1) & (d->nslots - 1)) {
+		uint32_t id = d->slot[h] - 1;
+		if (d->val[id] == v && strcmp(d->str[id], s) == 0)
+			return id;
+	}
+	if (d->n == d->size) {
+		d->size = d->size ? 2 * d->size : 64;
+		d->str = xrealloc(d->str, d->size * sizeof(*d->str));
+		d->val = xrealloc(d->val, d->size * sizeof(*d->val));
+	}
+	if ((d->str[d->n] = strdup(s)) == NULL) {
+		perror("strdup");
+		exit(EXIT_FAILURE);
+	}
+	d->val[d->n] = v;
+	d->slot[h] = d->n + 1;
+	return d->n++;
+}
+
+static void dictclear(struct dict *d) {
+	for (size_t i = 0; i < d->n; ++i)
+		free(d->str[i]);
+	d->n = 0;
+	if (d->slot != NULL)
+		memset(d->slot, 0, d->nslots * sizeof(*d->slot));
+}
+
+struct colwriter {
+	FILE *out;
+	size_t rows;
+	uint64_t first, last, prev;
+	struct dict levels, sites, threads, formats;
+	struct buf col[NCOLS];
+	int failed;
+};
+
+static void colflush(struct colwriter *w) {
+	if (w->rows == 0)
+		return;
+	struct buf hdr = { 0 }, dict = { 0 };
+	putvarint(&hdr, w->rows);
+	putvarint(&hdr, w->first);
+	putvarint(&hdr, w->last);
+	fwrite(hdr.p, 1, hdr.len, w->out);
+	for (int c = 0; c < NCOLS; ++c) {
+		dict.len = 0;
+		if (c == COL_LEVEL) {
+			putvarint(&dict, w->levels.n);
+			for (size_t i = 0; i < w->levels.n; ++i) {
+				putvarint(&dict, zigzag(w->levels.val[i]));
+				putbytes(&dict, w->levels.str[i], strlen(w->levels.str[i]));
+			}
+		} else if (c == COL_SITE) {
+			putvarint(&dict, w->sites.n);
+			for (size_t i = 0; i < w->sites.n; ++i) {
+				putbytes(&dict, w->sites.str[i], strlen(w->sites.str[i]));
+				putvarint(&dict, w->sites.val[i]);
+			}
+		} else if (c == COL_THREAD) {
+			putvarint(&dict, w->threads.n);
+			for (size_t i = 0; i < w->threads.n; ++i)
+				putvarint(&dict, w->threads.val[i]);
+		} else if (c == COL_MESSAGE) {
+			putvarint(&dict, w->formats.n);
+			for (size_t i = 0; i < w->formats.n; ++i)
+				putbytes(&dict, w->formats.str[i], strlen(w->formats.str[i]));
+		}
+		hdr.len = 0;
+		putvarint(&hdr, dict.len + w->col[c].len);
+		fwrite(hdr.p, 1, hdr.len, w->out);
+		if (dict.len > 0)
+			fwrite(dict.p, 1, dict.len, w->out);
+		fwrite(w->col[c].p, 1, w->col[c].len, w->out);
+		w->col[c].len = 0;
+	}
+	free(hdr.p);
+	free(dict.p);
+	if (fflush(w->out) == EOF)
+		w->failed = 1;
+	dictclear(&w->levels);
+	dictclear(&w->sites);
+	dictclear(&w->threads);
+	dictclear(&w->formats);
+	w->rows = 0;
+}
+
+static void coladd(const struct LOG_binrecord *rec, void *arg) {
+	struct colwriter *w = arg;
+	if (w->rows == 0)
+		w->first = w->prev = rec->ts;
+	putvarint(w->col + COL_TS, w->rows == 0 ? rec->ts : zigzag((int64_t)(rec->ts - w->prev)));
+	w->prev = w->last = rec->ts;
+	putvarint(w->col + COL_LEVEL, dictid(&w->levels, rec->prefix ? rec->prefix : "", rec->level));
+	putvarint(w->col + COL_SITE, dictid(&w->sites, rec->file ? rec->file : "", rec->line));
+	putvarint(w->col + COL_THREAD, dictid(&w->threads, "", rec->tid));
+	struct buf *msg = w->col + COL_MESSAGE;
+	if (rec->fmt != NULL) {
+		putvarint(msg, dictid(&w->formats, rec->fmt, 0) + 1);
+		putvarint(msg, rec->nargs);
+		for (size_t i = 0; i < rec->nargs; ++i)
+			putbytes(msg, rec->args[i], rec->arglens[i]);
+	} else {
+		size_t skip = (rec->cbprefix ? strlen(rec->cbprefix) : 0) + (rec->prefix ? strlen(rec->prefix) : 0);
+		putvarint(msg, 0);
+		putvarint(msg, 1);
+		putbytes(msg, rec->text + skip, rec->textlen - skip);
+	}
+	if (++w->rows == ROWGROUP)
+		colflush(w);
+}
+
+static int cmd_columns(int argc, char *argv[]) {
+	const char *path = NULL;
+	int opt;
+	while ((opt = getopt(argc, argv, "o:")) != -1) {
+		if (opt != 'o')
+			return usage("logtool");
+		path = optarg;
+	}
+	struct colwriter w = { .out = path ? fopen(path, "wb") : stdout };
+	if (w.out == NULL) {
+		perror(path);
+		return EXIT_FAILURE;
+	}
+	fwrite(COL_MAGIC, 1, 5, w.out);
+	fputc(COL_VERSION, w.out);
+	int rc = eachrecord(argc - optind, argv + optind, coladd, &w);
+	colflush(&w);
+	if (w.failed || (w.out != stdout ? fclose(w.out) : fflush(w.out)) == EOF) {
+		perror(path ? path : "stdout");
+		rc = EXIT_FAILURE;
+	}
+	for (int c = 0; c < NCOLS; ++c)
+		free(w.col[c].p);
+	struct dict *dicts[] = { &w.levels, &w.sites, &w.threads, &w.formats };
+	for (size_t i = 0; i < sizeof dicts / sizeof *dicts; ++i) {
+		dictclear(dicts[i]);
+		free(dicts[i]->str), free(dicts[i]->val), free(dicts[i]->slot);
+	}
+	return rc;
+}
+
+/*
+ * Merge
+ */
+
+struct mergeline {
+	size_t len;
+	char text[];
+};
+
+struct merge {
+	struct LOG_mergeitem *items;
+	size_t n, size;
+	unsigned stream;
+};
+
+static void mergeadd(const struct LOG_binrecord *rec, void *arg) {
+	struct merge *m = arg;
+	if (m->n == m->size)
+		m->items = xrealloc(m->items, (m->size = m->size ? 2 * m->size : 4096) * sizeof(*m->items));
+	struct mergeline *line = xrealloc(NULL, sizeof(*line) + rec->textlen);
+	line->len = rec->textlen;
+	memcpy(line->text, rec->text, rec->textlen);
+	m->items[m->n++] = (struct LOG_mergeitem){ .ts = rec->ts, .tid = rec->tid, .cpu = rec->cpu,
+		.stream = m->stream, .data = line };
+}
+
+static int cmd_merge(int argc, char *argv[]) {
+	int verbose = 0, opt;
+	while ((opt = getopt(argc, argv, "v")) != -1) {
+		if (opt != 'v')
+			return usage("logtool");
+		verbose = 1;
+	}
+	if (optind == argc)
+		return usage("logtool");
+	struct merge m = { NULL, 0, 0, 0 };
+	int rc = EXIT_SUCCESS, ncpus = 0;
+	for (int i = optind; i < argc; ++i, ++m.stream)
+		if (eachrecord(1, argv + i, mergeadd, &m) != EXIT_SUCCESS)
+			rc = EXIT_FAILURE;
+	for (size_t i = 0; i < m.n; ++i)
+		if (m.items[i].cpu >= ncpus)
+			ncpus = m.items[i].cpu + 1;
+	int64_t *offsets = xrealloc(NULL, (ncpus ? ncpus : 1) * sizeof(*offsets));
+	if (LOG_merge(m.items, m.n, offsets, ncpus) == -1) {
+		perror("merge");
+		return EXIT_FAILURE;
+	}
+	for (size_t i = 0; i < m.n; ++i) {
+		struct mergeline *line = m.items[i].data;
+		fwrite(line->text, 1, line->len, stdout);
+		free(line);
+	}
+	for (int cpu = 0; verbose && cpu < ncpus; ++cpu)
+		fprintf(stderr, "cpu %d: %+" PRId64 " ns\n", cpu, offsets[cpu]);
+	free(offsets);
+	free(m.items);
+	return rc;
+}
+
+/*
+ * Columnar reader
+ */
+
+static int readvarint(FILE *in, uint64_t *v) {
+	unsigned char b[10];
+	size_t n = 0;
+	int c;
+	do {
+		if ((c = fgetc(in)) == EOF)
+			return n == 0 ? 0 : -1;
+		b[n++] = c;
+	} while ((c & 0x80) && n < sizeof b);
+	const unsigned char *p = b;
+	return _LOG_getvarint(&p, b + n, v) == -1 ? -1 : 1;
+}
+
+struct bucket {
+	uint64_t start, count;
+};
+
+static int bucketcmp(const void *a, const void *b) {
+	const struct bucket *x = a, *y = b;
+	return x->start < y->start ? -1 : x->start > y->start;
+}
+
+static int cmd_count(int argc, char *argv[]) {
+	long minlevel = 2, interval = 60;
+	int opt;
+	while ((opt = getopt(argc, argv, "l:i:")) != -1) {
+		switch (opt) {
+			case 'l': minlevel = strtol(optarg, NULL, 0); break;
+			case 'i': interval = strtol(optarg, NULL, 0); break;
+			default: return usage("logtool");
+		}
+	}
+	if (optind != argc - 1 || interval <= 0)
+		return usage("logtool");
+	const char *path = argv[optind];
+	FILE *in = fopen(path, "rb");
+	char magic[6];
+	if (in == NULL) {
+		perror(path);
+		return EXIT_FAILURE;
+	}
+	if (fread(magic, 1, 6, in) != 6 || memcmp(magic, COL_MAGIC, 5) != 0 || magic[5] != COL_VERSION) {
+		fprintf(stderr, "%s: not a columnar log\n", path);
+		fclose(in);
+		return EXIT_FAILURE;
+	}
+
+	struct stat st;
+	fstat(fileno(in), &st);
+	struct bucket *buckets = NULL;
+	size_t nbuckets = 0, size = 0;
+	unsigned long long bytesread = 6, total = 6;
+	unsigned char *col[2] = { NULL, NULL };
+	size_t colsize[2] = { 0, 0 };
+	int rc = EXIT_SUCCESS;
+	for (;;) {
+		uint64_t rows, first, last, len[NCOLS];
+		long start = ftell(in);
+		int n = readvarint(in, &rows);
+		if (n == 0)
+			break;
+		if (n == -1 || readvarint(in, &first) != 1 || readvarint(in, &last) != 1)
+			goto corrupt;
+		// the timestamp and level chunks are read, the rest is skipped
+		for (int c = 0; c < NCOLS; ++c) {
+			if (readvarint(in, len + c) != 1)
+				goto corrupt;
+			if (c < 2) {
+				if (len[c] > colsize[c])
+					col[c] = xrealloc(col[c], colsize[c] = len[c]);
+				if (fread(col[c], 1, len[c], in) != len[c])
+					goto corrupt;
+			} else if (fseek(in, len[c], SEEK_CUR) == -1) {
+				goto corrupt;
+			}
+		}
+		if (ftell(in) > st.st_size)
+			goto corrupt;
+		bytesread += (ftell(in) - start) - (len[COL_SITE] + len[COL_THREAD] + len[COL_MESSAGE]);
+		total += ftell(in) - start;
+
+		// the level predicate is evaluated once per dictionary entry
+		const unsigned char *lp = col[1], *lend = col[1] + len[COL_LEVEL];
+		const unsigned char *tp = col[0], *tend = col[0] + len[COL_TS];
+		uint64_t nlevels, v, ts = 0;
+		if (_LOG_getvarint(&lp, lend, &nlevels) == -1 || nlevels > len[COL_LEVEL])
+			goto corrupt;
+		char *match = calloc(nlevels + 1, 1);
+		if (match == NULL) {
+			perror("calloc");
+			exit(EXIT_FAILURE);
+		}
+		for (uint64_t i = 0; i < nlevels; ++i) {
+			uint64_t plen;
+			if (_LOG_getvarint(&lp, lend, &v) == -1 || _LOG_getvarint(&lp, lend, &plen) == -1
+					|| plen > (uint64_t)(lend - lp)) {
+				free(match);
+				goto corrupt;
+			}
+			match[i] = (int64_t)((v >> 1) ^ -(v & 1)) >= minlevel;
+			lp += plen;
+		}
+		for (uint64_t row = 0; row < rows; ++row) {
+			if (_LOG_getvarint(&tp, tend, &v) == -1) {
+				free(match);
+				goto corrupt;
+			}
+			ts = row == 0 ? v : ts + (uint64_t)(int64_t)((v >> 1) ^ -(v & 1));
+			if (_LOG_getvarint(&lp, lend, &v) == -1 || v >= nlevels) {
+				free(match);
+				goto corrupt;
+			}
+			if (!match[v])
+				continue;
+			uint64_t b = ts / 1000000000ull / interval * interval;
+			if (nbuckets == 0 || buckets[nbuckets - 1].start != b) {
+				if (nbuckets == size)
+					buckets = xrealloc(buckets, (size = size ? 2 * size : 64) * sizeof(*buckets));
+				buckets[nbuckets++] = (struct bucket){ b, 0 };
+			}
+			buckets[nbuckets - 1].count++;
+		}
+		free(match);
+	}
+	if (0) {
+corrupt:
+		fprintf(stderr, "%s: corrupt row group at offset %ld\n", path, ftell(in));
+		rc = EXIT_FAILURE;
+	}
+
+	// lines of concurrent threads are only roughly in time order
+	qsort(buckets, nbuckets, sizeof(*buckets), bucketcmp);
+	for (size_t i = 0; i < nbuckets; ) {
+		struct bucket b = buckets[i];
+		while (++i < nbuckets && buckets[i].start == b.start)
+			b.count += buckets[i].count;
+		time_t t = b.start;
+		char when[32];
+		strftime(when, sizeof when, "%Y-%m-%dT%H:%M:%SZ", gmtime(&t));
+		printf("%s %llu\n", when, (unsigned long long)b.count);
+	}
+	fprintf(stderr, "%s: read %llu of %llu bytes\n", path, bytesread, total);
+	free(buckets);
+	free(col[0]);
+	free(col[1]);
+	fclose(in);
+	return rc;
+}
+
+static int cmd_tail(int argc, char *argv[]) {
+	long last = 10;
+	int follow = 0, opt;
+	while ((opt = getopt(argc, argv, "fn:")) != -1) {
+		switch (opt) {
+			case 'f': follow = 1; break;
+			case 'n': last = strtol(optarg, NULL, 0); break;
+			default: return usage("logtool");
+		}
+	}
+	if (optind != argc - 1)
+		return usage("logtool");
+	struct LOG_follower f;
+	struct LOG_lineview v;
+	int rc;
+	if (LOG_followopen(&f, argv[optind], last) == -1) {
+		perror(argv[optind]);
+		return EXIT_FAILURE;
+	}
+	while ((rc = LOG_follownext(&f, &v, follow ? -1 : 0)) == 1) {
+		fwrite(v.ptr, 1, v.len, stdout);
+		putchar('\n');
+		if (follow)
+			fflush(stdout);
+	}
+	if (rc == -1)
+		perror(argv[optind]);
+	LOG_followclose(&f);
+	return rc == -1 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+// `shm' and `ring': same reader over a shared memory object or a file
+static int cmd_ring(int argc, char *argv[], int (*attach)(struct LOG_ringreader *, const char *, int)) {
+	int follow = 0, opt, rc;
+	while ((opt = getopt(argc, argv, "f")) != -1) {
+		if (opt != 'f')
+			return usage("logtool");
+		follow = 1;
+	}
+	if (optind != argc - 1)
+		return usage("logtool");
+	struct LOG_ringreader r;
+	struct LOG_ringline l;
+	static char line[2 * LINE_MAX];
+	if (attach(&r, argv[optind], 1) == -1) {
+		perror(argv[optind]);
+		return EXIT_FAILURE;
+	}
+	// the writer never waits for readers, so followers poll
+	while ((rc = LOG_ringnext(&r, line, sizeof line, &l)) != -1) {
+		if (rc == 0) {
+			if (!follow)
+				break;
+			fflush(stdout);
+			nanosleep(&(struct timespec){ .tv_nsec = 10000000 }, NULL);
+			continue;
+		}
+		if (l.lost > 0)
+			fprintf(stderr, "logtool: overrun, %" PRIu64 " lines lost\n", l.lost);
+		fputs(line, stdout);
+	}
+	if (rc == -1)
+		fprintf(stderr, "%s: corrupt ring\n", argv[optind]);
+	LOG_ringdetach(&r);
+	return rc == -1 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+// A torn or corrupt binary log is cut after the last check that matched
+static int cmd_verify(int argc, char *argv[]) {
+	int repair = 0, opt, rc = EXIT_SUCCESS;
+	while ((opt = getopt(argc, argv, "r")) != -1) {
+		if (opt != 'r')
+			return usage("logtool");
+		repair = 1;
+	}
+	if (optind == argc)
+		return usage("logtool");
+	for (int i = optind; i < argc; ++i) {
+		const char *name = argv[i];
+		FILE *in = fopen(name, "rb");
+		if (in == NULL) {
+			perror(name);
+			rc = EXIT_FAILURE;
+			continue;
+		}
+		struct LOG_binreader r;
+		struct LOG_binrecord rec;
+		unsigned long long lines = 0;
+		int n;
+		LOG_binreader_init(&r, in);
+		while ((n = LOG_binnext(&r, &rec)) == 1)
+			++lines;
+		long end = ftell(in), size = fseek(in, 0, SEEK_END) == 0 ? ftell(in) : -1;
+		// logs from before check records can only lose a torn tail
+		long good = r.checks > 0 ? r.verified : n == 0 ? end : -1;
+		if (n == 0 && good == size) {
+			printf("%s: ok, %llu lines, %llu checks\n", name, lines, (unsigned long long)r.checks);
+		} else {
+			fprintf(stderr, "%s: %s at offset %ld, last good check ends at %ld\n", name,
+					n == -1 ? "corrupt record" : end < size ? "torn record" : "unchecked records", end, good);
+			if (repair && good >= 0 && truncate(name, good) == 0)
+				printf("%s: truncated to %ld bytes, %ld dropped\n", name, good, size - good);
+			else if (repair)
+				fprintf(stderr, "%s: can't repair%s%s\n", name, good < 0 ? "" : ": ", good < 0 ? "" : strerror(errno));
+			rc = EXIT_FAILURE;
+		}
+		LOG_binreader_free(&r);
+		fclose(in);
+	}
+	return rc;
+}
+
+int main(int argc, char *argv[]) {
+	if (argc < 2)
+		return usage(argv[0]);
+	if (strcmp(argv[1], "cat") == 0)
+		return cmd_cat(argc - 2, argv + 2);
+	if (strcmp(argv[1], "columns") == 0)
+		return cmd_columns(argc - 1, argv + 1);
+	if (strcmp(argv[1], "merge") == 0)
+		return cmd_merge(argc - 1, argv + 1);
+	if (strcmp(argv[1], "count") == 0)
+		return cmd_count(argc - 1, argv + 1);
+	if (strcmp(argv[1], "tail") == 0)
+		return cmd_tail(argc - 1, argv + 1);
+	if (strcmp(argv[1], "shm") == 0)
+		return cmd_ring(argc - 1, argv + 1, LOG_shmattach);
+	if (strcmp(argv[1], "ring") == 0)
+		return cmd_ring(argc - 1, argv + 1, LOG_circularattach);
+	if (strcmp(argv[1], "verify") == 0)
+		return cmd_verify(argc - 1, argv + 1);
+	return usage(argv[0]);
+}
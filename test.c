@@ -8,7 +8,7 @@
 
 const char *cback() {
 	static char buf[128];
-	snprintf(buf, sizeof buf, "[%zu]: ", time(NULL));
+	snprintf(buf, sizeof buf, "[%" PRIu64 "]: ", LOG_now());
 	return buf;
 }
 
@@ -19,6 +19,10 @@ int main() {
 	LOGI("%s, %s!\n", "Hello", "World");
 	LOGE("Nooo!\n");
 	LOGW("Hmm...\n");
+	LOGD("Debug 1\n"); // filtered out
+	int prev = LOG_threadlevel(-1);
+	LOGD("Debug 2\n"); // this thread only
+	LOG_threadlevel(prev);
 
 	LOG_teefile(stderr, 1);
 	LOG_teefile(stderr, 2);
@@ -31,11 +35,35 @@ int main() {
 
 	LOG_teefile(stderr, 0);
 	LOG_teepath("log.txt", 0);
+	LOG_backtrace(3); // LOGF lines come with a stack trace
 
 	unlink("/");
 	PLOGE("unlink"); // perror()-like
 
 	LOGI("Info 3\n");
+
+	LOG_context(2, -1); // Error lines bring the last 2 lines filtered out
+	LOGD("Context 1\n");
+	LOGD("Context 2\n");
+	LOGD("Context %d\n", 3);
+	LOGE("Err 3\n");
+	LOGE("Err 4\n"); // context handed out already
+	LOG_context(0, 0);
+
+	struct LOG_stats st;
+	LOG_budget(1); // far over it: Warnings and up only
+	LOGI("Info 3\n"); // dropped
+	LOG_stats(&st);
+	LOGW("Warn 3, %" PRIu64 " dropped, %zu byte budget, in use: %d\n", st.memdropped, st.membudget,
+			st.memused > 0);
+	LOG_budget(0);
+
+	LOG_teemetrics(0); // counts instead of writing
+	LOG_metricsfield("took_ms", "Took %d ms\n", 1);
+	LOGI("Took %d ms\n", 12);
+	LOGW("Took %d ms\n", 30);
+	LOG_metricsdump(stderr);
+
 	LOGF("Fatal\n");
 	LOGI("Not reached\n"); // not reached
 }
@@ -0,0 +1,1719 @@
+/**
+ * Concurrency stress test and format fuzzer for logtee.h
+ *
+ * The fuzzer checks text and binary targets against snprintf(), and context
+ * lines formatted late from captured arguments (LOG_context()). LOG_merge()
+ * gets records from CPUs with skewed clocks and must order them back.
+ *
+ * Meant to be run under ThreadSanitizer and AddressSanitizer (make tsan asan):
+ * logger threads write self-checking lines while control threads keep
+ * reconfiguring the Tee, then every line of every output file is verified
+ * for integrity (no torn or interleaved lines, per-thread order preserved).
+ * A follow reader then tails a log through a rotation and must see every
+ * line exactly once, and a shared memory ring reader racing the loggers
+ * must get whole lines in order, with every gap reported as lost. Last, a
+ * circular file must hold the newest lines in order across a restart.
+ * In async mode an Error must overtake a lane full of Debug lines, while
+ * each lane keeps its order and counts what it dropped, also with Errors
+ * past a full lane, and a queued line must not need its format or file
+ * once LOG() returned. LOG_try() must return at once with the right
+ * status while another thread holds the Tee, and a thread must still log
+ * from its own key destructors as it exits.
+ * A tee on a full pipe must be paused by its breaker and come back once
+ * the pipe drains, with both changes logged to the other tee, and
+ * LOG_try() must report lines no tee took as dropped. Snapshots
+ * of a memory ring must give the last lines of a level in order while
+ * loggers keep overwriting it, and not wait for the Tee. Binary logs
+ * must fail their check records where a byte flipped or the tail tore,
+ * and read cleanly up to there, and a line whose format can't be added
+ * to the dictionary must not cost the lines after it. A binary log
+ * converted with `logtool columns' must give `logtool count' the Errors
+ * per second it holds, read from its timestamp and level chunks alone.
+ * Threads charging the memory budget at once must leave the level floor
+ * where the final usage puts it.
+ * LOG_batch() lines must come out whole and in order, written directly
+ * or queued, while another thread logs between the batches, in smaller
+ * chunks as the memory budget fills. Literals without arguments must
+ * skip formatting and still read back the same.
+ * Builtin prefixes the macros pass must be used without a lookup, and
+ * give way to LOG_addlevel(). The profile must count every call of a
+ * site, gated or not, and the lines and bytes that got through, with
+ * one row per file:line however many copies of the name logged it.
+ * Metrics counted by threads at once must be exact, with one series per
+ * file:line whichever copy of the file name each thread logged with.
+ *
+ * Usage: test_stress [seed [lines-per-thread]]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#define  LOGTEE_UNIQUE_STATE
+#include "logtee.h"
+
+#define NLOGGERS  8
+#define NCONTROL  2
+#define NPATHS    4
+#define BINPATH   (NPATHS - 1)   // the last one gets binary targets
+
+static char paths[NPATHS][64];
+static int nlines = 20000;
+static int stop;
+static FILE *devnull;
+
+static unsigned xorshift(unsigned *s) {
+	*s ^= *s << 13; *s ^= *s >> 17; *s ^= *s << 5;
+	return *s;
+}
+
+static unsigned fnv1a(const char *p, size_t n) {
+	unsigned h = 2166136261u;
+	while (n--)
+		h = (h ^ (unsigned char)*p++) * 16777619u;
+	return h;
+}
+
+#define FAIL(...) do { fprintf(stdout, "FAIL: " __VA_ARGS__); exit(EXIT_FAILURE); } while (0)
+
+/*
+ * Format fuzzer: random literal text around up to two random conversions,
+ * checked against snprintf() truncated the same way LOG() does, and the
+ * same line decoded back from a binary target.
+ */
+
+union arg { long long ll; double d; const char *s; int c; void *p; };
+
+static const char *fuzzstrings[] = { "", "x", "hello", "a somewhat longer string argument", "%s%n%d" };
+static const double fuzzdoubles[] = { 0.0, -0.0, 1.5, -2.25e-300, 6.02e23, 1e308 };
+
+// Appends a random conversion of class `cls' to fmt, fills its argument
+static size_t fuzzspec(unsigned *seed, int cls, char *fmt, union arg *v) {
+	static const char *flags[] = { "-+ 0", "-+ #0", "-", "-", "-" };
+	static const char *convs[] = { "dioxXu", "eEfFgGaA", "s", "c", "p" };
+	size_t n = 0;
+	fmt[n++] = '%';
+	for (const char *f = flags[cls]; *f; ++f)
+		if (xorshift(seed) % 4 == 0)
+			fmt[n++] = *f;
+	unsigned r = xorshift(seed) % 16;
+	if (r < 6) // width, occasionally overflowing LINE_MAX
+		n += sprintf(fmt + n, "%u", r == 0 ? LINE_MAX + xorshift(seed) % 64 : xorshift(seed) % 40);
+	if (cls <= 2 && xorshift(seed) % 3 == 0)
+		n += sprintf(fmt + n, ".%u", xorshift(seed) % 30);
+	const char *conv = convs[cls];
+	char c = conv[xorshift(seed) % strlen(conv)];
+	if (cls == 0) {
+		fmt[n++] = 'l', fmt[n++] = 'l';
+		v->ll = (long long)xorshift(seed) << (xorshift(seed) % 32);
+		if (xorshift(seed) % 2 && c != 'u' && c != 'o' && c != 'x' && c != 'X')
+			v->ll = -v->ll;
+	} else if (cls == 1) {
+		r = xorshift(seed) % 9;
+		v->d = r < 6 ? fuzzdoubles[r] : r == 6 ? INFINITY : r == 7 ? -NAN : xorshift(seed) / 7.0;
+	} else if (cls == 2) {
+		v->s = fuzzstrings[xorshift(seed) % (sizeof fuzzstrings / sizeof *fuzzstrings)];
+	} else if (cls == 3) {
+		v->c = xorshift(seed) % 2 ? ' ' + xorshift(seed) % 95 : 0;
+	} else {
+		v->p = xorshift(seed) % 4 ? (void *)(uintptr_t)xorshift(seed) : NULL;
+	}
+	fmt[n++] = c;
+	return n;
+}
+
+static size_t fuzztext(unsigned *seed, char *fmt) {
+	static const char alphabet[] = "abcXYZ019 .,:;-_=!?\\\"'()[]{}<>";
+	size_t n = 0, len = xorshift(seed) % 12;
+	for (size_t i = 0; i < len; ++i) {
+		if (xorshift(seed) % 10 == 0)
+			fmt[n++] = '%', fmt[n++] = '%';
+		else
+			fmt[n++] = alphabet[xorshift(seed) % (sizeof alphabet - 1)];
+	}
+	return n;
+}
+
+#define CLASSES(X, ...)  X(0, ll, __VA_ARGS__) X(1, d, __VA_ARGS__) X(2, s, __VA_ARGS__) \
+                         X(3, c, __VA_ARGS__) X(4, p, __VA_ARGS__)
+#define CLASSES2(X, ...) X(0, ll, __VA_ARGS__) X(1, d, __VA_ARGS__) X(2, s, __VA_ARGS__) \
+                         X(3, c, __VA_ARGS__) X(4, p, __VA_ARGS__)
+// excess arguments are ignored by printf, so every call passes two
+#define FUZZCALL(j, b, i, a) case i * 5 + j: \
+		LOG(level, fmt, v[0].a, v[1].b); \
+		snprintf(want, LINE_MAX, fmt, v[0].a, v[1].b); \
+		break;
+#define FUZZOUTER(i, a, _) CLASSES2(FUZZCALL, i, a)
+
+// Random format with up to two conversions, logged and rendered into want
+static void fuzzline(unsigned *seed, int level, char *fmt, char *want) {
+	union arg v[2] = { { 0 }, { 0 } };
+	int cls[2] = { 0, 0 };
+	size_t n = fuzztext(seed, fmt);
+	for (int k = 0, nconv = xorshift(seed) % 3; k < nconv; ++k) {
+		cls[k] = xorshift(seed) % 5;
+		n += fuzzspec(seed, cls[k], fmt + n, v + k);
+		n += fuzztext(seed, fmt + n);
+	}
+	fmt[n] = '\0';
+
+	switch (cls[0] * 5 + cls[1]) {
+		CLASSES(FUZZOUTER, _)
+	}
+}
+
+static void fuzz(unsigned seed, int iterations) {
+	FILE *out = tmpfile(), *bin = tmpfile(), *binin;
+	if (out == NULL || bin == NULL)
+		FAIL("tmpfile: %s\n", strerror(errno));
+	char binpath[64];
+	snprintf(binpath, sizeof binpath, "/proc/self/fd/%d", fileno(bin));
+	if ((binin = fopen(binpath, "rb")) == NULL)
+		FAIL("%s: %s\n", binpath, strerror(errno));
+	struct LOG_binreader reader;
+	struct LOG_binrecord rec;
+	LOG_binreader_init(&reader, binin);
+	LOG_reset();
+	LOG_teefile(out, 0);
+	LOG_teebinary(bin, 0);
+
+	static char fmt[256], want[LINE_MAX + 8], got[LINE_MAX + 8];
+	off_t off = 0;
+	for (int it = 0; it < iterations; ++it) {
+		fuzzline(&seed, 0, fmt, want);
+		size_t wantlen = strlen("(II): ") + strlen(want);
+		ssize_t len = pread(fileno(out), got, sizeof got, off);
+		if (len < 0 || (size_t)len != wantlen || memcmp(got, "(II): ", 6) != 0
+				|| memcmp(got + 6, want, wantlen - 6) != 0)
+			FAIL("fuzz: format '%s' (seed %u, iteration %d): got %zd bytes, want %zu\n",
+					fmt, seed, it, len, wantlen);
+		off += len;
+
+		// text targets stop at a %c of '\0', the binary record keeps it
+		if (LOG_binnext(&reader, &rec) != 1 || strlen(rec.text) != wantlen
+				|| memcmp(rec.text, got, wantlen) != 0)
+			FAIL("fuzz: format '%s' (seed %u, iteration %d): binary record differs\n",
+					fmt, seed, it);
+		struct timespec now;
+		clock_gettime(CLOCK_REALTIME, &now);
+		uint64_t ns = now.tv_sec * 1000000000ull + now.tv_nsec;
+		if (rec.ts > ns + 1000000 || rec.ts < ns - 1000000000 || rec.tid != syscall(SYS_gettid)
+				|| rec.cpu < -1)
+			FAIL("fuzz: iteration %d: bad timestamp or thread id\n", it);
+	}
+	if (LOG_binnext(&reader, &rec) != 0)
+		FAIL("fuzz: trailing binary records\n");
+	LOG_binreader_free(&reader);
+	fclose(binin);
+	LOG_reset(); // closes `out' and `bin'
+}
+
+/*
+ * Deferred formatting: Debug lines filtered out are captured unformatted
+ * and rendered only when an Error line dumps them as context, which must
+ * give what snprintf() gives. Fuzzed formats first, then every conversion
+ * and length modifier.
+ */
+
+static FILE *ctxout;
+static off_t ctxoff;
+
+static void ctxcheck(const char *fmt, const char *want) {
+	static char expect[LINE_MAX + 64], got[LINE_MAX + 64];
+	size_t len = strlen(want); // as far as "%s" gets
+	int n = snprintf(expect, sizeof expect, "(DD): [context] %s%s(EE): end\n", want,
+			len > 0 && want[len - 1] == '\n' ? "" : "\n");
+	ssize_t rc = pread(fileno(ctxout), got, sizeof got, ctxoff);
+	if (rc != n || memcmp(got, expect, n) != 0)
+		FAIL("deferred: format '%s': got '%.*s', want '%s'\n", fmt, (int)(rc < 0 ? 0 : rc), got, expect);
+	ctxoff += rc;
+}
+
+#define DEFERRED(fmt, ...) do { \
+		snprintf(want, LINE_MAX, fmt, __VA_ARGS__); \
+		LOGD(fmt, __VA_ARGS__); \
+		LOGE("end\n"); \
+		ctxcheck(fmt, want); \
+	} while (0)
+
+static void deferred(unsigned seed, int iterations) {
+	if ((ctxout = tmpfile()) == NULL)
+		FAIL("tmpfile: %s\n", strerror(errno));
+	LOG_reset();
+	LOG_teefile(ctxout, 0);
+	LOG_context(1, -1);
+
+	static char fmt[256], want[LINE_MAX + 8];
+	for (int it = 0; it < iterations; ++it) {
+		fuzzline(&seed, -1, fmt, want);
+		LOGE("end\n");
+		ctxcheck(fmt, want);
+	}
+
+	const char *volatile null = NULL; // not a constant, for -Wformat-overflow
+	char unterminated[4] = { 'a', 'b', 'c', 'd' }, longer[200];
+	int count = 0;
+	memset(longer, 'x', sizeof longer - 1);
+	longer[sizeof longer - 1] = '\0';
+	DEFERRED("%d %i %u %o %x %X %c|%%|%5.3d %-+5i %#o %#x", -42, INT_MIN, UINT_MAX, 8u, 255u, 0xabcu, 'z',
+			7, 3, 8u, 0u);
+	DEFERRED("%hhd %hhu %hd %hu %ld %lu %lld %llu", (signed char)-5, (unsigned char)250, (short)-300,
+			(unsigned short)65000, LONG_MIN, ULONG_MAX, LLONG_MIN, ULLONG_MAX);
+	DEFERRED("%jd %ju %zd %zu %td %tx", INTMAX_MIN, UINTMAX_MAX, (ssize_t)-1, SIZE_MAX,
+			(ptrdiff_t)-77, (ptrdiff_t)77);
+	DEFERRED("%f %F %e %E %g %G %a %A %.0f %+.10e", 3.14159, -INFINITY, 6.02e23, -1e-300, 1e-5, NAN,
+			1.0, -0.5, 2.5, 1.0 / 3);
+	DEFERRED("%Lf %Le %Lg %La", 1.5L, -2.5e-4000L, 1e4000L, 0.1L);
+	DEFERRED("%*d|%-*d|%.*f|%*.*s|%.*s|%*s", 6, 42, -6, 42, 3, 2.71828, 8, 2, "hello", -1, "neg",
+			3, "ab");
+	DEFERRED("%s|%.3s|%.2s|%s|%10s", "plain", "truncated", unterminated, null, "");
+	DEFERRED("%ls|%.2ls|%lc|%lc", L"wide", L"wide", (wint_t)L'w', (wint_t)'A');
+	DEFERRED("%p %p %c", (void *)&count, (void *)NULL, 0);
+	DEFERRED("n before%n after %d", &count, 1);
+	errno = ENOSPC;
+	DEFERRED("%m %d", 2);
+
+	// %s arguments are kept up to LOGTEE_CONTEXT_STR bytes
+	LOGD("%s\n", longer);
+	LOGE("end\n");
+	snprintf(want, LINE_MAX, "%.*s", LOGTEE_CONTEXT_STR, longer);
+	ctxcheck("%s\n", want);
+	LOG_reset(); // closes ctxout
+}
+
+/*
+ * Clock skew: synthetic records of threads hopping between CPUs whose
+ * clocks are off by known amounts, in two streams. LOG_merge() must find
+ * the offsets and put the records back in true order.
+ */
+
+#define SKEWCPUS     4
+#define SKEWTHREADS  6
+#define SKEWLINES    2000
+#define SKEWSLACK    400     // ns, the merge may be off by this much
+
+struct skewrec {
+	uint64_t truets;
+	int thread, seq;
+};
+
+static void skew(unsigned seed) {
+	static const int64_t offset[SKEWCPUS] = { 0, 7000, -4000, 15000 };
+	static struct LOG_mergeitem items[SKEWTHREADS * SKEWLINES];
+	static struct skewrec recs[SKEWTHREADS * SKEWLINES];
+	size_t n = 0;
+	for (int t = 0; t < SKEWTHREADS; ++t) {
+		uint64_t now = 1000000000000000000ull + xorshift(&seed) % 1000;
+		int cpu = t % SKEWCPUS;
+		for (int i = 0; i < SKEWLINES; ++i, ++n) {
+			now += 200 + xorshift(&seed) % 3000;
+			if (xorshift(&seed) % 4 == 0)
+				cpu = xorshift(&seed) % SKEWCPUS;
+			recs[n] = (struct skewrec){ now, t, i };
+			items[n] = (struct LOG_mergeitem){ .ts = now + offset[cpu], .tid = 100 + t, .cpu = cpu,
+				.stream = t % 2, .data = recs + n };
+		}
+	}
+	int64_t found[SKEWCPUS];
+	if (LOG_merge(items, n, found, SKEWCPUS) == -1)
+		FAIL("skew: LOG_merge: %s\n", strerror(errno));
+	for (int c = 0; c < SKEWCPUS; ++c)
+		if (llabs((found[c] - found[0]) - offset[c]) > SKEWSLACK)
+			FAIL("skew: cpu %d offset %" PRId64 ", want %" PRId64 "\n", c, found[c] - found[0], offset[c]);
+	int last[SKEWTHREADS];
+	memset(last, -1, sizeof last);
+	for (size_t i = 0; i < n; ++i) {
+		const struct skewrec *r = items[i].data;
+		if (r->seq != last[r->thread] + 1)
+			FAIL("skew: thread %d line %d after %d\n", r->thread, r->seq, last[r->thread]);
+		last[r->thread] = r->seq;
+		const struct skewrec *prev = i > 0 ? items[i - 1].data : r;
+		if (prev->truets > r->truets + 2 * SKEWSLACK)
+			FAIL("skew: line %zu is %" PRIu64 " ns early\n", i, prev->truets - r->truets);
+	}
+}
+
+/*
+ * Concurrency stress
+ */
+
+static const char *cback() {
+	return "[cb] ";
+}
+
+static void *logger(void *arg) {
+	int id = (int)(intptr_t)arg;
+	unsigned seed = 0x9e3779b9u * (id + 1);
+	static const int levels[] = { -1, 0, 1, 2, 4, 5, 6 };
+	char payload[160], body[256];
+
+	for (int i = 0; i < nlines; ++i) {
+		size_t n = xorshift(&seed) % (sizeof payload - 1);
+		for (size_t k = 0; k < n; ++k)
+			payload[k] = 'a' + xorshift(&seed) % 26;
+		payload[n] = '\0';
+		int len = snprintf(body, sizeof body, "T%d #%d %s", id, i, payload);
+		LOG_at(__FILE__, __LINE__, levels[xorshift(&seed) % 7], "%s |%08x\n", body, fnv1a(body, len));
+		if (i % 1000 == 0)
+			LOG_threadlevel(i % 2000 ? -1 : LOG_THREADLEVEL_NONE);
+	}
+	return NULL;
+}
+
+static void *control(void *arg) {
+	unsigned seed = 0x85ebca6bu * ((unsigned)(intptr_t)arg + 1);
+	static const char *prefixes[] = { "(L4): ", "(L5): ", "(L6): " };
+	struct LOG_site sites[4];
+	while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+		unsigned r = xorshift(&seed) % 18;
+		if (r < 5)
+			LOG_teepath(paths[xorshift(&seed) % BINPATH], (int)(xorshift(&seed) % 4) - 1);
+		else if (r < 6)
+			LOG_teebinarypath(paths[BINPATH], (int)(xorshift(&seed) % 4) - 1);
+		else if (r < 8)
+			LOG_reset();
+		else if (r < 12)
+			LOG_addlevel(4 + r % 3, prefixes[r % 3]);
+		else if (r < 14)
+			LOG_prefixcallback(cback);
+		else if (r < 15)
+			LOG_backtrace(xorshift(&seed) % 2 ? 2 : INT_MAX);
+		else if (r < 16)
+			LOG_teemetrics((int)(xorshift(&seed) % 4) - 1);
+		else if (r < 17)
+			LOG_metricsdump(devnull);
+		else if (xorshift(&seed) % 2)
+			LOG_profile(xorshift(&seed) % 2);
+		else
+			LOG_profilesnapshot(sites, 4);
+		usleep(xorshift(&seed) % 200);
+	}
+	return NULL;
+}
+
+// Checks one line (without its newline), returns 1 for a logger line
+static int verifyline(const char *path, char *line, int *last) {
+	char *p = line;
+	if (strncmp(p, "[cb] ", 5) == 0)
+		p += 5;
+	if (p[0] == '(' && p[3] == ')' && p[4] == ':' && p[5] == ' ')
+		p += 6;
+	if (strncmp(p, "_LOG_tee: ", 10) == 0) // the library's own warnings
+		return 0;
+	if (strncmp(p, "  #", 3) == 0) { // backtrace frame
+		char *end;
+		strtoul(p + 3, &end, 10);
+		if (end == p + 3 || *end != ' ')
+			FAIL("%s: bad frame line '%s'\n", path, line);
+		return 0;
+	}
+	int id, seq, off = 0;
+	char *bar = strrchr(p, '|');
+	if (sscanf(p, "T%d #%d %n", &id, &seq, &off) != 2 || off == 0 || bar == NULL
+			|| id < 0 || id >= NLOGGERS || bar[-1] != ' ')
+		FAIL("%s: malformed line '%s'\n", path, line);
+	if (strtoul(bar + 1, NULL, 16) != fnv1a(p, bar - 1 - p) || strlen(bar + 1) != 8)
+		FAIL("%s: checksum mismatch '%s'\n", path, line);
+	if (seq < last[id]) // equal when a path is teed more than once
+		FAIL("%s: thread %d out of order, #%d after #%d\n", path, id, seq, last[id]);
+	last[id] = seq;
+	return 1;
+}
+
+// Returns the number of checked lines, fails on the first corrupt one
+static long verify(const char *path, int binary) {
+	FILE *fp = fopen(path, "r");
+	if (fp == NULL)
+		return 0;
+	char line[LINE_MAX + 256];
+	int last[NLOGGERS];
+	long count = 0;
+	for (int i = 0; i < NLOGGERS; ++i)
+		last[i] = -1;
+	if (binary) {
+		struct LOG_binreader r;
+		struct LOG_binrecord rec;
+		int rc;
+		LOG_binreader_init(&r, fp);
+		while ((rc = LOG_binnext(&r, &rec)) == 1) {
+			if (rec.textlen == 0 || rec.text[rec.textlen - 1] != '\n' || rec.textlen >= sizeof line)
+				FAIL("%s: bad binary record '%s'\n", path, rec.text);
+			memcpy(line, rec.text, rec.textlen - 1);
+			line[rec.textlen - 1] = '\0';
+			count += verifyline(path, line, last);
+		}
+		if (rc != 0 || r.checks == 0 || r.verified != ftell(fp) || fgetc(fp) != EOF)
+			FAIL("%s: corrupt binary log\n", path);
+		LOG_binreader_free(&r);
+	} else while (fgets(line, sizeof line, fp) != NULL) {
+		char *nl = strchr(line, '\n');
+		if (nl == NULL)
+			FAIL("%s: unterminated line '%s'\n", path, line);
+		*nl = '\0';
+		count += verifyline(path, line, last);
+	}
+	fclose(fp);
+	return count;
+}
+
+#if defined(__linux__)
+#define NFOLLOW 20000
+
+static void *rotator(void *arg) {
+	const char *path = arg;
+	char rotated[80];
+	snprintf(rotated, sizeof rotated, "%s.1", path);
+	for (int i = 0; i < NFOLLOW; ++i) {
+		if (i == NFOLLOW / 2) {
+			rename(path, rotated);
+			LOG_reset();
+			LOG_teepath(path, 0);
+		}
+		LOGI("follow %d\n", i);
+	}
+	unlink(rotated);
+	return NULL;
+}
+
+static void follow(const char *dir) {
+	char path[64], want[32];
+	snprintf(path, sizeof path, "%s/follow.txt", dir);
+	LOG_reset();
+	LOG_teepath(path, 0);
+	struct LOG_follower f;
+	struct LOG_lineview v;
+	if (LOG_followopen(&f, path, -1) == -1)
+		FAIL("follow: %s: %s\n", path, strerror(errno));
+	pthread_t t;
+	pthread_create(&t, NULL, rotator, path);
+	for (int i = 0; i < NFOLLOW; ++i) {
+		int n = LOG_follownext(&f, &v, 5000), len = snprintf(want, sizeof want, "(II): follow %d", i);
+		if (n != 1 || v.len != (size_t)len || memcmp(v.ptr, want, len) != 0)
+			FAIL("follow: line %d: got '%.*s'\n", i, n == 1 ? (int)v.len : 0, n == 1 ? v.ptr : "");
+	}
+	pthread_join(t, NULL);
+	if (LOG_follownext(&f, &v, 0) != 0)
+		FAIL("follow: unexpected trailing line\n");
+	LOG_followclose(&f);
+	LOG_reset();
+	unlink(path);
+}
+#endif
+
+#define RINGLINES 20000
+static int ringdone;
+
+static void *ringlogger(void *arg) {
+	for (int i = 0; i < RINGLINES; ++i)
+		LOGI("R%d #%d\n", (int)(intptr_t)arg, i);
+	__atomic_add_fetch(&ringdone, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static uint64_t shmring(void) {
+	char name[64], buf[64];
+	snprintf(name, sizeof name, "/logtee-stress-%d", getpid());
+	LOG_reset();
+	LOG_teeshm(name, 0, 16384);
+	struct LOG_ringreader r;
+	struct LOG_ringline l;
+	if (LOG_shmattach(&r, name, 1) == -1)
+		FAIL("ring: %s: %s\n", name, strerror(errno));
+	pthread_t t[NLOGGERS];
+	for (int i = 0; i < NLOGGERS; ++i)
+		pthread_create(t + i, NULL, ringlogger, (void *)(intptr_t)i);
+
+	// read until a pass comes up empty after every logger finished
+	int last[NLOGGERS], finished = 0, rc;
+	uint64_t first = 0, next = 0, got = 0, lost = 0;
+	for (int i = 0; i < NLOGGERS; ++i)
+		last[i] = -1;
+	while ((rc = LOG_ringnext(&r, buf, sizeof buf, &l)) != -1) {
+		if (rc == 0) {
+			if (finished)
+				break;
+			finished = __atomic_load_n(&ringdone, __ATOMIC_ACQUIRE) == NLOGGERS;
+			continue;
+		}
+		int th, n;
+		if ((got > 0 && l.seq != next + l.lost) || sscanf(buf, "(II): R%d #%d", &th, &n) != 2
+				|| th < 0 || th >= NLOGGERS || n <= last[th] || l.len != strlen(buf))
+			FAIL("ring: bad line %" PRIu64 " '%s' (lost %" PRIu64 ")\n", l.seq, buf, l.lost);
+		if (got++ == 0)
+			first = l.seq;
+		last[th] = n;
+		next = l.seq + 1, lost += l.lost;
+	}
+	if (rc == -1)
+		FAIL("ring: corrupt\n");
+	for (int i = 0; i < NLOGGERS; ++i)
+		pthread_join(t[i], NULL);
+	if (first + got + lost != (uint64_t)NLOGGERS * RINGLINES)
+		FAIL("ring: %" PRIu64 " lines read and %" PRIu64 " lost, want %d\n", got, first + lost, NLOGGERS * RINGLINES);
+	LOG_ringdetach(&r);
+	LOG_reset();
+	return got;
+}
+
+// Reads a circular file back: consecutive "C #n" lines ending at `last'
+static int circularcheck(const char *path, int last) {
+	struct LOG_ringreader r;
+	struct LOG_ringline l;
+	char buf[64];
+	int n = -1, first = -1, rc;
+	uint64_t off = 0;
+	if (LOG_circularattach(&r, path, 1) == -1)
+		FAIL("circular: %s: %s\n", path, strerror(errno));
+	while ((rc = LOG_ringnext(&r, buf, sizeof buf, &l)) == 1) {
+		int k;
+		if (sscanf(buf, "(II): C #%d", &k) != 1 || (n >= 0 && (k != n + 1 || l.seq != off + k)) || l.lost != 0)
+			FAIL("circular: line %" PRIu64 " '%s' after #%d\n", l.seq, buf, n);
+		if (first < 0)
+			first = k, off = l.seq - k;
+		n = k;
+	}
+	LOG_ringdetach(&r);
+	if (rc == -1 || n != last || first <= 0)
+		FAIL("circular: read #%d to #%d, want up to #%d after a wrap\n", first, n, last);
+	return n - first + 1;
+}
+
+static int circular(const char *dir) {
+	char path[64];
+	snprintf(path, sizeof path, "%s/circular.ring", dir);
+	LOG_reset();
+	LOG_teecircular(path, -1, 4096);
+	LOG_teecircular(path, -1, 4096); // refused with a warning line, one writer per file
+	for (int i = 0; i < 1000; ++i)
+		LOGI("C #%d\n", i);
+	LOG_reset();
+	circularcheck(path, 999);
+
+	// a restart carries on where the ring left off
+	LOG_teecircular(path, -1, 4096);
+	for (int i = 1000; i < 1010; ++i)
+		LOGI("C #%d\n", i);
+	LOG_reset();
+	int n = circularcheck(path, 1009);
+	unlink(path);
+	return n;
+}
+
+/*
+ * Async lanes
+ */
+
+#define NASYNC     4
+#define ASYNCLINES 20000
+static int asyncgate;
+
+// Holds the writer on its first line until the lanes are loaded
+static const char *asyncblock() {
+	static int first = 1;
+	if (first)
+		while (!__atomic_load_n(&asyncgate, __ATOMIC_ACQUIRE))
+			usleep(100);
+	first = 0;
+	return "";
+}
+
+static void *asynclogger(void *arg) {
+	for (int i = 0; i < ASYNCLINES; ++i)
+		LOGD("A%d #%d\n", (int)(intptr_t)arg, i);
+	return NULL;
+}
+
+static uint64_t async(const char *dir) {
+	char path[64], buf[256];
+	snprintf(path, sizeof path, "%s/async.txt", dir);
+	LOG_reset();
+	LOG_teepath(path, -1);
+	LOG_profile(0); // new threads would register their sites under the mutex the writer holds
+	LOG_prefixcallback(asyncblock);
+	struct LOG_stats st0, st;
+	LOG_stats(&st0);
+	if (LOG_async(1) == -1)
+		FAIL("async: %s\n", strerror(errno));
+	LOGI("A first\n");
+	pthread_t t[NASYNC];
+	for (int i = 0; i < NASYNC; ++i)
+		pthread_create(t + i, NULL, asynclogger, (void *)(intptr_t)i);
+	for (int i = 0; i < NASYNC; ++i)
+		pthread_join(t[i], NULL);
+	if (LOG_try(-1, "A full\n") != LOG_DROPPED)
+		FAIL("async: LOG_try() on a full lane did not drop\n");
+	LOGE("A error\n");
+	__atomic_store_n(&asyncgate, 1, __ATOMIC_RELEASE);
+	LOG_async(0);
+	LOG_stats(&st);
+	LOG_reset();
+
+	FILE *fp = fopen(path, "r");
+	if (fp == NULL)
+		FAIL("async: %s: %s\n", path, strerror(errno));
+	int last[NASYNC], n = 0, th, k;
+	for (int i = 0; i < NASYNC; ++i)
+		last[i] = -1;
+	uint64_t got = 0;
+	while (fgets(buf, sizeof buf, fp) != NULL) {
+		if (n == 0 ? strcmp(buf, "(II): A first\n") != 0 : n == 1 ? strcmp(buf, "(EE): A error\n") != 0
+				: sscanf(buf, "(DD): A%d #%d", &th, &k) != 2 || th < 0 || th >= NASYNC || k <= last[th])
+			FAIL("async: bad line %d '%s'\n", n + 1, buf);
+		if (n++ >= 2)
+			last[th] = k, ++got;
+	}
+	fclose(fp);
+	unlink(path);
+	uint64_t dropped = st.qdropped[LOGTEE_LANES - 1] - st0.qdropped[LOGTEE_LANES - 1] - 1;
+	if (dropped == 0 || got + dropped != (uint64_t)NASYNC * ASYNCLINES || st.qdropped[0] != st0.qdropped[0])
+		FAIL("async: %" PRIu64 " Debug lines written and %" PRIu64 " dropped, want %d\n",
+				got, dropped, NASYNC * ASYNCLINES);
+	return got;
+}
+
+static int copygate;
+
+static const char *copyblock() {
+	while (!__atomic_load_n(&copygate, __ATOMIC_ACQUIRE))
+		usleep(100);
+	return "";
+}
+
+// A queued line outlives the format and file it was logged with
+static void asynccopy(const char *dir) {
+	char path[64];
+	snprintf(path, sizeof path, "%s/asynccopy.bin", dir);
+	LOG_reset();
+	LOG_teebinarypath(path, 0);
+	LOG_prefixcallback(copyblock);
+	if (LOG_async(1 << 16) == -1)
+		FAIL("async: %s\n", strerror(errno));
+	char *fmt = strdup("Q heap format %d\n"), *file = strdup("heap.c");
+	LOG_at(file, 7, 0, fmt, 1);
+	LOG_at(file, 8, 0, fmt, 2); // the writer holds the first one
+	memset(fmt, 'x', strlen(fmt));
+	memset(file, 'x', strlen(file));
+	free(fmt);
+	free(file);
+	__atomic_store_n(&copygate, 1, __ATOMIC_RELEASE);
+	LOG_async(0);
+	LOG_reset();
+
+	FILE *fp = fopen(path, "rb");
+	if (fp == NULL)
+		FAIL("async: %s: %s\n", path, strerror(errno));
+	struct LOG_binreader r;
+	struct LOG_binrecord rec;
+	LOG_binreader_init(&r, fp);
+	for (int i = 1; i <= 2; ++i)
+		if (LOG_binnext(&r, &rec) != 1 || rec.fmt == NULL || strcmp(rec.fmt, "Q heap format %d\n") != 0
+				|| rec.file == NULL || strcmp(rec.file, "heap.c") != 0 || rec.line != 6 + i)
+			FAIL("async: queued line %d lost its format or file\n", i);
+	LOG_binreader_free(&r);
+	fclose(fp);
+	unlink(path);
+}
+
+static int ordergate;
+
+static const char *orderblock() {
+	while (!__atomic_load_n(&ordergate, __ATOMIC_ACQUIRE))
+		usleep(100);
+	return "";
+}
+
+static void *orderopen(void *arg) {
+	(void)arg;
+	usleep(100000); // the caller overflowing the Error lane waits till then
+	__atomic_store_n(&ordergate, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+// Errors the caller writes itself on a full lane stay behind the queued ones
+static int asyncorder(const char *dir) {
+	char path[64], buf[64], want[64];
+	snprintf(path, sizeof path, "%s/asyncorder.txt", dir);
+	LOG_reset();
+	LOG_teepath(path, 0);
+	LOG_prefixcallback(orderblock);
+	struct LOG_stats st0, st;
+	LOG_stats(&st0);
+	if (LOG_async(1) == -1)
+		FAIL("async: %s\n", strerror(errno));
+	int n = 0;
+	while (LOG_try(2, "O #%d\n", n) == LOG_ACCEPTED) // till the lane is full
+		++n;
+	pthread_t t;
+	pthread_create(&t, NULL, orderopen, NULL);
+	for (int i = n; i < n + 100; ++i)
+		LOGE("O #%d\n", i);
+	pthread_join(t, NULL);
+	LOG_async(0);
+	LOG_stats(&st);
+	LOG_reset();
+
+	FILE *fp = fopen(path, "r");
+	if (fp == NULL)
+		FAIL("async: %s: %s\n", path, strerror(errno));
+	int i = 0;
+	for (; fgets(buf, sizeof buf, fp) != NULL; ++i) {
+		snprintf(want, sizeof want, "(EE): O #%d\n", i);
+		if (strcmp(buf, want) != 0)
+			FAIL("async: line %d is '%s', not '%s'\n", i + 1, buf, want);
+	}
+	fclose(fp);
+	unlink(path);
+	if (n < 2 || i != n + 100 || st.qdropped[0] != st0.qdropped[0] + 1)
+		FAIL("async: %d of %d Errors in order, %" PRIu64 " tried ones dropped\n",
+				i, n + 100, st.qdropped[0] - st0.qdropped[0]);
+	return n;
+}
+
+/*
+ * LOG_try()
+ */
+
+static int trygate, tryheld;
+
+// Holds the Tee mutex in the thread logging until the gate opens
+static const char *tryblock() {
+	__atomic_store_n(&tryheld, 1, __ATOMIC_RELEASE);
+	while (!__atomic_load_n(&trygate, __ATOMIC_ACQUIRE))
+		usleep(100);
+	return "";
+}
+
+static void *trylogger(void *arg) {
+	(void)arg;
+	LOGI("T held\n");
+	return NULL;
+}
+
+static void trylog(const char *dir) {
+	char path[64], buf[LINE_MAX + 16];
+	snprintf(path, sizeof path, "%s/try.txt", dir);
+	LOG_reset();
+	LOG_teepath(path, 0);
+	LOG_prefixcallback(tryblock);
+	pthread_t t;
+	pthread_create(&t, NULL, trylogger, NULL);
+	while (!__atomic_load_n(&tryheld, __ATOMIC_ACQUIRE))
+		usleep(100);
+	enum LOG_status busy = LOG_try(0, "T busy\n"), filtered = LOG_try(-1, "T filtered\n");
+	__atomic_store_n(&trygate, 1, __ATOMIC_RELEASE);
+	pthread_join(t, NULL);
+	if (busy != LOG_DROPPED || filtered != LOG_FILTERED)
+		FAIL("try: status %d while the Tee was held, %d below its level\n", busy, filtered);
+	memset(buf, 'x', LINE_MAX);
+	buf[LINE_MAX] = '\0';
+	enum LOG_status ok = LOG_tryat(__FILE__, __LINE__, 1, "T ok\n"), cut = LOG_try(0, "%s\n", buf);
+	if (ok != LOG_ACCEPTED || cut != LOG_TRUNCATED)
+		FAIL("try: status %d for a line, %d for a long one\n", ok, cut);
+	LOG_reset();
+
+	FILE *fp = fopen(path, "r");
+	if (fp == NULL)
+		FAIL("try: %s: %s\n", path, strerror(errno));
+	static const char *want[] = { "(II): T held\n", "(WW): T ok\n" };
+	for (size_t i = 0; i < sizeof want / sizeof *want; ++i)
+		if (fgets(buf, sizeof buf, fp) == NULL || strcmp(buf, want[i]) != 0)
+			FAIL("try: line %zu is not '%s'\n", i + 1, want[i]);
+	if (fgets(buf, sizeof buf, fp) == NULL || strlen(buf) != LINE_MAX - 1 + 6)
+		FAIL("try: the long line was not cut to LINE_MAX\n");
+	fclose(fp);
+	unlink(path);
+}
+
+/*
+ * Logging from a thread's key destructors, after logtee's own ran
+ */
+
+static pthread_key_t exitkey;
+
+static void exitlog(void *arg) {
+	LOGI("E from destructor %d\n", (int)(intptr_t)arg);
+}
+
+static void *exitlogger(void *arg) {
+	LOGI("E first\n");
+	pthread_setspecific(exitkey, arg);
+	return NULL;
+}
+
+static void threadexit(const char *dir) {
+	char path[64], buf[64];
+	snprintf(path, sizeof path, "%s/exit.txt", dir);
+	LOG_reset();
+	LOG_teepath(path, 0);
+	LOGI("E main\n"); // logtee's key is created before ours
+	pthread_key_create(&exitkey, exitlog);
+	pthread_t t;
+	pthread_create(&t, NULL, exitlogger, (void *)(intptr_t)7);
+	pthread_join(t, NULL);
+	pthread_key_delete(exitkey);
+	LOG_reset();
+
+	static const char *want[] = { "(II): E main\n", "(II): E first\n", "(II): E from destructor 7\n" };
+	FILE *fp = fopen(path, "r");
+	if (fp == NULL)
+		FAIL("exit: %s: %s\n", path, strerror(errno));
+	for (size_t i = 0; i < sizeof want / sizeof *want; ++i)
+		if (fgets(buf, sizeof buf, fp) == NULL || strcmp(buf, want[i]) != 0)
+			FAIL("exit: line %zu is not '%s'\n", i + 1, want[i]);
+	fclose(fp);
+	unlink(path);
+}
+
+/*
+ * Circuit breaker
+ */
+
+static size_t drain(int fd) {
+	char buf[4096];
+	size_t total = 0;
+	ssize_t n;
+	while ((n = read(fd, buf, sizeof buf)) > 0)
+		total += n;
+	return total;
+}
+
+static void breaker(const char *dir) {
+	char path[64], line[LINE_MAX], pad[1024];
+	int p[2];
+	snprintf(path, sizeof path, "%s/breaker.txt", dir);
+	if (pipe(p) == -1 || fcntl(p[0], F_SETFL, O_NONBLOCK) == -1 || fcntl(p[1], F_SETFL, O_NONBLOCK) == -1)
+		FAIL("breaker: pipe: %s\n", strerror(errno));
+	memset(pad, 'p', sizeof pad - 1);
+	pad[sizeof pad - 1] = '\0';
+	LOG_reset();
+	LOG_teefile(fdopen(p[1], "w"), 0); // target #0, can't seek a pipe: warns nobody
+	LOG_teepath(path, 0);
+
+	// the pipe fills up and its tee gets paused
+	for (int i = 0; i < 200; ++i)
+		LOGI("B #%d %s\n", i, pad);
+	drain(p[0]);
+	for (int i = 200; i < 210; ++i)
+		LOGI("B #%d paused\n", i);
+	if (drain(p[0]) != 0)
+		FAIL("breaker: a paused tee was written\n");
+	usleep((LOGTEE_BREAKER_BACKOFF + 20) * 1000);
+	LOGI("B #210 retry\n");
+	if (drain(p[0]) == 0)
+		FAIL("breaker: the tee was not retried\n");
+	LOGI("B #211 after\n");
+	LOG_reset();
+	close(p[0]);
+
+	FILE *fp = fopen(path, "r");
+	if (fp == NULL)
+		FAIL("breaker: %s: %s\n", path, strerror(errno));
+	int n = 0, paused = 0, recovered = 0, k;
+	while (fgets(line, sizeof line, fp) != NULL) {
+		if (strncmp(line, "(WW): logtee: target #0 failing (", 33) == 0) {
+			if (paused++ || n == 0 || n >= 200)
+				FAIL("breaker: paused after %d lines\n", n);
+		} else if (strcmp(line, "(WW): logtee: target #0 recovered\n") == 0) {
+			if (recovered++ || n != 211)
+				FAIL("breaker: recovered after %d lines\n", n);
+		} else if (sscanf(line, "(II): B #%d", &k) != 1 || k != n++) {
+			FAIL("breaker: bad line '%s'\n", line);
+		}
+	}
+	fclose(fp);
+	unlink(path);
+	if (n != 212 || !paused || !recovered)
+		FAIL("breaker: %d lines, paused %d, recovered %d\n", n, paused, recovered);
+
+	// a line no tee could take is dropped, as LOG_try() tells
+	if (pipe(p) == -1 || fcntl(p[1], F_SETFL, O_NONBLOCK) == -1)
+		FAIL("breaker: pipe: %s\n", strerror(errno));
+	LOG_reset();
+	LOG_teefile(fdopen(p[1], "w"), 0);
+	enum LOG_status st = LOG_ACCEPTED;
+	for (int i = 0; i < 200 && st == LOG_ACCEPTED; ++i)
+		st = LOG_try(0, "B #%d %s\n", i, pad);
+	LOG_reset();
+	close(p[0]);
+	if (st != LOG_DROPPED)
+		FAIL("breaker: LOG_try() on a full pipe returned %d\n", (int)st);
+}
+
+/*
+ * Memory ring
+ */
+
+#define MEMLINES 20000
+static int memdone;
+
+static int memlevel(int i) { // Debug, Info, Error
+	return i % 3 == 2 ? 2 : i % 3 - 1;
+}
+
+static void *memlogger(void *arg) {
+	(void)arg;
+	for (int i = 0; i < MEMLINES; ++i)
+		LOG_at(__FILE__, __LINE__, memlevel(i), "M #%d\n", i);
+	__atomic_store_n(&memdone, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+struct memsnap {
+	int n, last, level;
+};
+
+static void memline(void *arg, const struct LOG_ringline *line, const char *text) {
+	struct memsnap *m = arg;
+	int k;
+	if (sscanf(text, "%*s M #%d", &k) != 1 || k <= m->last || line->level < m->level || memlevel(k) != line->level)
+		FAIL("memory: bad line '%s' after #%d\n", text, m->last);
+	m->last = k, ++m->n;
+}
+
+static int memheld;
+
+static void *memheldsnap(void *arg) {
+	struct memsnap *m = arg;
+	if (LOG_memsnapshot("recent", 2, 10, memline, m) != 10)
+		FAIL("memory: snapshot with the Tee held: %s\n", strerror(errno));
+	__atomic_store_n(&memheld, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static int memring(void) {
+	LOG_reset();
+	LOG_teememory("recent", -1, 4096);
+	LOG_teememory("recent", -1, 4096); // refused with a warning line, names are unique
+	struct LOG_ringreader r;
+	if (LOG_memsnapshot("nonesuch", 0, 0, memline, NULL) != -1 || LOG_memattach(&r, "recent", 1) == -1)
+		FAIL("memory: attach: %s\n", strerror(errno));
+	pthread_t t;
+	pthread_create(&t, NULL, memlogger, NULL);
+	int snaps = 0;
+	do { // snapshots race the logger
+		struct memsnap m = { 0, -1, 2 };
+		if (LOG_memsnapshot("recent", 2, 10, memline, &m) == -1 || m.n > 10)
+			FAIL("memory: snapshot of %d lines\n", m.n);
+		++snaps;
+	} while (!__atomic_load_n(&memdone, __ATOMIC_ACQUIRE));
+	pthread_join(t, NULL);
+
+	struct memsnap m = { 0, -1, 2 };
+	if (LOG_memsnapshot("recent", 2, 10, memline, &m) != 10 || m.last != MEMLINES - 3)
+		FAIL("memory: last snapshot ends at #%d\n", m.last);
+
+	// nor does a snapshot wait for whoever holds the Tee
+	m = (struct memsnap){ 0, -1, 2 };
+	pthread_mutex_lock(&_LOG_mtx);
+	pthread_create(&t, NULL, memheldsnap, &m);
+	for (int i = 0; i < 5000 && !__atomic_load_n(&memheld, __ATOMIC_ACQUIRE); ++i)
+		usleep(1000);
+	int held = __atomic_load_n(&memheld, __ATOMIC_ACQUIRE);
+	pthread_mutex_unlock(&_LOG_mtx); // exit() needs it
+	if (!held)
+		FAIL("memory: snapshot waited for the Tee\n");
+	pthread_join(t, NULL);
+	LOG_reset();
+
+	// the reader outlives the tee
+	char buf[64];
+	struct LOG_ringline l;
+	int n = 0, rc;
+	while ((rc = LOG_ringnext(&r, buf, sizeof buf, &l)) == 1)
+		++n;
+	LOG_ringdetach(&r);
+	if (rc == -1 || n == 0 || strcmp(buf, "(II): M #19999\n") != 0)
+		FAIL("memory: reader got %d lines, last '%s'\n", n, buf);
+	return snaps;
+}
+
+/*
+ * Check records
+ */
+
+// Reads a binary log: lines, and the offset the checks vouch for
+static int crcread(const char *path, long *verified) {
+	FILE *fp = fopen(path, "rb");
+	if (fp == NULL)
+		FAIL("crc: %s: %s\n", path, strerror(errno));
+	struct LOG_binreader r;
+	struct LOG_binrecord rec;
+	int n = 0, rc;
+	LOG_binreader_init(&r, fp);
+	while ((rc = LOG_binnext(&r, &rec)) == 1)
+		++n;
+	*verified = rc == -1 ? -r.verified : r.verified;
+	LOG_binreader_free(&r);
+	fclose(fp);
+	return n;
+}
+
+static void crc(unsigned seed, const char *dir) {
+	unsigned char buf[1000];
+	for (size_t i = 0; i < sizeof buf; ++i)
+		buf[i] = xorshift(&seed);
+	for (size_t off = 0; off < 16; ++off) // hardware and table agree at any alignment
+		if (_LOG_crc32c(0, buf + off, sizeof buf - off) != _LOG_crc32csw(0, buf + off, sizeof buf - off))
+			FAIL("crc: hardware and table differ at +%zu\n", off);
+	if (_LOG_crc32c(0, "123456789", 9) != 0xe3069283u || _LOG_crc32c(_LOG_crc32c(0, "1234", 4), "56789", 5) != 0xe3069283u)
+		FAIL("crc: wrong CRC32C\n");
+
+	char path[64];
+	snprintf(path, sizeof path, "%s/crc.bin", dir);
+	LOG_reset();
+	LOG_teebinarypath(path, 0);
+	for (int i = 0; i < 100; ++i)
+		LOGI("C #%d %s\n", i, "payload");
+	LOG_reset();
+	long size, verified;
+	if (crcread(path, &verified) != 100 || (size = verified) <= 0)
+		FAIL("crc: clean log does not verify\n");
+
+	// a flipped byte fails the next check
+	FILE *fp = fopen(path, "r+b");
+	fseek(fp, size / 2, SEEK_SET);
+	int c = fgetc(fp);
+	fseek(fp, size / 2, SEEK_SET);
+	fputc(c ^ 0x20, fp);
+	fclose(fp);
+	int n = crcread(path, &verified);
+	if (verified >= 0 || -verified > size / 2 || -verified < size / 2 - 128 || n > 60)
+		FAIL("crc: flip at %ld verified up to %ld\n", size / 2, -verified);
+
+	// cut there, then tear the last check: its line is read but not vouched for
+	if (truncate(path, -verified) == -1)
+		FAIL("crc: truncate: %s\n", strerror(errno));
+	int good = crcread(path, &verified);
+	long cut = verified - 3;
+	if (truncate(path, cut) == -1 || crcread(path, &verified) != good || verified <= 0 || verified >= cut)
+		FAIL("crc: torn tail verified up to %ld\n", verified);
+	unlink(path);
+}
+
+/*
+ * LOG_batch()
+ */
+
+#define NBATCH 600              // over LOGTEE_BATCH, so it takes chunks
+
+static int batchdone;
+
+static void *batchlogger(void *arg) {
+	(void)arg;
+	for (int i = 0; !__atomic_load_n(&batchdone, __ATOMIC_RELAXED); ++i)
+		LOGW("X #%d\n", i);
+	return NULL;
+}
+
+static int batchlevel(int i) { // Debug, Info, Warning, Error
+	return i % 4 - 1;
+}
+
+// Checks that the lines of batch `tag' follow one another from where fp is
+static void batchcheck(FILE *fp, const char *path, char tag, int minlevel, int binary, struct LOG_binreader *r) {
+	static const char *prefixes[] = { "(II): ", "(WW): ", "(EE): " };
+	char buf[64], want[64];
+	struct LOG_binrecord rec;
+	int chunk = -1, taken = -1; // chunks count the lines that passed the gate (Info and up)
+	for (int i = 0; i < NBATCH; ++i) {
+		taken += batchlevel(i) >= 0;
+		if (batchlevel(i) < minlevel)
+			continue;
+		snprintf(want, sizeof want, "%s%c #%d\n", prefixes[batchlevel(i)], tag, i);
+		for (;;) { // other lines only between chunks
+			if (binary ? LOG_binnext(r, &rec) != 1 || rec.textlen >= sizeof buf
+					: fgets(buf, sizeof buf, fp) == NULL)
+				FAIL("batch: %s: line %c #%d missing\n", path, tag, i);
+			if (binary)
+				memcpy(buf, rec.text, rec.textlen), buf[rec.textlen] = '\0';
+			if (strstr(buf, "X #") == NULL)
+				break;
+			if (taken / LOGTEE_BATCH == chunk)
+				FAIL("batch: %s: '%s' inside a batch before %c #%d\n", path, buf, tag, i);
+		}
+		if (strcmp(buf, want) != 0 || (binary && (rec.level != batchlevel(i) || rec.file != NULL
+						|| rec.prefix == NULL || strcmp(rec.prefix, prefixes[batchlevel(i)]) != 0)))
+			FAIL("batch: %s: got '%s', want '%s'\n", path, buf, want);
+		chunk = taken / LOGTEE_BATCH;
+	}
+}
+
+static void batch(const char *dir) {
+	char path[64], binpath[64], msgs[NBATCH][16];
+	struct LOG_entry e[NBATCH];
+	snprintf(path, sizeof path, "%s/batch.txt", dir);
+	snprintf(binpath, sizeof binpath, "%s/batch.bin", dir);
+	LOG_reset();
+	LOG_teepath(path, 0);
+	LOG_teebinarypath(binpath, 1);
+	pthread_t t;
+	pthread_create(&t, NULL, batchlogger, NULL);
+	const char tags[] = "SQ";
+	for (int k = 0; tags[k] != '\0'; ++k) {
+		if (k == 1 && LOG_async(1 << 20) == -1)
+			FAIL("batch: %s\n", strerror(errno));
+		for (int i = 0; i < NBATCH; ++i) {
+			snprintf(msgs[i], sizeof msgs[i], "%c #%d\n", tags[k], i);
+			e[i] = (struct LOG_entry){ batchlevel(i), msgs[i] };
+		}
+		size_t n = LOG_batch(e, NBATCH);
+		if (n != NBATCH / 4 * 3)
+			FAIL("batch: %zu of %d lines taken, want %d\n", n, NBATCH, NBATCH / 4 * 3);
+	}
+	LOG_async(0);
+	__atomic_store_n(&batchdone, 1, __ATOMIC_RELAXED);
+	pthread_join(t, NULL);
+	LOG_reset();
+
+	FILE *fp = fopen(path, "r"), *bfp = fopen(binpath, "rb");
+	if (fp == NULL || bfp == NULL)
+		FAIL("batch: %s\n", strerror(errno));
+	struct LOG_binreader r;
+	LOG_binreader_init(&r, bfp);
+	for (int k = 0; tags[k] != '\0'; ++k) {
+		batchcheck(fp, path, tags[k], 0, 0, NULL);
+		batchcheck(bfp, binpath, tags[k], 1, 1, &r);
+	}
+	LOG_binreader_free(&r);
+	fclose(fp);
+	fclose(bfp);
+	unlink(path);
+	unlink(binpath);
+}
+
+static int batchchunks;
+
+static const char *batchprefix(void) { // once per chunk and tee
+	++batchchunks;
+	return "";
+}
+
+// Chunks of LOG_batch() halve as the usage crosses each budget threshold
+static void batchbudget(const char *dir) {
+	char path[64];
+	struct LOG_entry e[NBATCH];
+	struct LOG_stats st;
+	snprintf(path, sizeof path, "%s/batchbudget.txt", dir);
+	LOG_reset();
+	LOG_teepath(path, 0);
+	LOG_prefixcallback(batchprefix);
+	for (int i = 0; i < NBATCH; ++i)
+		e[i] = (struct LOG_entry){ 0, "B\n" };
+	LOGI("B first\n"); // allocates what the thread needs
+	LOG_stats(&st);
+	const int percent[] = { 0, 60, 80 }; // under all thresholds, over LOGTEE_BUDGET_BATCH, over Debug's
+	for (int i = 0; i < 3; ++i) {
+		size_t max = LOGTEE_BATCH >> i, want = (NBATCH + max - 1) / max;
+		LOG_budget(percent[i] ? st.memused * 100 / percent[i] : 0);
+		batchchunks = 0;
+		if (LOG_batch(e, NBATCH) != NBATCH || batchchunks != (int)want)
+			FAIL("batch: %d%% of the budget: %d chunks, want %zu\n", percent[i], batchchunks, want);
+	}
+	LOG_budget(0);
+	LOG_reset();
+	unlink(path);
+}
+
+/*
+ * Argument-free literals
+ */
+
+static void literal(const char *dir) {
+	char array[32] = "L array\n", path[64], binpath[64], buf[64];
+	char bufs[2][9] = { "L first\n", "L other\n" }; // exactly sized, but not literals
+	int i = 0;
+	if (!_LOG_ISLIT("L plain\n") || _LOG_ISLIT("L 100%%\n") || _LOG_ISLIT("L %s\n", "x") || _LOG_ISLIT(array)
+			|| _LOG_ISLIT(bufs[i++]) || i != 0)
+		FAIL("literal: wrong fast path choice\n");
+	snprintf(path, sizeof path, "%s/literal.txt", dir);
+	snprintf(binpath, sizeof binpath, "%s/literal.bin", dir);
+	LOG_reset();
+	LOG_teepath(path, 0);
+	LOG_teebinarypath(binpath, 0);
+	LOGI("L plain\n");
+	LOGW("L 100%%\n");
+	LOGE(array, 0);
+	LOGI("L %s\n", "arg");
+	LOGI(bufs[i++]);
+	LOGI(bufs[i++]);
+	LOG_reset();
+	if (i != 2)
+		FAIL("literal: array index stepped %d times for 2 lines\n", i);
+
+	static const char *want[] = { "(II): L plain\n", "(WW): L 100%\n", "(EE): L array\n", "(II): L arg\n",
+		"(II): L first\n", "(II): L other\n" };
+	FILE *fp = fopen(path, "r"), *bfp = fopen(binpath, "rb");
+	if (fp == NULL || bfp == NULL)
+		FAIL("literal: %s\n", strerror(errno));
+	struct LOG_binreader r;
+	struct LOG_binrecord rec;
+	LOG_binreader_init(&r, bfp);
+	for (size_t i = 0; i < sizeof want / sizeof *want; ++i) {
+		if (fgets(buf, sizeof buf, fp) == NULL || strcmp(buf, want[i]) != 0)
+			FAIL("literal: %s: line %zu is not '%s'\n", path, i + 1, want[i]);
+		if (LOG_binnext(&r, &rec) != 1 || rec.textlen != strlen(want[i])
+				|| memcmp(rec.text, want[i], rec.textlen) != 0 || rec.fmt == NULL)
+			FAIL("literal: %s: record %zu is not '%s'\n", binpath, i + 1, want[i]);
+		if (i == 0 && (rec.nargs != 0 || strcmp(rec.fmt, "L plain\n") != 0 || rec.line == 0))
+			FAIL("literal: %s: '%s' not stored as its format\n", binpath, rec.fmt);
+	}
+	LOG_binreader_free(&r);
+	fclose(fp);
+	fclose(bfp);
+	unlink(path);
+	unlink(binpath);
+}
+
+/*
+ * Compile-time builtin prefixes
+ */
+
+// The level table entry of level, looked up by LOG() but not by the macros
+static const char **tableprefix(int level) {
+	for (size_t i = 0; i < _numlevels; ++i)
+		if (_loglevels[i].level == level)
+			return &_loglevels[i].prefix;
+	FAIL("prefix: no level %d\n", level);
+}
+
+static void prefixes(const char *dir) {
+	char path[64], buf[64];
+	snprintf(path, sizeof path, "%s/prefix.txt", dir);
+	LOG_reset();
+	LOG_teepath(path, 0);
+	LOGI("P builtin\n");
+
+	// swap the table's Info prefix behind LOG_addlevel()'s back: only a
+	// lookup can find it
+	pthread_mutex_lock(&_LOG_mtx);
+	const char **info = tableprefix(0), *saved = *info;
+	*info = "<looked up> ";
+	pthread_mutex_unlock(&_LOG_mtx);
+	LOGI("P %s\n", "macro");
+	LOGI("P macro literal\n");
+	LOG(0, "P plain LOG\n");
+	pthread_mutex_lock(&_LOG_mtx);
+	*info = saved;
+	pthread_mutex_unlock(&_LOG_mtx);
+
+	LOG_addlevel(0, "[info] "); // a real override reaches the macros
+	LOGI("P %s\n", "override");
+	LOGI("P override literal\n");
+	LOGW("P other level\n");
+	LOG_reset(); // back to the builtins
+	LOG_teepath(path, 0);
+	LOGI("P reset\n");
+	LOG_reset();
+
+	static const char *want[] = { "(II): P builtin\n", "(II): P macro\n", "(II): P macro literal\n",
+		"<looked up> P plain LOG\n", "[info] P override\n", "[info] P override literal\n",
+		"(WW): P other level\n", "(II): P reset\n" };
+	FILE *fp = fopen(path, "r");
+	if (fp == NULL)
+		FAIL("prefix: %s: %s\n", path, strerror(errno));
+	for (size_t i = 0; i < sizeof want / sizeof *want; ++i)
+		if (fgets(buf, sizeof buf, fp) == NULL || strcmp(buf, want[i]) != 0)
+			FAIL("prefix: line %zu is not '%s'\n", i + 1, want[i]);
+	fclose(fp);
+	unlink(path);
+}
+
+/*
+ * Call site profile
+ */
+
+#define NPROFILED 10
+
+static int profiledfirst, profiledlast;
+
+// Info and up reach the tee, Debug stops at the gate
+static size_t profiled(void) {
+	char buf[32];
+	size_t bytes = 0;
+	profiledfirst = __LINE__;
+	for (int i = 0; i < NPROFILED; ++i) {
+		LOGD("P debug %d\n", i);
+		LOGI("P info %d\n", i);
+		bytes += snprintf(buf, sizeof buf, "(II): P info %d\n", i);
+		if (i % 2) {
+			LOGW("P warn %d\n", i);
+			bytes += snprintf(buf, sizeof buf, "(WW): P warn %d\n", i);
+		}
+	}
+	profiledlast = __LINE__;
+	return bytes;
+}
+
+static void profile(const char *dir) {
+	char path[64];
+	snprintf(path, sizeof path, "%s/profile.txt", dir);
+	LOG_reset();
+	LOG_teepath(path, 0);
+	LOG_profile(1);
+	size_t want = profiled();
+	LOG_profile(0);
+	LOG_reset();
+
+	static struct LOG_site sites[LOGTEE_PROFILE_SITES + 1];
+	size_t n = LOG_profilesnapshot(sites, sizeof sites / sizeof *sites), found = 0, bytes = 0;
+	for (size_t i = 0; i < n; ++i) {
+		const struct LOG_site *s = sites + i;
+		if (strcmp(s->file, __FILE__) != 0 || s->line <= profiledfirst || s->line >= profiledlast)
+			continue;
+		unsigned long long calls = s->level == 1 ? NPROFILED / 2 : NPROFILED;
+		if (s->level < -1 || s->level > 1 || s->calls != calls || s->accepted != (s->level >= 0 ? calls : 0)
+				|| (s->accepted == 0) != (s->bytes == 0))
+			FAIL("profile: level %d site: %llu calls, %llu accepted, %llu bytes\n",
+					s->level, s->calls, s->accepted, s->bytes);
+		bytes += s->bytes;
+		++found;
+	}
+	struct stat st;
+	if (found != 3 || bytes != want || stat(path, &st) == -1 || (size_t)st.st_size != want)
+		FAIL("profile: %zu sites, %zu bytes profiled of %zu logged\n", found, bytes, want);
+	unlink(path);
+
+	// one file:line logged with two copies of its name is one site
+	static char twin[2][8] = { "twin.c", "twin.c" };
+	LOG_profile(1);
+	for (int i = 0; i < 2 * NPROFILED; ++i)
+		LOG_at(twin[i % 2], 9, -1, "twin %d\n", i);
+	LOG_profile(0);
+	n = LOG_profilesnapshot(sites, sizeof sites / sizeof *sites), found = 0;
+	for (size_t i = 0; i < n; ++i)
+		if (strcmp(sites[i].file, "twin.c") == 0 && (++found, sites[i].calls != 2 * NPROFILED))
+			FAIL("profile: twin.c:9 %llu calls of %d\n", sites[i].calls, 2 * NPROFILED);
+	if (found != 1)
+		FAIL("profile: %zu sites for twin.c:9\n", found);
+}
+
+/*
+ * Metrics counted by concurrent loggers
+ */
+
+#define NMETRICS  4
+#define METRICLINES 5000
+
+static void *metricslogger(void *arg) {
+	char *file = arg; // a copy of its own, freed once the thread is joined
+	for (int i = 1; i <= METRICLINES; ++i)
+		LOG_at(file, 7, 0, "M %d\n", i);
+	return NULL;
+}
+
+// Threads log the same file:line through their own copies of the name: one
+// series with every line, and the field's exact count, sum, min and max
+static void metricsites(void) {
+	char *files[NMETRICS], line[256];
+	pthread_t t[NMETRICS];
+	LOG_reset();
+	LOG_teemetrics(0);
+	LOG_metricsfield("m", "M %d\n", 1);
+	for (int i = 0; i < NMETRICS; ++i) {
+		if ((files[i] = strdup("metrics.c")) == NULL)
+			FAIL("metrics: strdup: %s\n", strerror(errno));
+		pthread_create(t + i, NULL, metricslogger, files[i]);
+	}
+	for (int i = 0; i < NMETRICS; ++i) {
+		pthread_join(t[i], NULL);
+		free(files[i]);
+	}
+	LOG_reset();
+
+	FILE *fp = tmpfile();
+	if (fp == NULL)
+		FAIL("metrics: tmpfile: %s\n", strerror(errno));
+	LOG_metricsdump(fp);
+	rewind(fp);
+	static const char *stat[] = { "count", "sum", "min", "max" };
+	const double want[] = { NMETRICS * METRICLINES, NMETRICS * (METRICLINES * (METRICLINES + 1.0) / 2),
+		1, METRICLINES };
+	int series = 0, stats = 0;
+	unsigned long long lines = 0;
+	while (fgets(line, sizeof line, fp) != NULL) {
+		char fmt[64];
+		double v;
+		if (sscanf(line, "logtee_site_lines_total{file=\"metrics.c\",line=\"7\",level=\"0\"} %llu", &lines) == 1)
+			++series;
+		for (int k = 0; k < 4; ++k) {
+			snprintf(fmt, sizeof fmt, "logtee_field_%s{field=\"m\"} %%lf", stat[k]);
+			if (sscanf(line, fmt, &v) == 1 && (++stats, v != want[k]))
+				FAIL("metrics: field %s %.17g, not %.17g\n", stat[k], v, want[k]);
+		}
+	}
+	fclose(fp);
+	if (series != 1 || lines != NMETRICS * METRICLINES || stats != 4)
+		FAIL("metrics: %d series of metrics.c:7, %llu lines of %d, %d field stats\n",
+				series, lines, NMETRICS * METRICLINES, stats);
+}
+
+/*
+ * Columnar round trip
+ */
+
+#define NCOLUMNS  70000   // past one row group
+#define COLBURSTS 5
+#define COLSECS   64
+
+// Binary log through `logtool columns' and `logtool count': the Errors per
+// second are those of the binary log, and count reads no other chunks
+static int columns(const char *dir) {
+	char bin[64], col[80], cmd[320], line[128], want[32];
+	snprintf(bin, sizeof bin, "%s/columns.bin", dir);
+	snprintf(col, sizeof col, "%s/columns.ltc", dir);
+	LOG_reset();
+	LOG_teebinarypath(bin, -1);
+	for (int b = 0; b < COLBURSTS; ++b) {
+		for (int i = 0; i < NCOLUMNS / COLBURSTS; ++i)
+			LOG_at(__FILE__, __LINE__, i % 11 == 0 ? 3 : i % 7 == 0 ? 2 : i % 2 - 1, "C %d of burst %d\n", i, b);
+		usleep(400000); // the bursts span seconds
+	}
+	LOG_reset();
+
+	// Errors and worse per second, as logtool buckets them
+	uint64_t secs[COLSECS], counts[COLSECS];
+	size_t nsecs = 0, rows = 0;
+	FILE *fp = fopen(bin, "rb");
+	if (fp == NULL)
+		FAIL("columns: %s: %s\n", bin, strerror(errno));
+	struct LOG_binreader r;
+	struct LOG_binrecord rec;
+	LOG_binreader_init(&r, fp);
+	while (LOG_binnext(&r, &rec) == 1) {
+		++rows;
+		if (rec.level < 2)
+			continue;
+		size_t s = 0;
+		while (s < nsecs && secs[s] != rec.ts / 1000000000u)
+			++s;
+		if (s == nsecs) {
+			if (nsecs == COLSECS)
+				FAIL("columns: Errors over more than %d seconds\n", COLSECS);
+			secs[nsecs] = rec.ts / 1000000000u, counts[nsecs++] = 0;
+		}
+		++counts[s];
+	}
+	LOG_binreader_free(&r);
+	fclose(fp);
+	if (rows != NCOLUMNS || nsecs < 2)
+		FAIL("columns: %zu lines over %zu seconds logged\n", rows, nsecs);
+
+	snprintf(cmd, sizeof cmd, "./logtool columns -o %s %s && ./logtool count -i 1 %s 2>&1", col, bin, col);
+	if ((fp = popen(cmd, "r")) == NULL)
+		FAIL("columns: %s: %s\n", cmd, strerror(errno));
+	unsigned long long nread = 0, total = 0;
+	size_t s = 0;
+	while (fgets(line, sizeof line, fp) != NULL) {
+		if (strncmp(line, col, strlen(col)) == 0) { // on stderr, so before or after the counts
+			if (sscanf(line + strlen(col), ": read %llu of %llu bytes", &nread, &total) != 2)
+				FAIL("columns: no byte counts in '%s'\n", line);
+			continue;
+		}
+		time_t t = s < nsecs ? secs[s] : 0;
+		strftime(want, sizeof want, "%Y-%m-%dT%H:%M:%SZ", gmtime(&t));
+		snprintf(want + strlen(want), sizeof want - strlen(want), " %llu\n",
+				(unsigned long long)(s < nsecs ? counts[s] : 0));
+		if (s++ == nsecs || strcmp(line, want) != 0)
+			FAIL("columns: count gave '%s' for '%s'\n", line, want);
+	}
+	if (pclose(fp) != 0 || s != nsecs)
+		FAIL("columns: '%s' failed after %zu of %zu seconds\n", cmd, s, nsecs);
+
+	// the row groups, less their site, thread and message chunks
+	struct stat st;
+	unsigned char *buf, *end;
+	if ((fp = fopen(col, "rb")) == NULL || fstat(fileno(fp), &st) == -1 || (buf = malloc(st.st_size)) == NULL
+			|| fread(buf, 1, st.st_size, fp) != (size_t)st.st_size)
+		FAIL("columns: %s: %s\n", col, strerror(errno));
+	fclose(fp);
+	const unsigned char *p = buf + 6;
+	unsigned long long skipped = 0;
+	int groups = 0;
+	end = buf + st.st_size;
+	for (rows = 0; p < end; ++groups) {
+		uint64_t v, len;
+		if (_LOG_getvarint(&p, end, &v) == -1)
+			FAIL("columns: %s: bad row group %d\n", col, groups);
+		rows += v;
+		for (int i = 0; i < 2; ++i)
+			if (_LOG_getvarint(&p, end, &v) == -1)
+				FAIL("columns: %s: bad row group %d\n", col, groups);
+		for (int c = 0; c < 5; ++c) {
+			if (_LOG_getvarint(&p, end, &len) == -1 || len > (uint64_t)(end - p))
+				FAIL("columns: %s: bad chunk %d of row group %d\n", col, c, groups);
+			p += len;
+			skipped += c >= 2 ? len : 0;
+		}
+	}
+	free(buf);
+	if (rows != NCOLUMNS || groups != 2 || total != (unsigned long long)st.st_size || nread != total - skipped)
+		FAIL("columns: %zu rows in %d groups, count read %llu of %llu bytes, %llu of them skippable\n",
+				rows, groups, nread, total, skipped);
+	unlink(bin);
+	unlink(col);
+	return (int)nsecs;
+}
+
+// A format that doesn't fit the budget fails its line, the next ones read fine
+static void dictfail(const char *dir) {
+	char path[64], big[600];
+	snprintf(path, sizeof path, "%s/dict.bin", dir);
+	memset(big, 'b', sizeof big - 1);
+	big[sizeof big - 1] = '\0';
+	LOG_reset();
+	LOG_teebinarypath(path, 0);
+	LOGE("D first %s\n", big); // grows the encoder's buffer past the next line's needs
+	struct LOG_stats st;
+	LOG_stats(&st);
+	LOG_budget(st.memused + 64);
+	LOGE("D a format too long for what is left of the budget, so it can't go to the dictionary: %d"
+			" ............................................................................\n", 1);
+	LOG_budget(0);
+	LOGE("D after %d\n", 2);
+	LOG_reset();
+
+	FILE *fp = fopen(path, "rb");
+	if (fp == NULL)
+		FAIL("dict: %s: %s\n", path, strerror(errno));
+	struct LOG_binreader r;
+	struct LOG_binrecord rec;
+	LOG_binreader_init(&r, fp);
+	if (LOG_binnext(&r, &rec) != 1 || strncmp(rec.text, "(EE): D first", 13) != 0
+			|| LOG_binnext(&r, &rec) != 1 || strcmp(rec.text, "(EE): D after 2\n") != 0
+			|| LOG_binnext(&r, &rec) != 0 || r.verified != ftell(fp))
+		FAIL("dict: the line after a failed dictionary entry was lost\n");
+	LOG_binreader_free(&r);
+	fclose(fp);
+	unlink(path);
+}
+
+/*
+ * Memory budget
+ */
+
+#define NBUDGET     4
+#define BUDGETLOOPS 20000
+#define BUDGETCHUNK (1 << 18)
+
+static void *budgetcharger(void *arg) {
+	(void)arg;
+	for (int i = 0; i < BUDGETLOOPS; ++i) {
+		if (_LOG_memcharge(BUDGETCHUNK) == 0)
+			_LOG_memcharge(-BUDGETCHUNK);
+		if (i % 64 == 0)
+			sched_yield();
+	}
+	return NULL;
+}
+
+// The floor follows the usage however the threads' updates interleave
+static int budget(void) {
+	struct LOG_stats st;
+	LOG_reset();
+	LOG_stats(&st);
+	size_t base = st.memused, cap = base + 4 * BUDGETCHUNK; // 1 chunk: under 75%, 3: over 90%
+	LOG_budget(cap);
+	pthread_t t[NBUDGET];
+	for (int i = 0; i < NBUDGET; ++i)
+		pthread_create(t + i, NULL, budgetcharger, NULL);
+	for (int i = 0; i < NBUDGET; ++i)
+		pthread_join(t[i], NULL);
+	LOG_stats(&st);
+	int floor = __atomic_load_n(&_LOG_memfloor, __ATOMIC_RELAXED);
+	LOG_budget(0);
+	if (st.memused != base || floor != INT_MIN)
+		FAIL("budget: %zu bytes used, %zu before, floor %d\n", st.memused, base, floor);
+	return NBUDGET * BUDGETLOOPS;
+}
+
+int main(int argc, char *argv[]) {
+	unsigned seed = argc > 1 ? strtoul(argv[1], NULL, 0) : 0x5eedu;
+	if (argc > 2)
+		nlines = atoi(argv[2]);
+	if (seed == 0)
+		seed = 1;
+
+	fuzz(seed, 20000);
+	printf("fuzz: ok (seed %u)\n", seed);
+	deferred(seed, 20000);
+	printf("deferred: ok (seed %u)\n", seed);
+	skew(seed);
+	printf("skew: ok, %d CPU offsets recovered\n", SKEWCPUS);
+
+	char dir[] = "/tmp/logtee-stress-XXXXXX";
+	if (mkdtemp(dir) == NULL)
+		FAIL("mkdtemp: %s\n", strerror(errno));
+	for (int i = 0; i < NPATHS; ++i)
+		snprintf(paths[i], sizeof paths[i], "%s/log%d.txt", dir, i);
+	LOG_teepath(paths[0], -1);
+	LOG_metricsfield("checksum", "%s |%08x\n", 2);
+	if ((devnull = fopen("/dev/null", "w")) == NULL)
+		FAIL("/dev/null: %s\n", strerror(errno));
+
+	pthread_t loggers[NLOGGERS], controls[NCONTROL];
+	for (int i = 0; i < NCONTROL; ++i)
+		pthread_create(controls + i, NULL, control, (void *)(intptr_t)i);
+	for (int i = 0; i < NLOGGERS; ++i)
+		pthread_create(loggers + i, NULL, logger, (void *)(intptr_t)i);
+	for (int i = 0; i < NLOGGERS; ++i)
+		pthread_join(loggers[i], NULL);
+	__atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+	for (int i = 0; i < NCONTROL; ++i)
+		pthread_join(controls[i], NULL);
+	LOG_reset();
+	fclose(devnull);
+
+	long total = 0;
+	for (int i = 0; i < NPATHS; ++i) {
+		total += verify(paths[i], i == BINPATH);
+		unlink(paths[i]);
+	}
+	if (total == 0)
+		FAIL("stress: no lines were logged\n");
+	printf("stress: ok, %ld lines verified\n", total);
+
+#if defined(__linux__)
+	follow(dir);
+	printf("follow: ok, %d lines across a rotation\n", NFOLLOW);
+#endif
+	uint64_t got = shmring();
+	printf("ring: ok, %" PRIu64 " of %d lines read, the rest reported lost\n", got, NLOGGERS * RINGLINES);
+	printf("circular: ok, newest %d lines in order\n", circular(dir));
+	got = async(dir);
+	printf("async: ok, Error first, %" PRIu64 " of %d Debug lines in order, the rest dropped\n",
+			got, NASYNC * ASYNCLINES);
+	asynccopy(dir);
+	printf("async: ok, queued lines keep copies of their format and file\n");
+	printf("async: ok, Errors past a full lane of %d written after it\n", asyncorder(dir));
+	trylog(dir);
+	printf("try: ok, never waited for the Tee\n");
+	threadexit(dir);
+	printf("exit: ok, logged from a key destructor after logtee's\n");
+	breaker(dir);
+	printf("breaker: ok, a full pipe paused and recovered\n");
+	printf("memory: ok, %d snapshots in order\n", memring());
+	crc(seed, dir);
+	printf("crc: ok, flipped byte and torn tail caught\n");
+	dictfail(dir);
+	printf("dict: ok, a failed dictionary entry cost only its line\n");
+	printf("columns: ok, Errors over %d seconds counted from 2 of 5 chunks\n", columns(dir));
+	printf("budget: ok, floor right after %d concurrent charges\n", budget());
+	batch(dir);
+	printf("batch: ok, %d lines in order, written and queued\n", NBATCH / 4 * 3 * 2);
+	batchbudget(dir);
+	printf("batch: ok, smaller chunks as the memory budget fills\n");
+	literal(dir);
+	printf("literal: ok, argument-free lines written as is\n");
+	prefixes(dir);
+	printf("prefix: ok, macros skip the level lookup until overridden\n");
+	profile(dir);
+	printf("profile: ok, calls, gated calls and bytes per site, merged by name\n");
+	metricsites();
+	printf("metrics: ok, one series per file:line, counted by %d threads\n", NMETRICS);
+	rmdir(dir);
+	return EXIT_SUCCESS;
+}